@@ -0,0 +1,108 @@
+#include "ast.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+
+#define ARENA_ALIGN       16
+#define ARENA_MIN_CHUNK   (64 * 1024)
+
+
+void *xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        fprintf(stderr, "Fatal error: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+
+static ArenaChunk *new_chunk(size_t size) {
+    ArenaChunk *c = xrealloc(NULL, sizeof(ArenaChunk) + size);
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+
+void arena_init(Arena *a) {
+    a->first = NULL;
+    a->current = NULL;
+}
+
+
+void *arena_alloc(Arena *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    ArenaChunk *c = a->current;
+    if (c && c->used + size <= c->size) {
+        void *p = c->data + c->used;
+        c->used += size;
+        return p;
+    }
+
+    // Reuse a chunk kept from an earlier compilation if it is big enough
+    if (c && c->next && c->next->size >= size) {
+        c = c->next;
+    } else {
+        size_t want = c ? c->size * 2 : ARENA_MIN_CHUNK;
+        if (want < size)
+            want = size;
+
+        ArenaChunk *n = new_chunk(want);
+        if (c) {
+            n->next = c->next;
+            c->next = n;
+        } else {
+            n->next = a->first;
+            a->first = n;
+        }
+        c = n;
+    }
+
+    a->current = c;
+    c->used = size;
+    return c->data;
+}
+
+
+void *arena_calloc(Arena *a, size_t size) {
+    void *p = arena_alloc(a, size);
+    memset(p, 0, size);
+    return p;
+}
+
+
+char *arena_strndup(Arena *a, const char *s, size_t len) {
+    char *p = arena_alloc(a, len + 1);
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+
+char *arena_strdup(Arena *a, const char *s) {
+    return arena_strndup(a, s, strlen(s));
+}
+
+
+void arena_reset(Arena *a) {
+    // Keep every chunk so the next compilation allocates without malloc
+    for (ArenaChunk *c = a->first; c; c = c->next)
+        c->used = 0;
+    a->current = a->first;
+}
+
+
+void arena_free(Arena *a) {
+    ArenaChunk *c = a->first;
+    while (c) {
+        ArenaChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    a->first = NULL;
+    a->current = NULL;
+}
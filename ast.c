@@ -4,156 +4,249 @@
 #include <string.h>
 
 
-static ASTNode *new_node(NodeType type) {
-    ASTNode *node = calloc(1, sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Fatal error: out of memory\n");
-        exit(1);
+void ast_init(AST *t) {
+    memset(t, 0, sizeof(*t));
+    ast_reset(t);
+}
+
+
+void ast_reset(AST *t) {
+    // Arrays are kept for the next compilation, slot 0 stays reserved
+    t->count = 1;
+    t->extra_len = 0;
+    t->pending_len = 0;
+    t->root = NODE_NONE;
+}
+
+
+void ast_free(AST *t) {
+    free(t->kind);
+    free(t->aux);
+    free(t->a);
+    free(t->b);
+    free(t->c);
+    free(t->extra);
+    free(t->pending);
+    memset(t, 0, sizeof(*t));
+}
+
+
+void ast_reserve(AST *t, unsigned nodes, unsigned extra) {
+    if (nodes > t->cap) {
+        unsigned cap = t->cap ? t->cap : 1024;
+        while (cap < nodes)
+            cap *= 2;
+        t->cap = cap;
+        t->kind = xrealloc(t->kind, cap);
+        t->aux = xrealloc(t->aux, cap);
+        t->a = xrealloc(t->a, cap * sizeof(unsigned));
+        t->b = xrealloc(t->b, cap * sizeof(unsigned));
+        t->c = xrealloc(t->c, cap * sizeof(unsigned));
+    }
+
+    if (extra > t->extra_cap) {
+        unsigned cap = t->extra_cap ? t->extra_cap : 1024;
+        while (cap < extra)
+            cap *= 2;
+        t->extra_cap = cap;
+        t->extra = xrealloc(t->extra, cap * sizeof(NodeId));
     }
-    node->type = type;
-    return node;
 }
 
 
+static NodeId new_node(AST *t, NodeType kind, int aux,
+                       unsigned a, unsigned b, unsigned c) {
+    if (t->count >= t->cap)
+        ast_reserve(t, t->count + 1, 0);
+
+    NodeId n = t->count++;
+    STAT_ADD(nodes[kind], 1);
+    t->kind[n] = kind;
+    t->aux[n] = aux;
+    t->a[n] = a;
+    t->b[n] = b;
+    t->c[n] = c;
+    return n;
+}
+
+
+static unsigned push_extra(AST *t, const NodeId *ids, unsigned count) {
+    if (t->extra_len + count > t->extra_cap)
+        ast_reserve(t, 0, t->extra_len + count);
+
+    unsigned first = t->extra_len;
+    memcpy(t->extra + first, ids, count * sizeof(NodeId));
+    t->extra_len += count;
+    return first;
+}
+
+
+
+unsigned ast_list_begin(AST *t) {
+    return t->pending_len;
+}
+
+void ast_list_push(AST *t, NodeId stmt) {
+    if (t->pending_len == t->pending_cap) {
+        t->pending_cap = t->pending_cap ? t->pending_cap * 2 : 256;
+        t->pending = xrealloc(t->pending, t->pending_cap * sizeof(NodeId));
+    }
+    t->pending[t->pending_len++] = stmt;
+}
+
+
+// Nested lists are closed before their parent goes on, so the open
+// list always sits at the top of the pending stack
+static NodeId close_list(AST *t, NodeType kind, unsigned mark) {
+    unsigned count = t->pending_len - mark;
+    unsigned first = push_extra(t, t->pending + mark, count);
+    t->pending_len = mark;
+    return new_node(t, kind, 0, first, count, 0);
+}
 
-ASTNode *make_stmt_list(ASTNode *l, ASTNode *r) {
-    ASTNode *node = new_node(NODE_STMT_LIST);
-    node->left = l;
-    node->right = r;
-    return node;
+NodeId make_stmt_list(AST *t, unsigned mark) {
+    return close_list(t, NODE_STMT_LIST, mark);
 }
 
-ASTNode *make_decl(char *name, ASTNode *expr) {
-    ASTNode *node = new_node(NODE_DECL);
-    node->name = strdup(name);
-    node->left = expr;
-    return node;
+NodeId make_decl(AST *t, Atom name, NodeId expr) {
+    return new_node(t, NODE_DECL, 0, name, expr, 0);
 }
 
-ASTNode *make_print(ASTNode *expr) {
-    ASTNode *node = new_node(NODE_PRINT);
-    node->left = expr;
-    return node;
+NodeId make_print(AST *t, NodeId expr) {
+    return new_node(t, NODE_PRINT, 0, expr, 0, 0);
 }
 
-ASTNode *make_if(ASTNode *cond, ASTNode *body, ASTNode *else_body) {
-    ASTNode *node = new_node(NODE_IF);
-    node->cond = cond;
-    node->body = body;
-    node->else_body = else_body;
-    return node;
+NodeId make_if(AST *t, NodeId cond, NodeId body, NodeId else_body) {
+    return new_node(t, NODE_IF, 0, cond, body, else_body);
 }
 
-ASTNode *make_for(char *var, ASTNode *from, ASTNode *to, ASTNode *body) {
-    ASTNode *node = new_node(NODE_FOR);
-    node->name = strdup(var);
-    node->left = from;
-    node->right = to;
-    node->body = body;
-    return node;
+NodeId make_for(AST *t, Atom var, NodeId from, NodeId to, NodeId body) {
+    NodeId rest[2] = { to, body };
+    return new_node(t, NODE_FOR, 0, var, from, push_extra(t, rest, 2));
 }
 
-ASTNode *make_block(ASTNode *stmts) {
-    ASTNode *node = new_node(NODE_BLOCK);
-    node->body = stmts;
-    return node;
+NodeId make_block(AST *t, unsigned mark) {
+    return close_list(t, NODE_BLOCK, mark);
 }
 
 
 
-ASTNode *make_binop(char op, ASTNode *l, ASTNode *r) {
-    ASTNode *node = new_node(NODE_BINOP);
-    node->op = op;
-    node->left = l;
-    node->right = r;
-    return node;
+NodeId make_binop(AST *t, char op, NodeId l, NodeId r) {
+    return new_node(t, NODE_BINOP, op, l, r, 0);
 }
 
-ASTNode *make_id(char *name) {
-    ASTNode *node = new_node(NODE_ID);
-    node->name = strdup(name);
-    return node;
+NodeId make_id(AST *t, Atom name) {
+    return new_node(t, NODE_ID, 0, name, 0, 0);
 }
 
 
 
-ASTNode *make_int(int v) {
-    ASTNode *node = new_node(NODE_LITERAL);
-    node->vtype = TYPE_INT;
-    node->ival = v;
-    return node;
+NodeId make_int(AST *t, int v) {
+    return new_node(t, NODE_LITERAL, TYPE_INT, (unsigned)v, 0, 0);
 }
 
-ASTNode *make_float(float v) {
-    ASTNode *node = new_node(NODE_LITERAL);
-    node->vtype = TYPE_FLOAT;
-    node->fval = v;
-    return node;
+NodeId make_float(AST *t, float v) {
+    unsigned bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return new_node(t, NODE_LITERAL, TYPE_FLOAT, bits, 0, 0);
 }
 
-ASTNode *make_char(char v) {
-    ASTNode *node = new_node(NODE_LITERAL);
-    node->vtype = TYPE_CHAR;
-    node->cval = v;
-    return node;
+NodeId make_char(AST *t, char v) {
+    return new_node(t, NODE_LITERAL, TYPE_CHAR, (unsigned char)v, 0, 0);
 }
 
-ASTNode *make_string(char *v) {
-    ASTNode *node = new_node(NODE_LITERAL);
-    node->vtype = TYPE_STRING;
-    node->sval = strdup(v);
-    return node;
+NodeId make_string(AST *t, Atom v) {
+    return new_node(t, NODE_LITERAL, TYPE_STRING, v, 0, 0);
 }
 
 
-void free_ast(ASTNode *node) {
-    if (!node) return;
+// Fields are read into locals first: new nodes may move the arrays
+NodeId ast_clone(AST *t, NodeId n) {
+    if (!n) return n;
 
+    NodeType kind = t->kind[n];
+    int aux = t->aux[n];
+    unsigned a = t->a[n], b = t->b[n], c = t->c[n];
 
-    switch (node->type) {
+    switch (kind) {
         case NODE_STMT_LIST:
-        case NODE_BINOP:
-            free_ast(node->left);
-            free_ast(node->right);
-            break;
+        case NODE_BLOCK: {
+            unsigned mark = ast_list_begin(t);
+            for (unsigned i = 0; i < b; i++)
+                ast_list_push(t, ast_clone(t, t->extra[a + i]));
+            return close_list(t, kind, mark);
+        }
 
         case NODE_DECL:
-            free(node->name);
-            free_ast(node->left);
-            break;
+            return make_decl(t, a, ast_clone(t, b));
+
+        case NODE_PRINT: {
+            NodeId p = make_print(t, ast_clone(t, a));
+            t->aux[p] = aux;
+            return p;
+        }
+
+        case NODE_IF: {
+            NodeId cond = ast_clone(t, a);
+            NodeId body = ast_clone(t, b);
+            return make_if(t, cond, body, ast_clone(t, c));
+        }
+
+        case NODE_FOR: {
+            NodeId from = ast_clone(t, b);
+            NodeId to = ast_clone(t, t->extra[c]);
+            NodeId body = ast_clone(t, t->extra[c + 1]);
+            return make_for(t, a, from, to, body);
+        }
+
+        case NODE_BINOP: {
+            NodeId l = ast_clone(t, a);
+            return make_binop(t, aux, l, ast_clone(t, b));
+        }
+
+        default:
+            return new_node(t, kind, aux, a, b, c);
+    }
+}
+
+
+unsigned ast_size(const AST *t, NodeId n) {
+    if (!n) return 0;
+
+    switch (t->kind[n]) {
+        case NODE_STMT_LIST:
+        case NODE_BLOCK: {
+            unsigned size = 1;
+            for (unsigned i = 0; i < t->b[n]; i++)
+                size += ast_size(t, t->extra[t->a[n] + i]);
+            return size;
+        }
+
+        case NODE_DECL:
+            return 1 + ast_size(t, t->b[n]);
 
         case NODE_PRINT:
-            free_ast(node->left);
-            break;
+            return 1 + ast_size(t, t->a[n]);
 
         case NODE_IF:
-            free_ast(node->cond);
-            free_ast(node->body);
-            free_ast(node->else_body);
-            break;
+        case NODE_BINOP:
+            return 1 + ast_size(t, t->a[n]) + ast_size(t, t->b[n]) +
+                   (t->kind[n] == NODE_IF ? ast_size(t, t->c[n]) : 0);
 
         case NODE_FOR:
-            free(node->name);
-            free_ast(node->left);
-            free_ast(node->right);
-            free_ast(node->body);
-            break;
-
-        case NODE_BLOCK:
-            free_ast(node->body);
-            break;
-
-        case NODE_ID:
-            free(node->name);
-            break;
+            return 1 + ast_size(t, t->b[n]) + ast_size(t, ast_for_to(t, n)) +
+                   ast_size(t, ast_for_body(t, n));
 
-        case NODE_LITERAL:
-            if (node->vtype == TYPE_STRING)
-                free(node->sval);
-            break;
+        default:
+            return 1;
     }
+}
 
-    free(node);
+
+float ast_float(const AST *t, NodeId n) {
+    float v;
+    memcpy(&v, &t->a[n], sizeof(v));
+    return v;
 }
 
 
@@ -163,84 +256,82 @@ static void indent_print(int level) {
 }
 
 
-void print_ast(ASTNode *node, int indent) {
-    if (!node) return;
+void print_ast(const AST *t, NodeId n, int indent) {
+    if (!n) return;
 
     indent_print(indent);
 
-    switch (node->type) {
+    switch (t->kind[n]) {
         case NODE_STMT_LIST:
-            printf("STMT_LIST\n");
-            print_ast(node->left, indent + 1);
-            print_ast(node->right, indent + 1);
+        case NODE_BLOCK: {
+            printf("%s\n", t->kind[n] == NODE_BLOCK ? "BLOCK" : "STMT_LIST");
+            const NodeId *items = ast_items(t, n);
+            for (unsigned i = 0; i < t->b[n]; i++)
+                print_ast(t, items[i], indent + 1);
             break;
+        }
 
         case NODE_DECL:
-            printf("DECL %s\n", node->name);
-            print_ast(node->left, indent + 1);
+            printf("DECL %s\n", atom_str(t->a[n]));
+            print_ast(t, t->b[n], indent + 1);
             break;
 
         case NODE_PRINT:
             printf("PRINT\n");
-            print_ast(node->left, indent + 1);
+            print_ast(t, t->a[n], indent + 1);
             break;
 
         case NODE_IF:
             printf("IF\n");
             indent_print(indent + 1);
             printf("COND\n");
-            print_ast(node->cond, indent + 2);
+            print_ast(t, t->a[n], indent + 2);
             indent_print(indent + 1);
             printf("BODY\n");
-            print_ast(node->body, indent + 2);
-            if (node->else_body) {
+            print_ast(t, t->b[n], indent + 2);
+            if (t->c[n]) {
                 indent_print(indent + 1);
                 printf("ELSE\n");
-                print_ast(node->else_body, indent + 2);
+                print_ast(t, t->c[n], indent + 2);
             }
             break;
 
         case NODE_FOR:
-            printf("FOR %s\n", node->name);
+            printf("FOR %s\n", atom_str(t->a[n]));
             indent_print(indent + 1);
             printf("FROM\n");
-            print_ast(node->left, indent + 2);
+            print_ast(t, t->b[n], indent + 2);
             indent_print(indent + 1);
             printf("TO\n");
-            print_ast(node->right, indent + 2);
+            print_ast(t, ast_for_to(t, n), indent + 2);
             indent_print(indent + 1);
             printf("BODY\n");
-            print_ast(node->body, indent + 2);
-            break;
-
-        case NODE_BLOCK:
-            printf("BLOCK\n");
-            print_ast(node->body, indent + 1);
+            print_ast(t, ast_for_body(t, n), indent + 2);
             break;
 
         case NODE_BINOP:
-            printf("BINOP '%c'\n", node->op);
-            print_ast(node->left, indent + 1);
-            print_ast(node->right, indent + 1);
+            printf("BINOP '%c'\n", t->aux[n]);
+            print_ast(t, t->a[n], indent + 1);
+            print_ast(t, t->b[n], indent + 1);
             break;
 
         case NODE_ID:
-            printf("ID %s\n", node->name);
+            printf("ID %s\n", atom_str(t->a[n]));
             break;
 
         case NODE_LITERAL:
-            switch (node->vtype) {
+            switch (t->aux[n]) {
                 case TYPE_INT:
-                    printf("INT %d\n", node->ival);
+                    printf("INT %d\n", (int)t->a[n]);
                     break;
                 case TYPE_FLOAT:
-                    printf("FLOAT %f\n", node->fval);
+                    printf("FLOAT %f\n", ast_float(t, n));
                     break;
                 case TYPE_CHAR:
-                    printf("CHAR '%c'\n", node->cval);
+                    printf("CHAR '%c'\n", (char)t->a[n]);
                     break;
                 case TYPE_STRING:
-                    printf("STRING \"%s\"\n", node->sval);
+                    printf("STRING \"%s\"\n", atom_str(t->a[n]));
                     break;
             }
             break;
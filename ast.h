@@ -1,6 +1,60 @@
 #ifndef AST_H
 #define AST_H
 
+#include <stddef.h>
+#include <stdio.h>
+
+
+/* Everything one compilation owns, see compiler.h at the end */
+typedef struct CompilerContext CompilerContext;
+
+
+/* --- From arena.h --- */
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    _Alignas(16) unsigned char data[];
+} ArenaChunk;
+
+
+typedef struct Arena {
+    ArenaChunk *first;
+    ArenaChunk *current;
+} Arena;
+
+
+/* realloc that exits with "Fatal error: out of memory" when it fails */
+void *xrealloc(void *p, size_t size);
+
+void arena_init(Arena *a);
+void *arena_alloc(Arena *a, size_t size);
+void *arena_calloc(Arena *a, size_t size);
+char *arena_strdup(Arena *a, const char *s);
+char *arena_strndup(Arena *a, const char *s, size_t len);
+void arena_reset(Arena *a);
+void arena_free(Arena *a);
+
+
+/* --- From intern.h --- */
+
+/* Stable id of an interned identifier or string literal, 0 = none */
+typedef int Atom;
+
+#define ATOM_NONE 0
+
+Atom intern(const char *s, size_t len);
+Atom intern_cstr(const char *s);
+const char *atom_str(Atom a);
+unsigned atom_len(Atom a);
+unsigned atom_hash(Atom a);
+int atom_count(void);
+
+/* Drops the calling thread's table. Every atom it handed out is invalid
+   afterwards; the next intern starts again from 1. */
+void intern_free(void);
+
 
 typedef enum {
     NODE_STMT_LIST,
@@ -23,49 +77,178 @@ typedef enum {
 } ValueType;
 
 
-typedef struct ASTNode {
-    NodeType type;
-    ValueType vtype;
+/*
+ * The tree is stored as parallel arrays indexed by NodeId; index 0 is
+ * never a real node and stands for "no node". What a, b and c hold
+ * depends on the kind:
+ *
+ *   kind            aux         a               b           c
+ *   NODE_STMT_LIST              first (extra)   count
+ *   NODE_BLOCK                  first (extra)   count
+ *   NODE_DECL                   name (Atom)     expr
+ *   NODE_PRINT      ValueType   expr
+ *   NODE_IF                     cond            body        else_body
+ *   NODE_FOR                    var (Atom)      from        to/body (extra)
+ *   NODE_BINOP      op          left            right
+ *   NODE_ID                     name (Atom)
+ *   NODE_LITERAL    ValueType   value bits (int, float, char or Atom)
+ *
+ * Statement lists are contiguous ranges of `extra`, so passes walk them
+ * with a loop instead of recursing once per statement.
+ */
+typedef unsigned NodeId;
 
-    char op;
-    char *name;
+#define NODE_NONE 0
+
+
+typedef struct AST {
+    unsigned char *kind;
+    unsigned char *aux;
+    unsigned *a;
+    unsigned *b;
+    unsigned *c;
+    unsigned count;
+    unsigned cap;
+
+    NodeId *extra;
+    unsigned extra_len;
+    unsigned extra_cap;
+
+    NodeId *pending;        // statements of the lists still being parsed
+    unsigned pending_len;
+    unsigned pending_cap;
+
+    NodeId root;
+} AST;
+
+
+/* Statement lists: open one, push statements, then close it */
+unsigned ast_list_begin(AST *t);
+void ast_list_push(AST *t, NodeId stmt);
+
+NodeId make_stmt_list(AST *t, unsigned mark);
+NodeId make_decl(AST *t, Atom name, NodeId expr);
+NodeId make_print(AST *t, NodeId expr);
+NodeId make_if(AST *t, NodeId cond, NodeId body, NodeId else_body);
+NodeId make_for(AST *t, Atom var, NodeId from, NodeId to, NodeId body);
+NodeId make_block(AST *t, unsigned mark);
+
+
+NodeId make_binop(AST *t, char op, NodeId l, NodeId r);
+NodeId make_id(AST *t, Atom name);
+
+
+NodeId make_int(AST *t, int v);
+NodeId make_float(AST *t, float v);
+NodeId make_char(AST *t, char v);
+NodeId make_string(AST *t, Atom v);
+
+
+static inline const NodeId *ast_items(const AST *t, NodeId n) {
+    return t->extra + t->a[n];
+}
+
+static inline NodeId ast_for_to(const AST *t, NodeId n) {
+    return t->extra[t->c[n]];
+}
+
+static inline NodeId ast_for_body(const AST *t, NodeId n) {
+    return t->extra[t->c[n] + 1];
+}
+
+float ast_float(const AST *t, NodeId n);
+
+/* Deep copy of a subtree, and its number of nodes */
+NodeId ast_clone(AST *t, NodeId n);
+unsigned ast_size(const AST *t, NodeId n);
+
+
+void ast_init(AST *t);
+void ast_reset(AST *t);
+void ast_free(AST *t);
+
+/* Grows the arrays to hold at least this many nodes and extra slots */
+void ast_reserve(AST *t, unsigned nodes, unsigned extra);
 
-    int ival;
-    float fval;
-    char cval;
-    char *sval;
 
-    struct ASTNode *left;
-    struct ASTNode *right;
+void print_ast(const AST *t, NodeId n, int indent);
 
-    struct ASTNode *cond;
-    struct ASTNode *body;
-    struct ASTNode *else_body;
-} ASTNode;
 
+/* --- From lexer.h --- */
 
-ASTNode *make_stmt_list(ASTNode *l, ASTNode *r);
-ASTNode *make_decl(char *name, ASTNode *expr);
-ASTNode *make_print(ASTNode *expr);
-ASTNode *make_if(ASTNode *cond, ASTNode *body, ASTNode *else_body);
-ASTNode *make_for(char *var, ASTNode *from, ASTNode *to, ASTNode *body);
-ASTNode *make_block(ASTNode *stmts);
+/* The scanner to use. LEX_FAST is the hand-written one in fastlex.c with
+   the widest vector code the CPU has, the next two cap that, and
+   LEX_FLEX is the one generated from lexer.l, the reference */
+typedef enum {
+    LEX_FAST,
+    LEX_FAST_SSE2,
+    LEX_FAST_SCALAR,
+    LEX_FLEX
+} LexerKind;
+
+typedef struct FastLexer {
+    const char *src;
+    size_t len;
+    size_t pos;
+    size_t start;                   // of the last token
+    size_t comment_end;             // past the last '>'
+    const struct Kernels *kernels;  // vector or plain loops
+    char *scratch;                  // unescaped strings, number texts
+    size_t scratch_cap;
+} FastLexer;
+
+/* The scanners are reentrant; their state lives in the context */
+void lex_init(CompilerContext *ctx);
+void lex_free(CompilerContext *ctx);
+
+/* Makes ctx->lexer read src, which must outlive the parse */
+void lex_set_input(CompilerContext *ctx, const char *src, size_t len);
+
+/* Where the token yylex returned last is in the source */
+void lex_span(CompilerContext *ctx, unsigned *offset, unsigned *length);
+
+/* Reports an unrecognized character, or keeps it as a token in lex_all */
+void lex_error(CompilerContext *ctx, char c);
 
+void fast_lex_set_input(FastLexer *lx, const char *src, size_t len, LexerKind kind);
+void fast_lex_free(FastLexer *lx);
 
-ASTNode *make_binop(char op, ASTNode *l, ASTNode *r);
-ASTNode *make_id(char *name);
+/* "avx2", "sse2" or "plain": the loops the fast scanner uses for kind */
+const char *fast_lex_kernels(LexerKind kind);
 
 
-ASTNode *make_int(int v);
-ASTNode *make_float(float v);
-ASTNode *make_char(char v);
-ASTNode *make_string(char *v);
+/* --- From parse.h --- */
 
+typedef enum {
+    PARSER_FAST,        // token array and recursive descent, parse.c
+    PARSER_BISON        // parser.y, the reference
+} ParserKind;
+
+/* The value of a token, as in the parser's %union */
+typedef union TokenValue {
+    int ival;
+    float fval;
+    char cval;
+    Atom atom;
+} TokenValue;
 
-void free_ast(ASTNode *node);
+/* One token of a source lexed ahead of parsing */
+typedef struct Token {
+    short kind;                 // parser.tab.h number, 0 at the end
+    int line;                   // ctx->line_no once it was read
+    unsigned offset, length;    // in the source
+    TokenValue value;
+} Token;
 
+#define TOKEN_LEX_ERROR (-1)    // an unrecognized character, value.cval
 
-void print_ast(ASTNode *node, int indent);
+/* Lexes all of src into ctx->tokens with ctx->lexer, the first line
+   numbered line. Lexical errors become tokens instead of messages */
+void lex_all(CompilerContext *ctx, const char *src, size_t len, int line);
+
+/* Parses src into ctx->ast with ctx->parser; returns 0 on success, and
+   reports errors, exactly as yyparse does */
+int parse_source(CompilerContext *ctx, const char *src, size_t len, int line);
 
 
 /* --- From symbol.h --- */
@@ -79,28 +262,633 @@ typedef enum {
 
 
 typedef struct Symbol {
-    char *name;
+    Atom name;
     SymbolType type;
     int scope_level;
-    struct Symbol *next;
+    struct Symbol *shadowed;    // outer binding of the same name
 } Symbol;
 
 
-void sym_enter_scope(void);
-void sym_exit_scope(void);
+typedef struct SymSlot SymSlot;
+
+typedef struct SymbolTable {
+    SymSlot *slots;
+    unsigned slot_mask;
+    unsigned slot_used;
+
+    Symbol **undo;              // symbols in declaration order
+    int undo_len;
+    int undo_cap;
+
+    int *scope_marks;           // undo_len at entry of each scope
+    int marks_cap;
+    int current_scope;
+
+    Arena records;              // the Symbol structs
+} SymbolTable;
+
+
+void sym_init(SymbolTable *st);
+void sym_free(SymbolTable *st);
+void sym_reset(SymbolTable *st);
+void sym_enter_scope(SymbolTable *st);
+void sym_exit_scope(SymbolTable *st);
+
+
+/* 0 if the name is already declared in the current scope */
+int sym_insert(SymbolTable *st, Atom name, SymbolType type);
+Symbol *sym_lookup(const SymbolTable *st, Atom name);
+
+
+/* Checks ctx->ast; returns the number of errors */
+int semantic_check(CompilerContext *ctx);
+
+/* The same one top-level statement at a time: begin, check each, end */
+void semantic_begin(CompilerContext *ctx);
+void semantic_check_stmt(CompilerContext *ctx, NodeId n);
+int semantic_end(CompilerContext *ctx);
+
+
+/* --- From opt.h --- */
+
+/* Folds constants, propagates let values and drops dead if branches */
+void optimize(AST *t);
+
+/* --- From ir.h --- */
+
+/*
+ * Three-address IR in SSA form. A program is one function: a list of
+ * basic blocks, block 0 is the entry. Every value is defined exactly
+ * once, by an instruction or a phi, and named by its id (v1, v2, ...).
+ * Operands are values, 16-bit constants or string literals.
+ *
+ * Each block holds its phis apart from its instructions, and the last
+ * instruction is the terminator: IR_JMP to succ[0], IR_BR on a to
+ * succ[0] (true) or succ[1] (false), or IR_RET. Phi arguments are in
+ * the same order as the block's preds.
+ */
+typedef enum {
+    IR_NOP,
+    IR_COPY,        // dst = a
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,         // unsigned, like the 8086 div
+    IR_POW,
+    IR_SHL,         // dst = a << b, b constant
+    IR_SHR,
+    IR_GT,          // dst = a > b ? 1 : 0, signed
+    IR_LT,
+    IR_GE,
+    IR_LE,
+    IR_EQ,
+    IR_NE,
+    IR_PHI,
+    IR_PRINT,       // print a as a number
+    IR_PRINTS,      // print the string a
+    IR_JMP,
+    IR_BR,
+    IR_RET
+} IrOp;
+
+
+typedef enum {
+    ARG_NONE,
+    ARG_VAL,
+    ARG_CONST,
+    ARG_STR         // val = string Atom
+} IrArgKind;
+
+
+typedef struct IrArg {
+    unsigned char kind;
+    int val;
+} IrArg;
+
+
+typedef struct IrInst {
+    unsigned char op;
+    int dst;                // value defined, 0 = none
+    IrArg a;
+    IrArg b;
+    IrArg *phi;             // IR_PHI: one argument per predecessor
+} IrInst;
+
+
+typedef struct IrBlock {
+    IrInst *phis;
+    int nphis;
+    int phi_cap;
+
+    IrInst *insts;
+    int len;
+    int cap;
+
+    int *preds;
+    int npreds;
+    int pred_cap;
+
+    int succ[2];
+    int nsucc;
 
+    int idom;               // immediate dominator, -1 for the entry
+    int order;              // index in rpo, -1 when unreachable
+    unsigned char sealed;   // all predecessors known (construction)
+} IrBlock;
 
-void sym_insert(const char *name, SymbolType type);
-Symbol *sym_lookup(const char *name);
 
+typedef struct IrFunc {
+    IrBlock *blocks;
+    int nblocks;
+    int block_cap;
 
-void semantic_check(ASTNode *root);
+    int *rpo;               // reachable blocks in reverse postorder
+    int nrpo;
 
+    int nvals;              // values are 1 .. nvals - 1
+    Atom *val_var;          // variable a value was assigned to, for dumps
+    int val_cap;
 
-extern int semantic_errors;
+    Arena arena;            // phi argument arrays
+} IrFunc;
+
+
+static inline int ir_is_compare(int op) {
+    return op >= IR_GT && op <= IR_NE;
+}
+
+/* Instructions without side effects, safe to share */
+static inline int ir_is_pure(int op) {
+    return op >= IR_COPY && op <= IR_NE;
+}
+
+/* Safe to remove, fold or move too: a division traps unless its divisor
+ * is a nonzero constant */
+static inline int ir_is_removable(const IrInst *in) {
+    if (in->op == IR_DIV)
+        return in->b.kind == ARG_CONST && in->b.val != 0;
+    return ir_is_pure(in->op);
+}
+
+static inline int ir_is_terminator(int op) {
+    return op >= IR_JMP;
+}
+
+static inline IrArg ir_val(int v) {
+    IrArg a = { ARG_VAL, v };
+    return a;
+}
+
+static inline IrArg ir_const(int c) {
+    IrArg a = { ARG_CONST, (short)c };
+    return a;
+}
+
+
+void ir_init(IrFunc *f);
+void ir_reset(IrFunc *f);
+void ir_free(IrFunc *f);
+
+/* Builds SSA form for t->root directly while lowering */
+void ir_lower(IrFunc *f, const AST *t);
+
+int ir_new_block(IrFunc *f);
+int ir_new_value(IrFunc *f, Atom var);
+IrInst *ir_emit(IrFunc *f, int block, IrOp op, int dst, IrArg a, IrArg b);
+void ir_add_edge(IrFunc *f, int from, int to);
+void ir_remove_edge(IrFunc *f, int from, int to);
+
+/* Recomputes rpo/order, then idom; unreachable blocks get order -1 */
+void ir_compute_order(IrFunc *f);
+void ir_compute_dominators(IrFunc *f);
+int ir_dominates(const IrFunc *f, int a, int b);
+
+/* Folds a pure operation on constants; returns 0 if it cannot */
+int ir_fold(int op, int a, int b, int *result);
+
+void ir_dump(const IrFunc *f, FILE *out);
+
+
+/* Pass manager, run between lowering and instruction selection */
+void ir_optimize(IrFunc *f);
+
+/* Replaces the pipeline with a comma-separated list of pass names.
+   Returns 0 and leaves the pipeline alone if a name is unknown. */
+int ir_set_passes(const char *list);
+
+/* Prints the time each pass took, summed over every run */
+void ir_report_times(FILE *out);
+
+/* --- From outbuf.h --- */
+
+typedef struct OutBuf {
+    char *data;
+    size_t len;
+    size_t cap;
+} OutBuf;
+
+
+void ob_init(OutBuf *ob);
+void ob_reset(OutBuf *ob);
+void ob_free(OutBuf *ob);
+void ob_reserve(OutBuf *ob, size_t n);
+void ob_write(OutBuf *ob, const char *s, size_t n);
+void ob_puts(OutBuf *ob, const char *s);
+void ob_putc(OutBuf *ob, char c);
+void ob_int(OutBuf *ob, int v);
+int ob_fwrite(const OutBuf *ob, FILE *f);
+int ob_save(const OutBuf *ob, const char *path);
+
+
+/* --- From diag.h --- */
+
+/* Status lines go to stdout and errors to stderr, or both into
+   ctx->msgs when it is set */
+void diag_status(CompilerContext *ctx, const char *fmt, ...);
+void diag_error(CompilerContext *ctx, const char *fmt, ...);
+
+
+/* --- From insn.h --- */
+
+/*
+ * The code generator builds the program body as a list of instructions
+ * rather than text, so the peephole pass can rewrite it before it is
+ * printed. Deleted instructions become I_NOP until the list is compacted.
+ */
+typedef enum {
+    I_NOP,
+    I_LABEL,
+    I_MOV,
+    I_ADD,
+    I_SUB,
+    I_CMP,
+    I_XOR,
+    I_SHL,
+    I_SHR,
+    I_MUL,
+    I_IMUL,         // two-operand form, x86-64 only
+    I_DIV,
+    I_MOVSX,        // dst = sign-extended low word of src, x86-64 only
+    I_MOVZX,        // dst = zero-extended low word of src, x86-64 only
+    I_INC,
+    I_PUSH,
+    I_POP,
+    I_CALL,
+    I_INT,
+    I_JMP,
+    I_JE,
+    I_JNE,
+    I_JG,
+    I_JGE,
+    I_JL,
+    I_JLE
+} InsnOp;
+
+
+typedef enum {
+    O_NONE,
+    O_REG,          // val = Reg
+    O_IMM,          // val = value
+    O_TMP,          // val = spill slot
+    O_STR,          // val = string index, printed as offset STR_n
+    O_LABEL,        // val = label id, lbl = LabelKind
+    O_PROC          // val = Proc
+} OperandKind;
+
+
+typedef enum {
+    AX, BX, CX, DX, SI, DI, AH,
+    R8, R9, R10, R11, R12, R13, R14, R15,   // x86-64 only
+    NUM_REGS
+} Reg;
+
+typedef enum {
+    LBL_BLOCK,      // id = IR block
+    LBL_EDGE,       // phi copies on a branch edge
+    LBL_CMP_END,
+    LBL_EXIT,
+    LBL_KINDS
+} LabelKind;
+
+typedef enum { PROC_PRINT_INT, PROC_POW_INT, PROC_PRINT_STR } Proc;
+
+
+typedef struct Operand {
+    unsigned char kind;
+    unsigned char lbl;
+    int val;
+} Operand;
+
+
+typedef struct Insn {
+    unsigned char op;
+    Operand dst;
+    Operand src;
+} Insn;
+
+
+typedef struct InsnList {
+    Insn *items;
+    int len;
+    int cap;
+} InsnList;
+
+
+static inline int insn_is_jump(int op) {
+    return op >= I_JMP;
+}
+
+/* Labels of all kinds share one dense key space */
+static inline int label_key(const Operand *o) {
+    return o->val * LBL_KINDS + o->lbl;
+}
+
+/* --- From peephole.h --- */
+
+/* Rewrites code in place with the enabled rules until nothing fires */
+void peephole(InsnList *code);
+
+/* Enables or disables a rule by name, or every rule with "all".
+   Returns 0 if there is no such rule. */
+int peephole_set_rule(const char *name, int enabled);
+
+/* Prints how often each rule fired since the last peephole_reset_stats */
+void peephole_report(FILE *f);
+void peephole_reset_stats(void);
 
 /* --- From codegen.h --- */
 
-void generate_code(ASTNode *root, const char *outfile);
+typedef enum {
+    TARGET_8086,        // 16-bit MASM text for DOS
+    TARGET_X64          // x86-64 GNU assembler text for Linux
+} Target;
+
+/* Appends assembly for f to ob; f is taken out of SSA on the way */
+void generate_code(IrFunc *f, OutBuf *ob, Target target);
+
+/* Compiles f for x86-64 and runs it in this process, writing what it
+   prints to out. Returns -1 if it cannot run on this host and 1 after
+   a runtime error. */
+int run_code(IrFunc *f, FILE *out);
+
+/* --- From mapfile.h --- */
+
+/* Maps a whole file read-only; NULL if it cannot, or if it is empty */
+void *map_file(const char *path, size_t *size);
+void unmap_file(void *p, size_t size);
+
+
+/* --- From cache.h --- */
+
+typedef struct CacheFile {
+    char *path;
+    unsigned long long hash;        // of the source text
+    const char *src;                // stored with the tree by cache_save
+    size_t src_len;
+    void *map;                      // NULL on a miss
+    size_t size;
+    Atom *remap;                    // stored atom -> atom in this process
+    int same_atoms;                 // remap is the identity
+} CacheFile;
+
+/* Looks up the entry for src in dir and returns 1 on a hit. On a miss
+   cf still names the entry, for cache_save. */
+int cache_open(CacheFile *cf, const char *dir, const char *src, size_t len);
+void cache_close(CacheFile *cf);
+
+/* Points view at the tree inside the mapping, read-only. Returns 0 if
+   the atoms had to be renumbered; cache_load works in every case. */
+int cache_view(const CacheFile *cf, AST *view);
+void cache_load(const CacheFile *cf, AST *t);
+
+/* Stores t, straight after a successful semantic_check */
+int cache_save(const CacheFile *cf, const AST *t);
+
+/* --- From x64.h --- */
+
+/* Prints the selected code as a complete x86-64 program with _start
+   and the runtime it calls */
+void x64_write(OutBuf *ob, const InsnList *code, const Atom *strings,
+               int nstrings, int spills, int uses_pow);
+
+/* --- From jit.h --- */
+
+/* Encodes the selected x86-64 code into executable memory and calls it.
+   Returns -1 for a host or an instruction the encoder does not handle,
+   1 after a division by zero. */
+int jit_run(const InsnList *code, const Atom *strings, int nstrings,
+            int spills, FILE *out);
+
+/* --- From vm.h --- */
+
+/* Register bytecode for the interpreter; what a, b and c mean depends
+   on the opcode, see vm.c */
+typedef struct VmInsn {
+    int op;
+    int a;
+    int b;
+    int c;
+} VmInsn;
+
+
+typedef struct VmProgram {
+    VmInsn *code;
+    int len;
+    int cap;
+
+    Atom *strings;
+    int nstrings;
+    int str_cap;
+
+    int nregs;
+} VmProgram;
+
+
+void vm_init(VmProgram *p);
+void vm_free(VmProgram *p);
+
+/* Translates a checked tree into bytecode */
+void vm_compile(VmProgram *p, const AST *t);
+
+/* Runs p, printing to out. Returns 1 after a runtime error. */
+int vm_run(const VmProgram *p, FILE *out);
+
+
+/* --- From stats.h --- */
+
+/*
+ * --stats: wall and CPU time per phase and counts of the work done, for
+ * the compilations on this thread since stats_reset. The hooks in the
+ * hot paths are macros that update a thread-local struct; without
+ * NOVA_STATS they and stats.c compile to nothing.
+ */
+typedef enum {
+    PHASE_NONE = -1,
+    PHASE_LEX,          // lex_all; with bison lexing is part of parse
+    PHASE_PARSE,
+    PHASE_CHECK,        // semantic_check
+    PHASE_FOLD,         // optimize on the tree
+    PHASE_IR,           // lowering and the IR passes
+    PHASE_SELECT,       // register allocation, selection, peephole
+    PHASE_EMIT,         // data section and code as text or machine code
+    PHASE_RUN,          // --run and --interpret
+    NUM_PHASES
+} Phase;
+
+#define NUM_NODE_KINDS (NODE_ID + 1)
+
+#if defined(NOVA_STATS)
+
+typedef struct CompileStats {
+    double wall[NUM_PHASES];        // seconds
+    double cpu[NUM_PHASES];
+    unsigned long long tokens;
+    unsigned long long nodes[NUM_NODE_KINDS];
+    unsigned long long lookups;     // symbol table searches
+    unsigned long long probes;
+    unsigned max_probes;
+    unsigned long long labels;
+    unsigned long long insns;       // after the peephole pass
+    unsigned long long bytes;       // assembly text or machine code
+} CompileStats;
+
+extern _Thread_local CompileStats compile_stats;
+
+#define STAT_ADD(field, n) (compile_stats.field += (n))
+#define STAT_LOOKUP(n) stats_lookup(n)
+#define STAT_PHASE(p) stats_phase(p)
+
+static inline void stats_lookup(unsigned probes) {
+    compile_stats.lookups++;
+    compile_stats.probes += probes;
+    if (probes > compile_stats.max_probes)
+        compile_stats.max_probes = probes;
+}
+
+/* Ends the running phase, if any, and starts p */
+void stats_phase(Phase p);
+void stats_reset(void);
+
+/* Prints the counters as a table or as one JSON object */
+void stats_report(FILE *f, int json);
+
+#else
+
+#define STAT_ADD(field, n) ((void)(n))
+#define STAT_LOOKUP(n) ((void)(n))
+#define STAT_PHASE(p) ((void)0)
+
+#endif
+
+
+/* --- From compiler.h --- */
+
+typedef enum {
+    MODE_ASM,           // assembly into the output buffer
+    MODE_RUN,           // compile to memory and run
+    MODE_INTERPRET      // run the checked tree with the bytecode interpreter
+} CompileMode;
+
+typedef struct CompileOptions {
+    Target target;
+    CompileMode mode;
+    const char *cache_dir;  // NULL: no cache
+    FILE *dump_ir;          // NULL: no dump
+    FILE *run_out;          // program output in the run modes
+    LexerKind lexer;
+    ParserKind parser;
+} CompileOptions;
+
+struct CompilerContext {
+    AST ast;
+    SymbolTable symbols;
+    IrFunc ir;
+    int semantic_errors;
+
+    LexerKind lexer;
+    FastLexer fast;         // see fastlex.c
+    void *scanner;          // flex state, see lexer.l
+    void *lex_buffer;
+    int line_no;
+
+    ParserKind parser;
+    Token *tokens;          // see parse.c
+    unsigned ntokens;
+    unsigned token_cap;
+    int lexing_ahead;       // lex_error keeps errors as tokens
+
+    OutBuf *msgs;           // NULL: status on stdout, errors on stderr
+    int quiet;              // drop status lines, keep errors
+    unsigned error_count;   // diag_error calls so far, never reset
+};
+
+void compiler_init(CompilerContext *ctx);
+void compiler_free(CompilerContext *ctx);
+
+/* Compiles one program; out gets the assembly, msgs the status lines and
+   errors. Returns 0 on success. Contexts are independent, so threads can
+   compile at the same time as long as each uses its own */
+int compile_program(CompilerContext *ctx, const char *src, size_t len,
+                    const CompileOptions *opt, OutBuf *out, OutBuf *msgs);
+
+/* The back half of compile_program: optimizes the checked tree in
+   ctx->ast and generates code for it, or runs it */
+int compile_tree(CompilerContext *ctx, const CompileOptions *opt, OutBuf *out);
+
+
+/* --- From batch.h --- */
+
+/* Compiles every file in paths (directories: every *.no inside) on jobs
+   threads, one assembly file each, into out_dir or next to the input.
+   Returns 1 if any file failed */
+int run_batch(const CompileOptions *opt, char **paths, int npaths,
+              const char *out_dir, int jobs);
+int batch_default_jobs(void);
+
+
+/* --- From incr.h --- */
+
+/* A run of whole top-level statements, see incr.c */
+typedef struct IncrChunk {
+    unsigned long long hash;    // of the source text
+    size_t len;
+    int clean;                  // parsed without messages, may be reused
+    unsigned long long tree;    // of the statements, position independent
+    unsigned items;             // statements, in the session's extra
+    unsigned nitems;
+    unsigned nodes;             // nodes parsed for it
+
+    int checked;                // passed semantic_check with env below
+    unsigned long long env;     // global names and types before it
+    Atom *decl_names;           // its top-level lets
+    SymbolType *decl_types;
+    unsigned ndecls;
+} IncrChunk;
+
+/* Everything kept between compilations of one editor buffer */
+typedef struct IncrSession {
+    AST parsed;                 // statements of the chunks, only aux rewritten
+    unsigned live;              // nodes still used by a chunk
+    IncrChunk *chunks;
+    int nchunks;
+    int chunk_cap;
+    IncrChunk *next;            // being built
+    int next_cap;
+
+    unsigned long long program; // last program that compiled, 0: none
+    OutBuf asm_text;            // and its assembly
+
+    int reparsed;               // chunks of the last call
+    int rechecked;
+} IncrSession;
+
+void incr_init(IncrSession *s);
+void incr_free(IncrSession *s);
+
+/* compile_program for a buffer that changed since the session's last
+   call: unchanged statements are neither parsed nor checked again */
+int compile_incremental(CompilerContext *ctx, IncrSession *s,
+                        const char *src, size_t len,
+                        const CompileOptions *opt, OutBuf *out, OutBuf *msgs);
 
 #endif /* AST_H */
@@ -0,0 +1,403 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+
+/*
+ * Batch mode: many source files, one assembly file each, compiled by a
+ * pool of threads in one process.
+ *
+ * Files are dealt out largest first, round robin, to one deque per
+ * worker. A worker takes from the front of its own deque and, when it
+ * runs dry, steals from the back of the others, so a few large files
+ * do not leave the rest of the pool idle. Each worker keeps one
+ * CompilerContext for all the files it compiles.
+ *
+ * Messages are collected per file and printed in input order once
+ * every file is done, with the time each one took.
+ */
+
+typedef struct BatchFile {
+    char *input;
+    char *output;
+    size_t size;
+    int rc;
+    double ms;
+    OutBuf errors;
+} BatchFile;
+
+typedef struct Deque {
+    int *items;
+    int head;               // owner takes here
+    int tail;               // thieves take at tail - 1
+    pthread_mutex_t lock;
+} Deque;
+
+typedef struct Batch {
+    BatchFile *files;
+    int nfiles;
+    int files_cap;
+    Deque *deques;
+    int nworkers;
+    const CompileOptions *opt;
+} Batch;
+
+typedef struct Worker {
+    Batch *batch;
+    int id;
+} Worker;
+
+
+static char *xstrdup(const char *s) {
+    size_t n = strlen(s) + 1;
+    return memcpy(xrealloc(NULL, n), s, n);
+}
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+int batch_default_jobs(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+
+/* ---- Collecting the inputs ---- */
+
+static int has_suffix(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// dir/name.no -> out_dir/name.asm, or next to the input without out_dir
+static char *output_name(const char *input, const char *out_dir, Target target) {
+    const char *ext = target == TARGET_X64 ? ".s" : ".asm";
+    const char *base = input;
+    for (const char *p = input; *p; p++)
+        if (*p == '/' || *p == '\\')
+            base = p + 1;
+
+    size_t stem = strlen(input);
+    if (has_suffix(input, ".no"))
+        stem -= 3;
+
+    size_t n = (out_dir ? strlen(out_dir) : 0) + strlen(input) + 8;
+    char *name = xrealloc(NULL, n);
+    if (out_dir)
+        snprintf(name, n, "%s/%.*s%s", out_dir, (int)(stem - (base - input)), base, ext);
+    else
+        snprintf(name, n, "%.*s%s", (int)stem, input, ext);
+    return name;
+}
+
+static void add_file(Batch *b, const char *path, size_t size, const char *out_dir) {
+    if (b->nfiles == b->files_cap) {
+        b->files_cap = b->files_cap ? b->files_cap * 2 : 64;
+        b->files = xrealloc(b->files, b->files_cap * sizeof(BatchFile));
+    }
+    BatchFile *f = &b->files[b->nfiles++];
+    memset(f, 0, sizeof(*f));
+    f->input = xstrdup(path);
+    f->output = output_name(path, out_dir, b->opt->target);
+    f->size = size;
+    ob_init(&f->errors);
+}
+
+static int by_name(const void *x, const void *y) {
+    return strcmp(*(char *const *)x, *(char *const *)y);
+}
+
+// Files are taken as given, directories are searched for *.no files
+// in name order
+static int add_path(Batch *b, const char *path, const char *out_dir) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        add_file(b, path, (size_t)st.st_size, out_dir);
+        return 1;
+    }
+
+    DIR *d = opendir(path);
+    if (!d) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 0;
+    }
+    char **names = NULL;
+    int count = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            names = xrealloc(names, cap * sizeof(char *));
+        }
+        names[count++] = xstrdup(e->d_name);
+    }
+    closedir(d);
+    qsort(names, count, sizeof(char *), by_name);
+
+    int ok = 1;
+    for (int i = 0; i < count; i++) {
+        size_t n = strlen(path) + strlen(names[i]) + 2;
+        char *child = xrealloc(NULL, n);
+        snprintf(child, n, "%s/%s", path, names[i]);
+        if (stat(child, &st) == 0 && (S_ISDIR(st.st_mode) || has_suffix(child, ".no")))
+            ok &= add_path(b, child, out_dir);
+        free(child);
+        free(names[i]);
+    }
+    free(names);
+    return ok;
+}
+
+static const BatchFile *sort_files;
+
+static int by_output(const void *x, const void *y) {
+    return strcmp(sort_files[*(const int *)x].output, sort_files[*(const int *)y].output);
+}
+
+// With -o, inputs of the same name in different directories would
+// overwrite each other's output
+static int unique_outputs(const Batch *b) {
+    int *order = xrealloc(NULL, b->nfiles * sizeof(int));
+    for (int i = 0; i < b->nfiles; i++)
+        order[i] = i;
+    sort_files = b->files;
+    qsort(order, b->nfiles, sizeof(int), by_output);
+
+    int ok = 1;
+    for (int i = 1; i < b->nfiles; i++) {
+        const BatchFile *f = &b->files[order[i - 1]], *g = &b->files[order[i]];
+        if (strcmp(f->output, g->output) == 0) {
+            fprintf(stderr, "%s and %s would both be written to %s\n",
+                    f->input, g->input, f->output);
+            ok = 0;
+        }
+    }
+    free(order);
+    return ok;
+}
+
+
+/* ---- Scheduling ---- */
+
+static int larger_first(const void *x, const void *y) {
+    size_t a = sort_files[*(const int *)x].size;
+    size_t b = sort_files[*(const int *)y].size;
+    return a < b ? 1 : a > b ? -1 : 0;
+}
+
+static void deal(Batch *b) {
+    int *order = xrealloc(NULL, b->nfiles * sizeof(int));
+    for (int i = 0; i < b->nfiles; i++)
+        order[i] = i;
+    sort_files = b->files;
+    qsort(order, b->nfiles, sizeof(int), larger_first);
+
+    b->deques = xrealloc(NULL, b->nworkers * sizeof(Deque));
+    for (int w = 0; w < b->nworkers; w++) {
+        Deque *q = &b->deques[w];
+        q->items = xrealloc(NULL, (b->nfiles / b->nworkers + 1) * sizeof(int));
+        q->head = q->tail = 0;
+        pthread_mutex_init(&q->lock, NULL);
+    }
+    for (int i = 0; i < b->nfiles; i++) {
+        Deque *q = &b->deques[i % b->nworkers];
+        q->items[q->tail++] = order[i];
+    }
+    free(order);
+}
+
+// Next file for worker w, its own first; -1 when every deque is empty
+static int take(Batch *b, int w) {
+    Deque *own = &b->deques[w];
+    int job = -1;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail)
+        job = own->items[own->head++];
+    pthread_mutex_unlock(&own->lock);
+
+    for (int k = 1; job < 0 && k < b->nworkers; k++) {
+        Deque *q = &b->deques[(w + k) % b->nworkers];
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail)
+            job = q->items[--q->tail];
+        pthread_mutex_unlock(&q->lock);
+    }
+    return job;
+}
+
+
+/* ---- Compiling ---- */
+
+static int read_file(const char *path, OutBuf *ob) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+
+    size_t n;
+    do {
+        ob_reserve(ob, 64 * 1024);
+        n = fread(ob->data + ob->len, 1, ob->cap - ob->len, f);
+        ob->len += n;
+    } while (n > 0);
+    fclose(f);
+    return 1;
+}
+
+static void compile_file(CompilerContext *ctx, const CompileOptions *opt,
+                         BatchFile *f, OutBuf *src, OutBuf *out) {
+    double start = now();
+
+    ob_reset(src);
+    ob_reset(out);
+    size_t size = 0;
+    const char *map = map_file(f->input, &size);
+    if (!map && !read_file(f->input, src)) {
+        ob_puts(&f->errors, "Cannot read the file\n");
+        f->rc = 1;
+    } else {
+        f->rc = map
+            ? compile_program(ctx, map, size, opt, out, &f->errors)
+            : compile_program(ctx, src->data, src->len, opt, out, &f->errors);
+        if (f->rc == 0 && ob_save(out, f->output) != 0) {
+            ob_puts(&f->errors, "Cannot write ");
+            ob_puts(&f->errors, f->output);
+            ob_putc(&f->errors, '\n');
+            f->rc = 1;
+        }
+    }
+    if (map)
+        unmap_file((void *)map, size);
+    f->ms = (now() - start) * 1e3;
+}
+
+static void *work(void *arg) {
+    Worker *w = arg;
+    Batch *b = w->batch;
+    CompilerContext ctx;
+    OutBuf src, out;
+
+    compiler_init(&ctx);
+    ctx.quiet = 1;
+    ob_init(&src);
+    ob_init(&out);
+
+    for (int job; (job = take(b, w->id)) >= 0; )
+        compile_file(&ctx, b->opt, &b->files[job], &src, &out);
+
+    ob_free(&src);
+    ob_free(&out);
+    compiler_free(&ctx);
+    intern_free();
+    return NULL;
+}
+
+
+static void report(const Batch *b, double wall_ms) {
+    double busy_ms = 0;
+    size_t bytes = 0;
+    int failed = 0;
+
+    for (int i = 0; i < b->nfiles; i++) {
+        const BatchFile *f = &b->files[i];
+        busy_ms += f->ms;
+        bytes += f->size;
+        if (f->rc != 0) {
+            failed++;
+            printf("  FAILED %9.2f ms  %s\n", f->ms, f->input);
+            fprintf(stderr, "%s:\n", f->input);
+            fwrite(f->errors.data, 1, f->errors.len, stderr);
+        } else {
+            printf("  ok     %9.2f ms  %s -> %s\n", f->ms, f->input, f->output);
+        }
+    }
+
+    printf("Batch: %d files, %d failed, %d threads\n", b->nfiles, failed, b->nworkers);
+    printf("  wall %.2f ms, compiling %.2f ms (%.2fx), %.2f MB/s\n",
+        wall_ms, busy_ms, wall_ms > 0 ? busy_ms / wall_ms : 0.0,
+        wall_ms > 0 ? bytes / 1e3 / wall_ms : 0.0);
+}
+
+
+int run_batch(const CompileOptions *opt, char **paths, int npaths,
+              const char *out_dir, int jobs) {
+    Batch b;
+    memset(&b, 0, sizeof(b));
+    b.opt = opt;
+
+    int ok = 1;
+    for (int i = 0; i < npaths; i++)
+        ok &= add_path(&b, paths[i], out_dir);
+    if (!ok || b.nfiles == 0 || !unique_outputs(&b)) {
+        if (b.nfiles == 0)
+            fprintf(stderr, "No input files\n");
+        return 1;
+    }
+
+    b.nworkers = jobs < b.nfiles ? jobs : b.nfiles;
+    if (b.nworkers < 1)
+        b.nworkers = 1;
+    deal(&b);
+
+    pthread_t *threads = xrealloc(NULL, b.nworkers * sizeof(pthread_t));
+    Worker *workers = xrealloc(NULL, b.nworkers * sizeof(Worker));
+    double start = now();
+
+    // Worker 0 is this thread, so -j1 runs without creating any
+    for (int w = 0; w < b.nworkers; w++) {
+        workers[w].batch = &b;
+        workers[w].id = w;
+        if (w > 0 && pthread_create(&threads[w], NULL, work, &workers[w]) != 0) {
+            fprintf(stderr, "Cannot start a compiler thread\n");
+            exit(1);
+        }
+    }
+    work(&workers[0]);
+    for (int w = 1; w < b.nworkers; w++)
+        pthread_join(threads[w], NULL);
+
+    report(&b, (now() - start) * 1e3);
+
+    int failed = 0;
+    for (int i = 0; i < b.nfiles; i++) {
+        failed |= b.files[i].rc != 0;
+        free(b.files[i].input);
+        free(b.files[i].output);
+        ob_free(&b.files[i].errors);
+    }
+    for (int w = 0; w < b.nworkers; w++) {
+        free(b.deques[w].items);
+        pthread_mutex_destroy(&b.deques[w].lock);
+    }
+    free(b.deques);
+    free(b.files);
+    free(threads);
+    free(workers);
+    return failed;
+}
@@ -0,0 +1,421 @@
+#include "gen.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/*
+ * Large Nova programs of a given shape, for benchmarking the compiler:
+ * gen.exe writes them for bench/suite.py and the benchmarks build their
+ * sources with them. Every program is valid: names are declared before
+ * use and only once per scope, and divisors are nonzero constants.
+ *
+ *   straight  - top-level let and print runs over earlier variables;
+ *               the folder reduces them to constants
+ *   nested    - if/else and for nested --depth levels deep
+ *   wide      - expressions of --width terms inside loops, so they
+ *               survive folding into the IR passes and the back end
+ *   names     - many distinct long identifiers and string literals
+ *   mixed     - the four above in turns
+ *   tokens    - every kind of literal, escapes, operators and comments,
+ *               for the scanner
+ *
+ * Documented programs have a comment after about every other line, "$"
+ * lines and now and then a "<" block, and three times the indentation.
+ *
+ * No "<" is written outside a comment: with a ">" anywhere after it, it
+ * starts one.
+ */
+
+typedef struct Gen {
+    OutBuf *out;
+    unsigned state;
+    long lines;         // written so far
+    int depth;
+    int width;
+    int documented;
+    int indent;         // of the last line, in columns
+    unsigned next;      // numbers fresh names
+    int *loops;         // levels of the enclosing for loops, in nested
+    int nloops;
+} Gen;
+
+
+static unsigned rnd(Gen *g, unsigned n) {
+    g->state = g->state * 1103515245u + 12345u;
+    return (g->state >> 16) % n;
+}
+
+static void put(Gen *g, const char *fmt, ...) {
+    va_list args;
+    for (size_t room = 256; ; ) {
+        ob_reserve(g->out, room);
+        va_start(args, fmt);
+        int n = vsnprintf(g->out->data + g->out->len, room, fmt, args);
+        va_end(args);
+        if ((size_t)n < room) {
+            g->out->len += (size_t)n;
+            return;
+        }
+        room = (size_t)n + 1;
+    }
+}
+
+static void indent(Gen *g, int level) {
+    g->indent = level * (g->documented ? 12 : 4);
+    put(g, "%*s", g->indent, "");
+}
+
+// A line or a block of comment at the indentation of the line before
+static void comment(Gen *g) {
+    static const char *notes[] = {
+        "updated on every pass; the value is kept until the loop below has run to the end",
+        "the same as before the last change, see the notes at the top",
+        "kept for reference while the new version is checked"
+    };
+    const char *note = notes[rnd(g, 3)];
+
+    if (rnd(g, 8) == 0) {
+        put(g, "%*s<\n%*s  %s\n%*s>\n", g->indent, "", g->indent, "", note, g->indent, "");
+        g->lines += 3;
+    } else {
+        put(g, "%*s$ %s\n", g->indent, "", note);
+        g->lines++;
+    }
+}
+
+static void end_line(Gen *g) {
+    ob_putc(g->out, '\n');
+    g->lines++;
+    if (g->documented && rnd(g, 2) == 0)
+        comment(g);
+    g->indent = 0;
+}
+
+
+/* ---- straight ---- */
+
+// A few terms over the variables v<first>..v<first + count - 1>
+static void small_expr(Gen *g, unsigned first, unsigned count) {
+    static const char *ops[] = { " + ", " - ", " * " };
+    int terms = 1 + (int)rnd(g, 3);
+
+    for (int k = 0; k < terms; k++) {
+        if (k > 0)
+            ob_puts(g->out, ops[rnd(g, 3)]);
+        if (count > 0 && rnd(g, 3) != 0)
+            put(g, "v%u", first + rnd(g, count));
+        else
+            put(g, "%u", rnd(g, 100));
+    }
+    if (rnd(g, 4) == 0)
+        put(g, " / %u", 1 + rnd(g, 9));
+}
+
+static void straight(Gen *g, long lines) {
+    unsigned first = g->next;
+    long stop = g->lines + lines;
+
+    while (g->lines < stop) {
+        unsigned count = g->next - first;
+        if (count > 0 && rnd(g, 4) == 0) {
+            put(g, "print v%u", first + rnd(g, count));
+        } else {
+            put(g, "let v%u = ", g->next);
+            // Only the last few, so the dependence chains stay short
+            unsigned window = count > 16 ? 16 : count;
+            small_expr(g, first + count - window, window);
+            g->next++;
+        }
+        end_line(g);
+    }
+}
+
+
+/* ---- nested ---- */
+
+// A let over a loop variable in scope, and a print of it
+static void leaf(Gen *g, int level) {
+    indent(g, level);
+    put(g, "let n%u = i%d * %u + %u", g->next++,
+            g->loops[rnd(g, (unsigned)g->nloops)], 1 + rnd(g, 9), rnd(g, 100));
+    end_line(g);
+    indent(g, level);
+    put(g, "print n%u", g->next - 1);
+    end_line(g);
+}
+
+// Levels level..depth - 1. A for declares i<level>; of the two branches
+// of an if only one goes deeper, so the size grows with the depth alone
+static void nest(Gen *g, int level) {
+    if (level + 1 >= g->depth) {
+        leaf(g, level);
+        return;
+    }
+
+    indent(g, level);
+    put(g, "let n%u = i%d + %u", g->next++,
+            g->loops[rnd(g, (unsigned)g->nloops)], rnd(g, 100));
+    end_line(g);
+
+    if (rnd(g, 2)) {
+        indent(g, level);
+        put(g, "for i%d = 1 to %u [", level, 2 + rnd(g, 8));
+        end_line(g);
+        g->loops[g->nloops++] = level;
+        nest(g, level + 1);
+        g->nloops--;
+        indent(g, level);
+        ob_puts(g->out, "]");
+        end_line(g);
+    } else {
+        int deeper = (int)rnd(g, 2);
+        indent(g, level);
+        put(g, "if n%u %s %u [", g->next - 1, rnd(g, 2) ? ">" : "!=", rnd(g, 100));
+        end_line(g);
+        if (deeper) leaf(g, level + 1); else nest(g, level + 1);
+        indent(g, level);
+        ob_puts(g->out, "] else [");
+        end_line(g);
+        if (deeper) nest(g, level + 1); else leaf(g, level + 1);
+        indent(g, level);
+        ob_puts(g->out, "]");
+        end_line(g);
+    }
+}
+
+static void nested(Gen *g, long lines) {
+    long stop = g->lines + lines;
+    while (g->lines < stop) {
+        // The loop variables of the outer levels need a level to live in
+        put(g, "for i0 = 1 to %u [", 2 + rnd(g, 8));
+        end_line(g);
+        g->loops[0] = 0;
+        g->nloops = 1;
+        nest(g, 1);
+        ob_puts(g->out, "]");
+        end_line(g);
+    }
+}
+
+
+/* ---- wide ---- */
+
+static void wide_term(Gen *g, unsigned first, unsigned count) {
+    switch (rnd(g, 6)) {
+        case 0:
+            put(g, "%u", 1 + rnd(g, 100));
+            break;
+        case 1:
+            put(g, "(i %s %u)", rnd(g, 2) ? ">" : ">=", rnd(g, 50));
+            break;
+        case 2:
+            put(g, "(i - %u) * %u", rnd(g, 10), 1 + rnd(g, 9));
+            break;
+        case 3:
+            put(g, "i / %u", 1 + rnd(g, 9));
+            break;
+        default:
+            if (count > 0)
+                put(g, "w%u", first + rnd(g, count));
+            else
+                ob_puts(g->out, "i");
+            break;
+    }
+}
+
+static void wide(Gen *g, long lines) {
+    static const char *ops[] = { " + ", " - ", " * ", " + " };
+    long stop = g->lines + lines;
+
+    while (g->lines < stop) {
+        put(g, "for i = 1 to %u [", 10 + rnd(g, 90));
+        end_line(g);
+
+        unsigned first = g->next;
+        for (int s = 0; s < 16; s++) {
+            put(g, "    let w%u = ", g->next);
+            for (int k = 0; k < g->width; k++) {
+                if (k > 0)
+                    ob_puts(g->out, ops[rnd(g, 4)]);
+                wide_term(g, first, g->next - first);
+            }
+            g->next++;
+            end_line(g);
+        }
+        put(g, "    print w%u", g->next - 1);
+        end_line(g);
+        ob_puts(g->out, "]");
+        end_line(g);
+    }
+}
+
+
+/* ---- names ---- */
+
+static void names(Gen *g, long lines) {
+    static const char *nouns[] = {
+        "customer", "order", "invoice", "shipment", "warehouse", "supplier",
+        "account", "payment", "discount", "inventory"
+    };
+    static const char *verbs[] = {
+        "received", "shipped", "cancelled", "delayed", "approved", "returned"
+    };
+    long stop = g->lines + lines;
+
+    while (g->lines < stop) {
+        unsigned id = g->next++;
+        const char *noun = nouns[rnd(g, 10)];
+
+        put(g, "let %s_record_count_%u = %u", noun, id, rnd(g, 1000));
+        end_line(g);
+        put(g, "let %s_status_message_%u = \"%s %u %s on day %u\"",
+                noun, id, noun, id, verbs[rnd(g, 6)], 1 + rnd(g, 365));
+        end_line(g);
+        if (rnd(g, 2)) {
+            put(g, "print %s_status_message_%u", noun, id);
+            end_line(g);
+        }
+    }
+}
+
+
+
+
+/* ---- tokens ---- */
+
+static const char *words[] = {
+    "total", "count", "index", "running_sum_of_values", "x",
+    "temperature_celsius", "y2", "accumulator", "left_edge", "n"
+};
+
+// <word>_<id>: the word comes with the id, so the names vary in length
+static void name(Gen *g, unsigned id) {
+    put(g, "%s_%u", words[id % 10], id);
+}
+
+static void tokens(Gen *g, long lines) {
+    unsigned first = g->next;
+    long stop = g->lines + lines;
+
+    while (g->lines < stop) {
+        unsigned count = g->next - first;
+        unsigned a = count ? first + rnd(g, count) : 0;
+        unsigned b = count ? first + rnd(g, count) : 0;
+
+        indent(g, (int)rnd(g, 4));
+        switch (count ? rnd(g, 6) : 0) {
+            case 0:
+                put(g, "let ");
+                name(g, g->next++);
+                put(g, " = %u * %u + %u.%u", rnd(g, 100), rnd(g, 1000), rnd(g, 100), rnd(g, 100));
+                break;
+            case 1:
+                put(g, "print \"%s is now \\t%s, see the notes\\n\"",
+                    words[a % 10], words[b % 10]);
+                break;
+            case 2:
+                put(g, "for i = 1 to %u [", rnd(g, 50));
+                end_line(g);
+                indent(g, 1);
+                put(g, "print i ^ 2");
+                end_line(g);
+                put(g, "]");
+                break;
+            case 3:
+                put(g, "if ");
+                name(g, a);
+                put(g, " >= ");
+                name(g, b);
+                put(g, " [ print '%c' ] else [ print ", 'a' + rnd(g, 26));
+                name(g, b);
+                put(g, " != %u ]", rnd(g, 9));
+                break;
+            case 4:
+                put(g, "$ ");
+                name(g, a);
+                put(g, " keeps the value of ");
+                name(g, b);
+                put(g, " between the passes");
+                break;
+            default:
+                put(g, "let ");
+                name(g, g->next++);
+                put(g, " = (");
+                name(g, a);
+                put(g, " - %u) / %u", rnd(g, 10), 1 + rnd(g, 9));
+                break;
+        }
+        end_line(g);
+    }
+}
+
+
+static const struct {
+    const char *name;
+    void (*write)(Gen *g, long lines);
+} shapes[NUM_GEN_SHAPES] = {
+    { "straight", straight },
+    { "nested", nested },
+    { "wide", wide },
+    { "names", names },
+    { "mixed", NULL },
+    { "tokens", tokens }
+};
+
+
+void gen_defaults(GenOptions *o) {
+    memset(o, 0, sizeof(*o));
+    o->shape = GEN_MIXED;
+    o->lines = 10000;
+    o->depth = 24;
+    o->width = 32;
+    o->seed = 1;
+}
+
+
+int gen_shape(const char *name) {
+    for (int s = 0; s < NUM_GEN_SHAPES; s++)
+        if (strcmp(name, shapes[s].name) == 0)
+            return s;
+    return -1;
+}
+
+const char *gen_shape_name(GenShape shape) {
+    return shapes[shape].name;
+}
+
+
+void gen_program(OutBuf *ob, const GenOptions *o) {
+    Gen g;
+    memset(&g, 0, sizeof(g));
+    g.out = ob;
+    g.state = o->seed;
+    g.depth = o->depth;
+    g.width = o->width;
+    g.documented = o->documented;
+
+    g.loops = malloc(g.depth * sizeof(int));
+    if (!g.loops) {
+        fprintf(stderr, "Fatal error: out of memory\n");
+        exit(1);
+    }
+
+    // Whole pieces are written, so the program ends a little past the target
+    if (shapes[o->shape].write) {
+        shapes[o->shape].write(&g, o->lines);
+    } else {
+        for (int turn = 0; g.lines < o->lines; turn = (turn + 1) % GEN_MIXED)
+            shapes[turn].write(&g, 200);
+    }
+    free(g.loops);
+}
+
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
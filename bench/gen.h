@@ -0,0 +1,41 @@
+#ifndef GEN_H
+#define GEN_H
+
+#include "ast.h"
+
+
+/* Generated Nova programs and a clock, shared by the benchmarks and gen.exe */
+
+typedef enum {
+    GEN_STRAIGHT,
+    GEN_NESTED,
+    GEN_WIDE,
+    GEN_NAMES,
+    GEN_MIXED,          // the shapes above in turns
+    GEN_TOKENS,
+    NUM_GEN_SHAPES
+} GenShape;
+
+typedef struct GenOptions {
+    GenShape shape;
+    long lines;         // the program ends a little past this many
+    int depth;          // levels of nested, at least 2
+    int width;          // terms per expression in wide, at least 1
+    unsigned seed;
+    int documented;     // comment lines and deep indentation throughout
+} GenOptions;
+
+/* Mixed, 10000 lines, depth 24, width 32, seed 1, undocumented */
+void gen_defaults(GenOptions *o);
+
+/* The shape called name, or -1 */
+int gen_shape(const char *name);
+const char *gen_shape_name(GenShape shape);
+
+/* Appends a program to ob; the same options always give the same one */
+void gen_program(OutBuf *ob, const GenOptions *o);
+
+/* Monotonic wall clock in seconds */
+double bench_now(void);
+
+#endif /* GEN_H */
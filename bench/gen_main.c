@@ -0,0 +1,72 @@
+#include "gen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Writes a large Nova program of a given shape (see gen.c), for
+ * bench/suite.py. The first line is a comment with the options.
+ *
+ *   gen.exe [--shape=<shape>] [--lines=<n>] [--depth=<n>] [--width=<n>]
+ *           [--seed=<n>] [--documented] [-o <file.no>]
+ */
+
+static void usage(void) {
+    fprintf(stderr, "Usage: gen.exe [--shape=<shape>] [--lines=<n>] [--depth=<n>] "
+                    "[--width=<n>] [--seed=<n>] [--documented] [-o <file.no>]\n");
+    fprintf(stderr, "  shapes: straight, nested, wide, names, mixed (default), tokens\n");
+}
+
+
+int main(int argc, char **argv) {
+    GenOptions o;
+    const char *outfile = NULL;
+    OutBuf ob;
+
+    gen_defaults(&o);
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--shape=", 8) == 0) {
+            int shape = gen_shape(argv[i] + 8);
+            if (shape < 0) {
+                usage();
+                return 1;
+            }
+            o.shape = (GenShape)shape;
+        } else if (strncmp(argv[i], "--lines=", 8) == 0) {
+            o.lines = atol(argv[i] + 8);
+        } else if (strncmp(argv[i], "--depth=", 8) == 0) {
+            o.depth = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "--width=", 8) == 0) {
+            o.width = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            o.seed = (unsigned)strtoul(argv[i] + 7, NULL, 10);
+        } else if (strcmp(argv[i], "--documented") == 0) {
+            o.documented = 1;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outfile = argv[++i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (o.depth < 2)
+        o.depth = 2;
+    if (o.width < 1)
+        o.width = 1;
+
+    ob_init(&ob);
+    char head[160];
+    snprintf(head, sizeof(head), "$ gen.exe --shape=%s --lines=%ld --depth=%d --width=%d%s\n",
+             gen_shape_name(o.shape), o.lines, o.depth, o.width,
+             o.documented ? " --documented" : "");
+    ob_puts(&ob, head);
+    o.lines--;
+    gen_program(&ob, &o);
+
+    int failed = outfile ? ob_save(&ob, outfile) != 0 : ob_fwrite(&ob, stdout) != 0;
+    if (failed)
+        fprintf(stderr, "Cannot write %s\n", outfile ? outfile : "the program");
+    ob_free(&ob);
+    return failed;
+}
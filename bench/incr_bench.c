@@ -0,0 +1,116 @@
+#include "ast.h"
+#include "gen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Incremental compilation of a large buffer under small edits, as the
+ * web editor sends them. The buffer is a mixed program from gen.c with
+ * shallow nesting, so its top-level statements stay small. Each edit is compiled once from scratch with
+ * compile_program and once with compile_incremental on a session that
+ * has seen the previous version; the outputs and messages must match.
+ *
+ *   comment  - a comment line added in the middle
+ *   insert   - a print statement added in the middle
+ *   change   - a different value in the first let
+ *   revert   - back to the original program
+ */
+
+#define LINES 4000
+#define DEPTH 4
+#define ROUNDS 5
+
+
+// base with text put in front of the line at the given fraction of it
+static void edit(OutBuf *dst, const OutBuf *base, double at, const char *text) {
+    size_t i = (size_t)(base->len * at);
+    while (i > 0 && base->data[i - 1] != '\n')
+        i--;
+    ob_reset(dst);
+    ob_write(dst, base->data, i);
+    ob_puts(dst, text);
+    ob_write(dst, base->data + i, base->len - i);
+}
+
+
+int main(void) {
+    static const char *names[] = { "comment", "insert", "change", "revert" };
+    OutBuf base, versions[4], full, inc, full_msgs, inc_msgs;
+    CompilerContext ctx;
+    IncrSession session;
+    CompileOptions opt;
+    GenOptions gen;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.target = TARGET_8086;
+    opt.mode = MODE_ASM;
+
+    ob_init(&base);
+    gen_defaults(&gen);
+    gen.lines = LINES;
+    gen.depth = DEPTH;
+    gen_program(&base, &gen);
+    for (int v = 0; v < 4; v++)
+        ob_init(&versions[v]);
+    edit(&versions[0], &base, 0.5, "$ a comment\n");
+    edit(&versions[1], &base, 0.5, "print 12345\n");
+    const char *rest = memchr(base.data, '\n', base.len);
+    ob_puts(&versions[2], "let v0 = 1000");
+    ob_write(&versions[2], rest, base.len - (rest - base.data));
+    ob_write(&versions[3], base.data, base.len);
+
+    ob_init(&full);
+    ob_init(&inc);
+    ob_init(&full_msgs);
+    ob_init(&inc_msgs);
+    compiler_init(&ctx);
+    incr_init(&session);
+
+    printf("%d lines, %.1f KB of source\n", LINES, base.len / 1024.0);
+    printf("%-8s %10s %10s %9s %9s\n", "edit", "full ms", "incr ms", "speedup", "reparsed");
+
+    double full_time[4] = { 0 }, inc_time[4] = { 0 };
+    int reparsed[4] = { 0 };
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int v = 0; v < 4; v++) {
+            // The session has seen the original program before each edit
+            ob_reset(&inc);
+            ob_reset(&inc_msgs);
+            compile_incremental(&ctx, &session, base.data, base.len, &opt, &inc, &inc_msgs);
+
+            ob_reset(&full);
+            ob_reset(&full_msgs);
+            double start = bench_now();
+            int full_rc = compile_program(&ctx, versions[v].data, versions[v].len,
+                                          &opt, &full, &full_msgs);
+            full_time[v] += bench_now() - start;
+
+            ob_reset(&inc);
+            ob_reset(&inc_msgs);
+            start = bench_now();
+            int inc_rc = compile_incremental(&ctx, &session, versions[v].data, versions[v].len,
+                                             &opt, &inc, &inc_msgs);
+            inc_time[v] += bench_now() - start;
+            reparsed[v] = session.reparsed;
+
+            if (full_rc != 0 || inc_rc != 0 || full.len != inc.len ||
+                memcmp(full.data, inc.data, full.len) != 0 ||
+                full_msgs.len != inc_msgs.len ||
+                memcmp(full_msgs.data, inc_msgs.data, full_msgs.len) != 0) {
+                fprintf(stderr, "%s: outputs differ\n", names[v]);
+                return 1;
+            }
+        }
+    }
+
+    for (int v = 0; v < 4; v++)
+        printf("%-8s %10.2f %10.2f %8.2fx %9d\n", names[v],
+            full_time[v] * 1e3 / ROUNDS, inc_time[v] * 1e3 / ROUNDS,
+            full_time[v] / inc_time[v], reparsed[v]);
+
+    incr_free(&session);
+    compiler_free(&ctx);
+    return 0;
+}
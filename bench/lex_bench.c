@@ -0,0 +1,197 @@
+#include "ast.h"
+#include "parser.tab.h"
+#include "gen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Lexing throughput of the flex scanner and of the fast one in
+ * fastlex.c with each set of loops it has. Every scanner reads the same
+ * source from memory, the file given or two generated by gen.c in its
+ * tokens shape: dense code, and code documented with long comments and
+ * deep indentation.
+ * The token streams (kind, value and line) must be the same as flex's.
+ *
+ * The generated source is written out once more to compare reading it
+ * with fread against mapping it.
+ */
+
+#define LINES 200000         // about 8 MB dense
+#define ROUNDS 5
+
+int yylex(YYSTYPE *lval, CompilerContext *ctx);
+
+
+typedef struct Run {
+    unsigned long long sum;     // of the token stream
+    unsigned long tokens;
+    double ms;                  // best of ROUNDS
+} Run;
+
+static unsigned long long mix(unsigned long long h, unsigned long long v) {
+    return (h ^ v) * 1099511628211ull;
+}
+
+static Run scan(CompilerContext *ctx, LexerKind kind, const char *src, size_t len) {
+    Run r = { 0, 0, 1e30 };
+    ctx->lexer = kind;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        unsigned long long sum = 14695981039346656037ull;
+        unsigned long tokens = 0;
+        YYSTYPE v;
+
+        double start = bench_now();
+        lex_set_input(ctx, src, len);
+        for (int t; (t = yylex(&v, ctx)) != 0; tokens++) {
+            unsigned long long val = 0;
+            switch (t) {
+                case INT_LITERAL: val = (unsigned)v.ival; break;
+                case FLOAT_LITERAL: memcpy(&val, &v.fval, sizeof(v.fval)); break;
+                case CHAR_LITERAL: val = (unsigned char)v.cval; break;
+                case ID:
+                case STRING_LITERAL: val = v.atom; break;
+            }
+            sum = mix(mix(mix(sum, (unsigned)t), val), (unsigned)ctx->line_no);
+        }
+        double ms = (bench_now() - start) * 1e3;
+
+        r.sum = sum;
+        r.tokens = tokens;
+        if (ms < r.ms)
+            r.ms = ms;
+    }
+    return r;
+}
+
+
+static double time_fread(const char *path, size_t *len) {
+    double start = bench_now();
+    OutBuf ob;
+    ob_init(&ob);
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        size_t n;
+        do {
+            ob_reserve(&ob, 64 * 1024);
+            n = fread(ob.data + ob.len, 1, ob.cap - ob.len, f);
+            ob.len += n;
+        } while (n > 0);
+        fclose(f);
+    }
+    *len = ob.len;
+    ob_free(&ob);
+    return (bench_now() - start) * 1e3;
+}
+
+// Mapping alone costs nothing; the pages are touched as a scanner would
+static volatile unsigned sink;
+
+static double time_map(const char *path, size_t *len) {
+    double start = bench_now();
+    size_t size = 0;
+    const char *p = map_file(path, &size);
+    for (size_t i = 0; i < size; i += 4096)
+        sink += (unsigned char)p[i];
+    if (p)
+        unmap_file((void *)p, size);
+    *len = size;
+    return (bench_now() - start) * 1e3;
+}
+
+
+// Runs every scanner over src; 1 if a token stream differs from flex's
+static int compare(CompilerContext *ctx, const char *title, const OutBuf *src) {
+    static const struct { LexerKind kind; const char *name; } scanners[] = {
+        { LEX_FLEX, "flex" },
+        { LEX_FAST_SCALAR, NULL },
+        { LEX_FAST_SSE2, NULL },
+        { LEX_FAST, NULL }
+    };
+    double mb = src->len / 1e6;
+    Run ref = { 0, 0, 0 };
+    int failed = 0;
+    const char *prev = NULL;
+
+    printf("%s: %.1f MB, best of %d\n", title, mb, ROUNDS);
+    printf("scanner        tokens        ms      MB/s   speedup\n");
+    for (int i = 0; i < 4; i++) {
+        const char *name = scanners[i].name;
+        char label[32];
+        if (!name) {
+            // A level the CPU or the build lacks falls back to the one before
+            name = fast_lex_kernels(scanners[i].kind);
+            if (prev && strcmp(prev, name) == 0) continue;
+            prev = name;
+            snprintf(label, sizeof(label), "fast/%s", name);
+            name = label;
+        }
+
+        Run r = scan(ctx, scanners[i].kind, src->data, src->len);
+        if (i == 0)
+            ref = r;
+        int same = r.sum == ref.sum && r.tokens == ref.tokens;
+        failed |= !same;
+        printf("%-12s %8lu %9.2f %9.1f %8.2fx%s\n", name, r.tokens, r.ms,
+            mb / (r.ms / 1e3), ref.ms / r.ms, same ? "" : "  MISMATCH");
+    }
+    printf("\n");
+    return failed;
+}
+
+
+int main(int argc, char **argv) {
+    CompilerContext ctx;
+    OutBuf src, msgs;
+    int failed = 0;
+    ob_init(&src);
+    ob_init(&msgs);
+    compiler_init(&ctx);
+    ctx.msgs = &msgs;
+
+    if (argc > 1) {
+        size_t size = 0;
+        const char *map = map_file(argv[1], &size);
+        if (!map) {
+            fprintf(stderr, "Cannot map %s\n", argv[1]);
+            return 1;
+        }
+        ob_write(&src, map, size);
+        unmap_file((void *)map, size);
+        failed |= compare(&ctx, argv[1], &src);
+    } else {
+        GenOptions gen;
+        gen_defaults(&gen);
+        gen.shape = GEN_TOKENS;
+        gen.lines = LINES;
+        gen.documented = 1;
+        gen_program(&src, &gen);
+        failed |= compare(&ctx, "documented", &src);
+        ob_reset(&src);
+        gen.documented = 0;
+        gen_program(&src, &gen);
+        failed |= compare(&ctx, "dense", &src);
+
+        const char *path = "lex_bench.tmp";
+        if (ob_save(&src, path) == 0) {
+            size_t n1, n2;
+            double fr = 1e30, mp = 1e30;
+            for (int round = 0; round < ROUNDS; round++) {
+                double a = time_fread(path, &n1), b = time_map(path, &n2);
+                if (a < fr) fr = a;
+                if (b < mp) mp = b;
+            }
+            printf("reading the dense source from a file: fread %.2f ms, map %.2f ms\n", fr, mp);
+            remove(path);
+        }
+    }
+    if (msgs.len)
+        printf("%.*s", (int)msgs.len, msgs.data);
+
+    compiler_free(&ctx);
+    ob_free(&src);
+    ob_free(&msgs);
+    return failed;
+}
@@ -0,0 +1,125 @@
+#include "ast.h"
+#include "gen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Parse throughput of the bison parser, which pulls tokens from yylex
+ * one at a time, against lexing into a token array and parsing that
+ * with the recursive descent parser in parse.c. Both use the fast
+ * scanner. The source is a mixed program from gen.c or the files given;
+ * the trees and the messages of the two parsers must be identical.
+ */
+
+#define LINES 80000          // about 8 MB
+#define ROUNDS 5
+
+
+static int same_tree(const AST *x, const AST *y) {
+    unsigned n = x->count - 1;
+    if (x->count != y->count || x->root != y->root || x->extra_len != y->extra_len)
+        return 0;
+    // Slot 0 is never written
+    return memcmp(x->kind + 1, y->kind + 1, n) == 0 &&
+           memcmp(x->aux + 1, y->aux + 1, n) == 0 &&
+           memcmp(x->a + 1, y->a + 1, n * sizeof(unsigned)) == 0 &&
+           memcmp(x->b + 1, y->b + 1, n * sizeof(unsigned)) == 0 &&
+           memcmp(x->c + 1, y->c + 1, n * sizeof(unsigned)) == 0 &&
+           memcmp(x->extra, y->extra, x->extra_len * sizeof(NodeId)) == 0;
+}
+
+// Best time of ROUNDS parses of src; the tree is left in ctx->ast
+static double parse(CompilerContext *ctx, ParserKind kind, const OutBuf *src,
+                    OutBuf *msgs, int *rc) {
+    double best = 1e30;
+    ctx->parser = kind;
+    ctx->msgs = msgs;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        ast_reset(&ctx->ast);
+        ob_reset(msgs);
+        double start = bench_now();
+        *rc = parse_source(ctx, src->data, src->len, 1);
+        double ms = (bench_now() - start) * 1e3;
+        if (ms < best)
+            best = ms;
+    }
+    return best;
+}
+
+static double lex_only(CompilerContext *ctx, const OutBuf *src) {
+    double best = 1e30;
+    for (int round = 0; round < ROUNDS; round++) {
+        double start = bench_now();
+        lex_all(ctx, src->data, src->len, 1);
+        double ms = (bench_now() - start) * 1e3;
+        if (ms < best)
+            best = ms;
+    }
+    return best;
+}
+
+static int compare(CompilerContext *bison, CompilerContext *fast, const char *title,
+                   const OutBuf *src) {
+    OutBuf bmsgs, fmsgs;
+    ob_init(&bmsgs);
+    ob_init(&fmsgs);
+
+    int brc, frc;
+    double bms = parse(bison, PARSER_BISON, src, &bmsgs, &brc);
+    double fms = parse(fast, PARSER_FAST, src, &fmsgs, &frc);
+    double lms = lex_only(fast, src);
+    double mb = src->len / 1e6;
+
+    int same = brc == frc && bmsgs.len == fmsgs.len &&
+               memcmp(bmsgs.data, fmsgs.data, bmsgs.len) == 0 &&
+               (brc != 0 || same_tree(&bison->ast, &fast->ast));
+
+    printf("%s: %.1f MB, %u tokens, %u nodes%s\n", title, mb,
+        fast->ntokens, fast->ast.count - 1, brc ? ", does not parse" : "");
+    printf("  bison           %9.2f ms %8.1f MB/s\n", bms, mb / (bms / 1e3));
+    printf("  tokens+descent  %9.2f ms %8.1f MB/s  %.2fx  (lexing %.2f ms)%s\n",
+        fms, mb / (fms / 1e3), bms / fms, lms, same ? "" : "  MISMATCH");
+
+    ob_free(&bmsgs);
+    ob_free(&fmsgs);
+    return !same;
+}
+
+
+int main(int argc, char **argv) {
+    CompilerContext bison, fast;
+    OutBuf src;
+    int failed = 0;
+
+    compiler_init(&bison);
+    compiler_init(&fast);
+    ob_init(&src);
+    printf("best of %d\n", ROUNDS);
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            size_t size = 0;
+            const char *map = map_file(argv[i], &size);
+            ob_reset(&src);
+            if (map) {
+                ob_write(&src, map, size);
+                unmap_file((void *)map, size);
+            }
+            failed |= compare(&bison, &fast, argv[i], &src);
+        }
+    } else {
+        GenOptions gen;
+        gen_defaults(&gen);
+        gen.lines = LINES;
+        gen_program(&src, &gen);
+        failed |= compare(&bison, &fast, "generated", &src);
+    }
+
+    ob_free(&src);
+    compiler_free(&bison);
+    compiler_free(&fast);
+    return failed;
+}
@@ -0,0 +1,181 @@
+"""Compiler benchmark suite.
+
+Generates one program of each shape with gen.exe, compiles each with
+`nova.exe --stats=json` a few times and reports the best run:
+end-to-end and per-phase throughput in source lines per second, and the
+compiler's peak memory. The results are compared with a stored baseline
+and the exit status is 1 if any of them regressed by more than the
+tolerance.
+
+    python bench/suite.py                 # compare with bench/baseline.json
+    python bench/suite.py --save          # record a new baseline
+    python bench/suite.py --lines 50000 --rounds 5 --tolerance 0.15
+
+Run it from the directory holding nova.exe and gen.exe (`make suite`).
+Times depend on the machine, so the baseline is only meaningful on the
+one it was recorded on; it notes the host and the suite warns when that
+differs.
+"""
+
+import argparse
+import json
+import os
+import platform
+import subprocess
+import sys
+import tempfile
+import time
+
+COMPILER = os.path.abspath('nova.exe')
+GENERATOR = os.path.abspath('gen.exe')
+BASELINE = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'baseline.json')
+
+SHAPES = ['straight', 'nested', 'wide', 'names', 'mixed']
+PHASES = ['lex', 'parse', 'check', 'fold', 'ir', 'select', 'emit']
+MEMORY_TOLERANCE = 0.10
+MIN_PHASE_SHARE = 0.05      # shorter phases are too noisy to compare
+
+
+def host():
+    return '%s %s' % (platform.system(), platform.machine())
+
+
+def generate(shape, lines, path):
+    subprocess.run([GENERATOR, '--shape=' + shape, '--lines=%d' % lines, '-o', path],
+                   check=True)
+    with open(path, 'rb') as f:
+        return f.read().count(b'\n')
+
+
+def compile_once(source, output):
+    """One compilation: wall seconds end to end and the --stats record."""
+    start = time.perf_counter()
+    result = subprocess.run([COMPILER, '--stats=json', '-o', output, source],
+                            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    wall = time.perf_counter() - start
+    if result.returncode != 0:
+        raise RuntimeError('%s failed:\n%s' % (source, result.stderr.decode(errors='replace')))
+    # The record is the last line, after the status lines
+    return wall, json.loads(result.stdout.decode().strip().splitlines()[-1])
+
+
+def measure(shape, lines, rounds, workdir):
+    source = os.path.join(workdir, shape + '.no')
+    output = os.path.join(workdir, shape + '.asm')
+    lines = generate(shape, lines, source)
+
+    best_wall = None
+    phases = {p: None for p in PHASES}
+    peak = 0
+    for _ in range(rounds):
+        wall, stats = compile_once(source, output)
+        best_wall = wall if best_wall is None else min(best_wall, wall)
+        for p in PHASES:
+            ms = stats['phases'][p]['wall_ms']
+            phases[p] = ms if phases[p] is None else min(phases[p], ms)
+        peak = max(peak, stats['peak_rss_kb'])
+
+    return {
+        'lines': lines,
+        'wall_ms': round(best_wall * 1e3, 3),
+        'lines_per_s': round(lines / best_wall),
+        'phase_ms': phases,
+        'phase_lines_per_s': {p: round(lines / (ms / 1e3)) if ms else None
+                              for p, ms in phases.items()},
+        'peak_rss_kb': peak,
+    }
+
+
+def report(results):
+    print('%-9s %7s %10s %11s %9s' % ('shape', 'lines', 'total ms', 'lines/s', 'peak KB'), end='')
+    for p in PHASES:
+        print(' %8s' % p, end='')
+    print()
+    for shape, r in results.items():
+        print('%-9s %7d %10.1f %11d %9d' % (shape, r['lines'], r['wall_ms'],
+                                           r['lines_per_s'], r['peak_rss_kb']), end='')
+        for p in PHASES:
+            print(' %8.1f' % r['phase_ms'][p], end='')
+        print()
+    print('(phases in ms)')
+
+
+def compare(results, baseline, tolerance):
+    """Lines of what got slower or bigger than the baseline allows."""
+    problems = []
+    for shape, r in results.items():
+        old = baseline['shapes'].get(shape)
+        if not old:
+            continue
+        if r['lines'] != old['lines']:
+            problems.append('%s: %d lines, the baseline has %d; record a new one'
+                            % (shape, r['lines'], old['lines']))
+            continue
+
+        if r['lines_per_s'] < old['lines_per_s'] * (1 - tolerance):
+            problems.append('%s: %d lines/s, baseline %d (%+.0f%%)' % (
+                shape, r['lines_per_s'], old['lines_per_s'],
+                (r['lines_per_s'] / old['lines_per_s'] - 1) * 100))
+
+        if r['peak_rss_kb'] > old['peak_rss_kb'] * (1 + MEMORY_TOLERANCE):
+            problems.append('%s: peak %d KB, baseline %d KB' % (
+                shape, r['peak_rss_kb'], old['peak_rss_kb']))
+
+        total = sum(ms for ms in old['phase_ms'].values() if ms)
+        for p in PHASES:
+            rate, old_rate = r['phase_lines_per_s'][p], old['phase_lines_per_s'].get(p)
+            if not rate or not old_rate or old['phase_ms'][p] < total * MIN_PHASE_SHARE:
+                continue
+            if rate < old_rate * (1 - tolerance):
+                problems.append('%s/%s: %d lines/s, baseline %d (%+.0f%%)' % (
+                    shape, p, rate, old_rate, (rate / old_rate - 1) * 100))
+    return problems
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Nova compiler benchmark suite')
+    parser.add_argument('--lines', type=int, help='lines per program (default: the baseline\'s, or 20000)')
+    parser.add_argument('--rounds', type=int, default=5, help='compilations per shape, the best counts')
+    parser.add_argument('--tolerance', type=float, default=0.25, help='allowed slowdown, 0.25 = 25%%')
+    parser.add_argument('--baseline', default=BASELINE, help='baseline file')
+    parser.add_argument('--save', action='store_true', help='write the results as the new baseline')
+    args = parser.parse_args()
+
+    baseline = None
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    lines = args.lines or (baseline['lines'] if baseline else 20000)
+
+    with tempfile.TemporaryDirectory() as workdir:
+        try:
+            results = {s: measure(s, lines, args.rounds, workdir) for s in SHAPES}
+        except (OSError, RuntimeError, subprocess.CalledProcessError) as e:
+            print(e, file=sys.stderr)
+            return 1
+    report(results)
+
+    if args.save:
+        with open(args.baseline, 'w') as f:
+            json.dump({'host': host(), 'lines': lines, 'rounds': args.rounds,
+                       'shapes': results}, f, indent=2)
+            f.write('\n')
+        print('Baseline written to %s' % args.baseline)
+        return 0
+
+    if not baseline:
+        print('No baseline at %s; run with --save to record one' % args.baseline)
+        return 0
+    if baseline.get('host') != host():
+        print('Warning: the baseline was recorded on %s, this is %s' % (baseline.get('host'), host()))
+
+    problems = compare(results, baseline, args.tolerance)
+    for p in problems:
+        print('REGRESSION ' + p)
+    if not problems:
+        print('No regressions against %s (tolerance %.0f%%)' % (args.baseline, args.tolerance * 100))
+    return 1 if problems else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,103 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+/*
+ * Symbol table scaling benchmark.
+ *
+ *   flat    - N declarations in one scope, then N lookups
+ *   nested  - scopes of 10 declarations nested 100 deep and unwound
+ *             again; every name is shadowed at each level and each
+ *             declaration looks up an outer binding
+ *
+ * Time per declaration should stay flat as N grows.
+ */
+
+
+static Atom *names;
+static SymbolTable table;
+static int redeclared;
+
+
+static double elapsed_ms(clock_t start) {
+    return (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+}
+
+
+static double bench_flat(int n) {
+    clock_t start = clock();
+
+    sym_reset(&table);
+    sym_enter_scope(&table);
+    for (int i = 0; i < n; i++)
+        redeclared += !sym_insert(&table, names[i], SYM_INT);
+    for (int i = 0; i < n; i++)
+        if (!sym_lookup(&table, names[i])) {
+            fprintf(stderr, "lookup failed\n");
+            exit(1);
+        }
+    sym_exit_scope(&table);
+
+    return elapsed_ms(start);
+}
+
+
+static double bench_nested(int n) {
+    const int per_scope = 10, depth = 100;
+    clock_t start = clock();
+
+    sym_reset(&table);
+    sym_enter_scope(&table);
+    int done = 0;
+    while (done < n) {
+        int d = 0;
+        for (; d < depth && done < n; d++) {
+            sym_enter_scope(&table);
+            for (int i = 0; i < per_scope; i++, done++) {
+                redeclared += !sym_insert(&table, names[i], SYM_INT);
+                sym_lookup(&table, names[per_scope + d]);
+            }
+            redeclared += !sym_insert(&table, names[per_scope + d + 1], SYM_INT);
+        }
+        while (d-- > 0)
+            sym_exit_scope(&table);
+    }
+    sym_exit_scope(&table);
+
+    return elapsed_ms(start);
+}
+
+
+int main(void) {
+    const int sizes[] = { 10000, 100000, 1000000 };
+    const int max = sizes[2];
+    char buf[32];
+
+    sym_init(&table);
+    names = malloc(max * sizeof(Atom));
+    for (int i = 0; i < max; i++) {
+        int len = sprintf(buf, "v%d", i);
+        names[i] = intern(buf, len);
+    }
+
+    // Warm up the table, undo stack and arena before timing
+    bench_flat(max);
+
+    printf("%-8s %10s %12s %12s\n", "shape", "decls", "total ms", "ns/decl");
+
+    for (int shape = 0; shape < 2; shape++) {
+        for (int k = 0; k < 3; k++) {
+            int n = sizes[k];
+            double ms = shape == 0 ? bench_flat(n) : bench_nested(n);
+
+            printf("%-8s %10d %12.2f %12.1f\n",
+                shape == 0 ? "flat" : "nested", n, ms, ms * 1e6 / n);
+        }
+    }
+
+    free(names);
+    sym_free(&table);
+    return redeclared != 0;
+}
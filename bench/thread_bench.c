@@ -0,0 +1,127 @@
+#include "ast.h"
+#include "gen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+/*
+ * Parallel compilation in one process. A set of mixed programs from
+ * gen.c is compiled once on the main thread for reference, then again
+ * by 1, 2, 4 and 8 threads that each own a CompilerContext and take
+ * programs from a shared counter. Every output must match its reference.
+ *
+ * Built with -fsanitize=thread by "make tsan" to check that the
+ * compiler core shares nothing between threads.
+ */
+
+#define NUM_PROGRAMS 32
+#define LINES 1000
+
+typedef struct Job {
+    OutBuf src;
+    OutBuf expected;
+    OutBuf got;
+    Target target;
+} Job;
+
+static Job jobs[NUM_PROGRAMS];
+static int next_job;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ---- Compiling ---- */
+
+static void compile_job(CompilerContext *ctx, Job *job, OutBuf *out) {
+    CompileOptions opt;
+    OutBuf msgs;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.target = job->target;
+    opt.mode = MODE_ASM;
+
+    ob_init(&msgs);
+    ob_reset(out);
+    if (compile_program(ctx, job->src.data, job->src.len, &opt, out, &msgs) != 0) {
+        fprintf(stderr, "compilation failed:\n%.*s", (int)msgs.len, msgs.data);
+        exit(1);
+    }
+    ob_free(&msgs);
+}
+
+static void *worker(void *arg) {
+    CompilerContext ctx;
+    (void)arg;
+
+    compiler_init(&ctx);
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        int i = next_job++;
+        pthread_mutex_unlock(&lock);
+        if (i >= NUM_PROGRAMS) break;
+        compile_job(&ctx, &jobs[i], &jobs[i].got);
+    }
+    compiler_free(&ctx);
+    return NULL;
+}
+
+
+int main(void) {
+    const int counts[] = { 1, 2, 4, 8 };
+    CompilerContext ctx;
+    GenOptions opt;
+    size_t bytes = 0;
+
+    compiler_init(&ctx);
+    double start = bench_now();
+    for (int i = 0; i < NUM_PROGRAMS; i++) {
+        Job *job = &jobs[i];
+        ob_init(&job->src);
+        ob_init(&job->expected);
+        ob_init(&job->got);
+        job->target = i % 2 ? TARGET_X64 : TARGET_8086;
+        gen_defaults(&opt);
+        opt.lines = LINES;
+        opt.seed = 1000u + i;
+        gen_program(&job->src, &opt);
+        compile_job(&ctx, job, &job->expected);
+        bytes += job->src.len;
+    }
+    double serial = bench_now() - start;
+    compiler_free(&ctx);
+
+    printf("%d programs, %.1f MB of source\n", NUM_PROGRAMS, bytes / 1e6);
+    printf("%-8s %12s %10s\n", "threads", "ms", "speedup");
+    printf("%-8s %12.2f %10s\n", "serial", serial * 1e3, "-");
+
+    for (int c = 0; c < 4; c++) {
+        pthread_t threads[8];
+        next_job = 0;
+
+        start = bench_now();
+        for (int t = 0; t < counts[c]; t++)
+            pthread_create(&threads[t], NULL, worker, NULL);
+        for (int t = 0; t < counts[c]; t++)
+            pthread_join(threads[t], NULL);
+        double ms = (bench_now() - start) * 1e3;
+
+        for (int i = 0; i < NUM_PROGRAMS; i++) {
+            const Job *job = &jobs[i];
+            if (job->got.len != job->expected.len ||
+                memcmp(job->got.data, job->expected.data, job->got.len) != 0) {
+                fprintf(stderr, "program %d: output differs with %d threads\n",
+                    i, counts[c]);
+                return 1;
+            }
+        }
+        printf("%-8d %12.2f %9.2fx\n", counts[c], ms, serial * 1e3 / ms);
+    }
+
+    for (int i = 0; i < NUM_PROGRAMS; i++) {
+        ob_free(&jobs[i].src);
+        ob_free(&jobs[i].expected);
+        ob_free(&jobs[i].got);
+    }
+    return 0;
+}
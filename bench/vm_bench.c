@@ -0,0 +1,222 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/*
+ * Bytecode interpreter against a naive tree-walking evaluator.
+ *
+ *   loops   - two nested for loops around arithmetic and an if
+ *   scalar  - a long loop of lets that shuffle three variables
+ *
+ * Both runs print into a temporary file and the outputs must match.
+ * The interpreter's time includes translating the tree to bytecode.
+ */
+
+
+static AST ast;
+static int *env;
+
+
+static double elapsed_ms(clock_t start) {
+    return (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+}
+
+
+/* ---- Tree walker: recursion over the tree, variables by atom ---- */
+
+static int eval(const AST *t, NodeId n) {
+    switch (t->kind[n]) {
+        case NODE_LITERAL:
+            return (short)t->a[n];
+
+        case NODE_ID:
+            return env[t->a[n]];
+
+        case NODE_BINOP: {
+            int a = eval(t, t->a[n]), b = eval(t, t->b[n]);
+            switch (t->aux[n]) {
+                case '+': return (short)(a + b);
+                case '-': return (short)(a - b);
+                case '*': return (short)(a * b);
+                case '/': return (short)((unsigned short)a / (unsigned short)b);
+                case '^': {
+                    int v = 1;
+                    for (int i = 0; i < b; i++)
+                        v = (short)(v * a);
+                    return v;
+                }
+                case '>': return a > b;
+                case '<': return a < b;
+                case 'G': return a >= b;
+                case 'L': return a <= b;
+                case 'E': return a == b;
+                default:  return a != b;
+            }
+        }
+    }
+    return 0;
+}
+
+static void exec(const AST *t, NodeId n, FILE *out) {
+    if (!n) return;
+
+    switch (t->kind[n]) {
+        case NODE_STMT_LIST:
+        case NODE_BLOCK:
+            for (unsigned i = 0; i < t->b[n]; i++)
+                exec(t, t->extra[t->a[n] + i], out);
+            break;
+
+        case NODE_DECL:
+            env[t->a[n]] = eval(t, t->b[n]);
+            break;
+
+        case NODE_PRINT:
+            fprintf(out, "%u", (unsigned short)eval(t, t->a[n]));
+            break;
+
+        case NODE_IF:
+            if (eval(t, t->a[n]))
+                exec(t, t->b[n], out);
+            else
+                exec(t, t->c[n], out);
+            break;
+
+        case NODE_FOR: {
+            Atom v = t->a[n];
+            env[v] = eval(t, t->b[n]);
+            int limit = eval(t, ast_for_to(t, n));
+            while (env[v] <= limit) {
+                exec(t, ast_for_body(t, n), out);
+                env[v] = (short)(env[v] + 1);
+            }
+            break;
+        }
+    }
+}
+
+
+/* ---- Building the programs ---- */
+
+static NodeId num(int v) { return make_int(&ast, v); }
+static NodeId var(const char *s) { return make_id(&ast, intern_cstr(s)); }
+static NodeId op(char c, NodeId l, NodeId r) { return make_binop(&ast, c, l, r); }
+static NodeId let(const char *s, NodeId e) { return make_decl(&ast, intern_cstr(s), e); }
+
+static NodeId loop(const char *v, NodeId from, NodeId to, NodeId body) {
+    return make_for(&ast, intern_cstr(v), from, to, body);
+}
+
+// Statements are complete before the list is opened, so lists nest
+static NodeId list(int root, int n, const NodeId *items) {
+    unsigned mark = ast_list_begin(&ast);
+    for (int i = 0; i < n; i++)
+        ast_list_push(&ast, items[i]);
+    return root ? make_stmt_list(&ast, mark) : make_block(&ast, mark);
+}
+
+static NodeId block(int n, const NodeId *items) {
+    return list(0, n, items);
+}
+
+
+static void build_loops(int n) {
+    NodeId wrap[] = { let("s", op('-', var("s"), num(1000))) };
+    NodeId inner[] = {
+        let("s", op('-', op('+', var("s"), op('*', var("i"), var("j"))),
+                         op('/', var("j"), num(3)))),
+        make_if(&ast, op('>', var("s"), num(1000)), block(1, wrap), NODE_NONE)
+    };
+    NodeId outer[] = { loop("j", num(1), num(200), block(2, inner)) };
+    NodeId prog[] = {
+        let("s", num(0)),
+        loop("i", num(1), num(n), block(1, outer)),
+        make_print(&ast, var("s"))
+    };
+    ast.root = list(1, 3, prog);
+}
+
+static void build_scalar(int n) {
+    NodeId hit[] = { let("k", op('+', var("k"), num(1))) };
+    NodeId body[] = {
+        let("t", op('+', var("a"), var("b"))),
+        let("a", var("b")),
+        let("b", var("t")),
+        make_if(&ast, op('E', var("a"), num(144)), block(1, hit), NODE_NONE)
+    };
+    NodeId inner[] = { loop("i", num(1), num(30000), block(4, body)) };
+    NodeId prog[] = {
+        let("a", num(0)),
+        let("b", num(1)),
+        let("k", num(0)),
+        loop("r", num(1), num(n), block(1, inner)),
+        make_print(&ast, var("k")),
+        make_print(&ast, var("a"))
+    };
+    ast.root = list(1, 6, prog);
+}
+
+
+static int same_output(FILE *x, FILE *y) {
+    char bx[256], by[256];
+    rewind(x);
+    rewind(y);
+    for (;;) {
+        size_t nx = fread(bx, 1, sizeof(bx), x);
+        size_t ny = fread(by, 1, sizeof(by), y);
+        if (nx != ny || memcmp(bx, by, nx) != 0) return 0;
+        if (nx == 0) return 1;
+    }
+}
+
+
+int main(void) {
+    static const char *shapes[] = { "loops", "scalar" };
+    const int sizes[] = { 20000, 200 };
+    VmProgram prog;
+
+    vm_init(&prog);
+    printf("%-8s %12s %12s %10s\n", "shape", "tree ms", "vm ms", "speedup");
+
+    for (int shape = 0; shape < 2; shape++) {
+        ast_init(&ast);
+        if (shape == 0)
+            build_loops(sizes[shape]);
+        else
+            build_scalar(sizes[shape]);
+
+        FILE *tree_out = tmpfile(), *vm_out = tmpfile();
+        if (!tree_out || !vm_out) {
+            fprintf(stderr, "cannot create temporary files\n");
+            return 1;
+        }
+
+        env = calloc(atom_count() + 1, sizeof(int));
+        clock_t start = clock();
+        exec(&ast, ast.root, tree_out);
+        double tree_ms = elapsed_ms(start);
+        free(env);
+
+        start = clock();
+        vm_compile(&prog, &ast);
+        vm_run(&prog, vm_out);
+        double vm_ms = elapsed_ms(start);
+
+        if (!same_output(tree_out, vm_out)) {
+            fprintf(stderr, "%s: outputs differ\n", shapes[shape]);
+            return 1;
+        }
+        printf("%-8s %12.2f %12.2f %9.2fx\n",
+            shapes[shape], tree_ms, vm_ms, tree_ms / vm_ms);
+
+        fclose(tree_out);
+        fclose(vm_out);
+        ast_free(&ast);
+    }
+
+    vm_free(&prog);
+    return 0;
+}
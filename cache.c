@@ -0,0 +1,387 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+
+/*
+ * Cache of checked trees, one file per source text, named after a
+ * 64-bit FNV-1a hash of the source. A hit skips the parser and
+ * semantic_check.
+ *
+ * The file is the header below followed by 8-byte aligned sections:
+ * the node fields a, b and c, the extra array, the kind and aux bytes,
+ * the atom table (one length per atom, then the strings back to back)
+ * and the source text. It is mapped read-only and the sections are used
+ * in place.
+ *
+ * An entry is a hit only if its source equals the one being compiled,
+ * so two sources with the same hash never share a tree, and only if the
+ * tree is well formed (tree_ok), so a damaged file is a miss rather than
+ * a crash in a later pass.
+ *
+ * Only the atoms the tree names are stored, numbered densely in the
+ * order its nodes first name them, so an entry depends on nothing but
+ * the source. Interning them in that order gives a fresh process the
+ * same ids, and the tree can then be read straight from the mapping.
+ * Otherwise it is copied and its atoms renumbered.
+ *
+ * Files are written under a temporary name and renamed into place, so
+ * parallel compilers never see a partial entry. The name includes the
+ * CacheFile's address as well as the process id, for batch threads.
+ * Bump CACHE_VERSION whenever the tree layout changes.
+ */
+
+#define CACHE_VERSION 3
+
+typedef struct CacheHeader {
+    char magic[4];
+    unsigned version;
+    unsigned long long hash;
+    unsigned long long src_len;
+    unsigned long long size;        // whole file
+    unsigned count;                 // nodes, slot 0 included
+    unsigned extra_len;
+    unsigned root;
+    unsigned natoms;
+    unsigned long long off_a, off_b, off_c, off_extra;
+    unsigned long long off_kind, off_aux, off_atoms, off_src;
+} CacheHeader;
+
+static const char magic[4] = { 'N', 'V', 'C', 'T' };
+
+// Scratch for cache_save; stored_id is all 0 between calls
+static _Thread_local unsigned *stored_id = NULL; // by atom, 0 = not stored
+static _Thread_local int stored_cap = 0;
+static _Thread_local Atom *stored = NULL;       // the stored atoms
+static _Thread_local unsigned *field_a = NULL;  // a with the stored ids
+static _Thread_local unsigned scratch_cap = 0;
+
+
+static unsigned long long hash_source(const char *s, size_t len) {
+    unsigned long long h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+
+static int section_ok(const CacheHeader *h, unsigned long long off,
+                      unsigned long long bytes) {
+    return off % 8 == 0 && off <= h->size && bytes <= h->size - off;
+}
+
+static int header_ok(const CacheHeader *h, size_t size,
+                     unsigned long long hash, size_t src_len) {
+    unsigned long long n = h->count, words = n * sizeof(unsigned);
+
+    return size >= sizeof(CacheHeader) &&
+           memcmp(h->magic, magic, 4) == 0 &&
+           h->version == CACHE_VERSION &&
+           h->hash == hash && h->src_len == src_len &&
+           h->size == size &&
+           h->count > 0 && h->root < h->count &&
+           section_ok(h, h->off_a, words) &&
+           section_ok(h, h->off_b, words) &&
+           section_ok(h, h->off_c, words) &&
+           section_ok(h, h->off_extra, (unsigned long long)h->extra_len * sizeof(NodeId)) &&
+           section_ok(h, h->off_kind, n) &&
+           section_ok(h, h->off_aux, n) &&
+           section_ok(h, h->off_atoms, (unsigned long long)h->natoms * sizeof(unsigned)) &&
+           section_ok(h, h->off_src, h->src_len);
+}
+
+
+static int names_atom(const AST *t, unsigned i) {
+    return t->kind[i] == NODE_DECL || t->kind[i] == NODE_FOR ||
+           t->kind[i] == NODE_ID ||
+           (t->kind[i] == NODE_LITERAL && t->aux[i] == TYPE_STRING);
+}
+
+
+/* ---- Checking an entry ---- */
+
+// The tree as it lies in the mapping, atoms as stored
+static void map_tree(const CacheFile *cf, AST *view) {
+    const CacheHeader *h = cf->map;
+    char *base = cf->map;
+
+    memset(view, 0, sizeof(*view));
+    view->kind = (unsigned char *)(base + h->off_kind);
+    view->aux = (unsigned char *)(base + h->off_aux);
+    view->a = (unsigned *)(base + h->off_a);
+    view->b = (unsigned *)(base + h->off_b);
+    view->c = (unsigned *)(base + h->off_c);
+    view->extra = (NodeId *)(base + h->off_extra);
+    view->count = h->count;
+    view->extra_len = h->extra_len;
+    view->root = h->root;
+}
+
+// Children are made before their parents, so a child's id is below its
+// parent's; requiring that also keeps a damaged tree from looping
+static int expr_ok(const AST *t, NodeId child, NodeId parent) {
+    return child && child < parent && t->kind[child] >= NODE_BINOP;
+}
+
+// Statements come first in NodeType; a missing one is allowed
+static int stmt_ok(const AST *t, NodeId child, NodeId parent) {
+    return !child || (child < parent && t->kind[child] <= NODE_BLOCK);
+}
+
+static int list_ok(const AST *t, NodeId n) {
+    unsigned first = t->a[n], count = t->b[n];
+    if (first > t->extra_len || count > t->extra_len - first)
+        return 0;
+    for (unsigned i = 0; i < count; i++)
+        if (!t->extra[first + i] || !stmt_ok(t, t->extra[first + i], n))
+            return 0;
+    return 1;
+}
+
+static int node_ok(const AST *t, NodeId n, unsigned natoms) {
+    unsigned aux = t->aux[n], a = t->a[n], b = t->b[n], c = t->c[n];
+    int names = a >= 1 && a <= natoms;
+
+    switch (t->kind[n]) {
+        case NODE_STMT_LIST:
+        case NODE_BLOCK:
+            return list_ok(t, n);
+        case NODE_DECL:
+            return names && expr_ok(t, b, n);
+        case NODE_PRINT:
+            return aux <= TYPE_STRING && expr_ok(t, a, n);
+        case NODE_IF:
+            return expr_ok(t, a, n) && stmt_ok(t, b, n) && stmt_ok(t, c, n);
+        case NODE_FOR:
+            if (!names || !expr_ok(t, b, n) ||
+                t->extra_len < 2 || c > t->extra_len - 2)
+                return 0;
+            return expr_ok(t, ast_for_to(t, n), n) &&
+                   stmt_ok(t, ast_for_body(t, n), n);
+        case NODE_BINOP:
+            return aux && strchr("+-*/^<>GLEN", (int)aux) &&
+                   expr_ok(t, a, n) && expr_ok(t, b, n);
+        case NODE_LITERAL:
+            return aux < TYPE_STRING || (aux == TYPE_STRING && names);
+        case NODE_ID:
+            return names;
+    }
+    return 0;
+}
+
+// Every later pass trusts the tree, so each node is checked once here
+static int tree_ok(const CacheFile *cf, const CacheHeader *h) {
+    AST t;
+    map_tree(cf, &t);
+    for (unsigned i = 1; i < t.count; i++)
+        if (!node_ok(&t, i, h->natoms))
+            return 0;
+    return !t.root || t.kind[t.root] == NODE_STMT_LIST;
+}
+
+
+// Interns the stored atoms; 0 if the table runs past the file
+static int read_atoms(CacheFile *cf, const CacheHeader *h) {
+    const char *base = cf->map;
+    const unsigned *lens = (const unsigned *)(base + h->off_atoms);
+    const char *s = (const char *)(lens + h->natoms);
+    const char *end = base + h->size;
+
+    cf->remap = xrealloc(cf->remap, (h->natoms + 1) * sizeof(Atom));
+    cf->remap[0] = ATOM_NONE;
+    cf->same_atoms = 1;
+
+    for (unsigned i = 1; i <= h->natoms; i++) {
+        unsigned len = lens[i - 1];
+        if (len > (size_t)(end - s)) return 0;
+        cf->remap[i] = intern(s, len);
+        if (cf->remap[i] != (Atom)i)
+            cf->same_atoms = 0;
+        s += len;
+    }
+    return 1;
+}
+
+
+int cache_open(CacheFile *cf, const char *dir, const char *src, size_t len) {
+    memset(cf, 0, sizeof(*cf));
+    cf->hash = hash_source(src, len);
+    cf->src = src;
+    cf->src_len = len;
+
+    size_t n = strlen(dir) + 32;
+    cf->path = xrealloc(NULL, n);
+    snprintf(cf->path, n, "%s/%016llx.nvc", dir, cf->hash);
+
+    cf->map = map_file(cf->path, &cf->size);
+    if (!cf->map) return 0;
+
+    const CacheHeader *h = cf->map;
+    if (!header_ok(h, cf->size, cf->hash, len) ||
+        memcmp((const char *)cf->map + h->off_src, src, len) != 0 ||
+        !tree_ok(cf, h) || !read_atoms(cf, h)) {
+        unmap_file(cf->map, cf->size);
+        cf->map = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+
+void cache_close(CacheFile *cf) {
+    if (cf->map)
+        unmap_file(cf->map, cf->size);
+    free(cf->path);
+    free(cf->remap);
+    memset(cf, 0, sizeof(*cf));
+}
+
+
+/* ---- Reading the tree ---- */
+
+int cache_view(const CacheFile *cf, AST *view) {
+    if (!cf->same_atoms) return 0;
+    map_tree(cf, view);
+    return 1;
+}
+
+
+void cache_load(const CacheFile *cf, AST *t) {
+    const CacheHeader *h = cf->map;
+    const char *base = cf->map;
+    unsigned n = h->count;
+
+    ast_reset(t);
+    ast_reserve(t, n, h->extra_len);
+    memcpy(t->kind, base + h->off_kind, n);
+    memcpy(t->aux, base + h->off_aux, n);
+    memcpy(t->a, base + h->off_a, n * sizeof(unsigned));
+    memcpy(t->b, base + h->off_b, n * sizeof(unsigned));
+    memcpy(t->c, base + h->off_c, n * sizeof(unsigned));
+    memcpy(t->extra, base + h->off_extra, h->extra_len * sizeof(NodeId));
+    t->count = n;
+    t->extra_len = h->extra_len;
+    t->root = h->root;
+
+    if (cf->same_atoms) return;
+
+    for (unsigned i = 1; i < n; i++)
+        if (names_atom(t, i) && t->a[i] <= h->natoms)
+            t->a[i] = cf->remap[t->a[i]];
+}
+
+
+/* ---- Writing ---- */
+
+static unsigned long long align(OutBuf *ob) {
+    static const char pad[8];
+    ob_write(ob, pad, (size_t)(-ob->len & 7));
+    return ob->len;
+}
+
+static unsigned long long section(OutBuf *ob, const void *p, size_t n) {
+    unsigned long long off = align(ob);
+    ob_write(ob, p, n);
+    return off;
+}
+
+// A node field; slot 0 is never written, so it is stored as zeros
+static unsigned long long field(OutBuf *ob, const void *p, size_t size, unsigned count) {
+    static const char zero[8];
+    unsigned long long off = align(ob);
+    ob_write(ob, zero, size);
+    ob_write(ob, (const char *)p + size, (count - 1) * size);
+    return off;
+}
+
+/*
+ * Fills stored with the atoms t names, in node order, and field_a with
+ * t->a renumbered to 1..count in that order. Returns the count.
+ */
+static unsigned collect_atoms(const AST *t) {
+    int natoms = atom_count() + 1;
+    if (natoms > stored_cap) {
+        stored_id = xrealloc(stored_id, natoms * 2 * sizeof(unsigned));
+        memset(stored_id + stored_cap, 0, (natoms * 2 - stored_cap) * sizeof(unsigned));
+        stored_cap = natoms * 2;
+    }
+    if (t->count > scratch_cap) {
+        scratch_cap = t->count * 2;
+        stored = xrealloc(stored, scratch_cap * sizeof(Atom));
+        field_a = xrealloc(field_a, scratch_cap * sizeof(unsigned));
+    }
+
+    unsigned n = 0;
+    for (unsigned i = 1; i < t->count; i++)
+        if (names_atom(t, i) && t->a[i] != ATOM_NONE && !stored_id[t->a[i]]) {
+            stored[n++] = t->a[i];
+            stored_id[t->a[i]] = n;
+        }
+
+    for (unsigned i = 1; i < t->count; i++)
+        field_a[i] = names_atom(t, i) ? stored_id[t->a[i]] : t->a[i];
+
+    for (unsigned k = 0; k < n; k++)
+        stored_id[stored[k]] = 0;
+    return n;
+}
+
+
+int cache_save(const CacheFile *cf, const AST *t) {
+    CacheHeader h;
+    OutBuf ob;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, magic, 4);
+    h.version = CACHE_VERSION;
+    h.hash = cf->hash;
+    h.src_len = cf->src_len;
+    h.count = t->count;
+    h.extra_len = t->extra_len;
+    h.root = t->root;
+    h.natoms = collect_atoms(t);
+
+    ob_init(&ob);
+    ob_write(&ob, (const char *)&h, sizeof(h));
+    h.off_a = field(&ob, field_a, sizeof(unsigned), t->count);
+    h.off_b = field(&ob, t->b, sizeof(unsigned), t->count);
+    h.off_c = field(&ob, t->c, sizeof(unsigned), t->count);
+    h.off_extra = section(&ob, t->extra, t->extra_len * sizeof(NodeId));
+    h.off_kind = field(&ob, t->kind, 1, t->count);
+    h.off_aux = field(&ob, t->aux, 1, t->count);
+
+    h.off_atoms = align(&ob);
+    for (unsigned k = 0; k < h.natoms; k++) {
+        unsigned len = atom_len(stored[k]);
+        ob_write(&ob, (const char *)&len, sizeof(len));
+    }
+    for (unsigned k = 0; k < h.natoms; k++)
+        ob_write(&ob, atom_str(stored[k]), atom_len(stored[k]));
+    h.off_src = section(&ob, cf->src, cf->src_len);
+
+    h.size = ob.len;
+    memcpy(ob.data, &h, sizeof(h));
+
+    size_t n = strlen(cf->path) + 32;
+    char *tmp = xrealloc(NULL, n);
+    snprintf(tmp, n, "%s.%d.%p.tmp", cf->path, (int)getpid(), (const void *)cf);
+
+    int rc = ob_save(&ob, tmp);
+    if (rc == 0 && rename(tmp, cf->path) != 0) {
+        // Another compiler got there first with the same contents
+        remove(tmp);
+    }
+    free(tmp);
+    ob_free(&ob);
+    return rc;
+}
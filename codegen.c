@@ -3,328 +3,1034 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
 
-static FILE *out;
-static int label_id = 0;
+static _Thread_local OutBuf *out;
+static _Thread_local int label_id = 0;
 
 
 
 
+// Only %d, %s and %c are used by the code generator
 static void emit(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    vfprintf(out, fmt, args);
-    fprintf(out, "\n");
+
+    const char *p = fmt;
+    for (;;) {
+        const char *q = p;
+        while (*q && *q != '%')
+            q++;
+        ob_write(out, p, q - p);
+        if (!*q) break;
+
+        switch (q[1]) {
+            case 'd': ob_int(out, va_arg(args, int)); break;
+            case 's': ob_puts(out, va_arg(args, const char *)); break;
+            case 'c': ob_putc(out, (char)va_arg(args, int)); break;
+            default: ob_putc(out, q[1]); break;
+        }
+        p = q + 2;
+    }
+
+    ob_putc(out, '\n');
     va_end(args);
 }
 
 
 
-typedef struct Var {
-    char *name;
-    struct Var *next;
-} Var;
+/*
+ * Constant pool: atoms in insertion order plus an open-addressing index
+ * into that order. The position of an atom is its id, so the .data
+ * section comes out in first-use order on every run.
+ */
+typedef struct Pool {
+    Atom *items;
+    int len;
+    int cap;
+    int *index;         // -1 = empty slot
+    unsigned mask;
+} Pool;
 
-static Var *vars = NULL;
+static _Thread_local Pool strings;
 
-static int var_exists(const char *name) {
-    for (Var *v = vars; v; v = v->next)
-        if (strcmp(v->name, name) == 0) return 1;
-    return 0;
+
+static void pool_reset(Pool *p) {
+    p->len = 0;
+    if (p->index)
+        memset(p->index, -1, (p->mask + 1) * sizeof(int));
+}
+
+
+static int *pool_slot(Pool *p, Atom a) {
+    unsigned i = ((unsigned)a * 2654435761u) & p->mask;
+    while (p->index[i] >= 0 && p->items[p->index[i]] != a)
+        i = (i + 1) & p->mask;
+    return &p->index[i];
+}
+
+
+static int pool_find(Pool *p, Atom a) {
+    if (!p->index) return -1;
+    return *pool_slot(p, a);
+}
+
+
+static int pool_add(Pool *p, Atom a) {
+    int id = pool_find(p, a);
+    if (id >= 0) return id;
+
+    // Keep the load factor under one half
+    if ((unsigned)(p->len + 1) * 2 > (p->index ? p->mask + 1 : 0)) {
+        unsigned cap = p->index ? (p->mask + 1) * 2 : 256;
+        free(p->index);
+        p->index = xrealloc(NULL, cap * sizeof(int));
+        p->mask = cap - 1;
+        memset(p->index, -1, cap * sizeof(int));
+        for (int i = 0; i < p->len; i++)
+            *pool_slot(p, p->items[i]) = i;
+    }
+
+    if (p->len == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 256;
+        p->items = xrealloc(p->items, p->cap * sizeof(Atom));
+    }
+
+    id = p->len++;
+    p->items[id] = a;
+    *pool_slot(p, a) = id;
+    return id;
 }
 
-static void add_var(const char *name) {
-    if (var_exists(name)) return;
-    Var *v = malloc(sizeof(Var));
-    v->name = strdup(name);
-    v->next = vars;
-    vars = v;
+
+static void add_string(Atom s) {
+    pool_add(&strings, s);
+}
+
+static int find_string(Atom s) {
+    return pool_find(&strings, s);
+}
+
+
+
+
+/*
+ * Instruction selection from the optimized SSA IR.
+ *
+ * Blocks are laid out in reverse postorder and every block and
+ * instruction gets a position. Each SSA value's live range is reduced
+ * to one interval [lo, hi] over those positions, found by walking back
+ * from every use to the definition. A phi and its arguments are put in
+ * one class when their intervals do not overlap, so that they share a
+ * location and the phi costs no copies; the classes are then given the
+ * registers BX, CX, SI, DI and DX by linear scan, and TMP_n words when
+ * those run out.
+ *
+ * AX is never allocated: it is the accumulator for every instruction
+ * that needs one and the temporary for memory-to-memory moves. DX is
+ * only given to intervals that no mul, div or string print lies inside.
+ * print_int and pow_int preserve every register but AX.
+ *
+ * Phis are resolved with parallel copies at the end of each
+ * predecessor. A predecessor ending in a conditional branch gets the
+ * copies on an out-of-line edge stub instead, unless the edge can fall
+ * through. A compare whose only use is the branch right after it is
+ * fused with the branch.
+ *
+ * The x86-64 target uses the same selection with eight more registers.
+ * Values sit in 64-bit registers but keep Nova's 16-bit range: a result
+ * that can leave it is sign-extended from its low word again, so both
+ * targets and the constant folders agree on every program. R11 is the
+ * scratch register of the x86-64 code and never allocated.
+ */
+static const char *reg_name[NUM_REGS] = {
+    "ax", "bx", "cx", "dx", "si", "di", "ah"
+};
+
+// DX last since mul and div clobber it
+static const int alloc_8086[] = { BX, CX, SI, DI, DX };
+static const int alloc_x64[] = {
+    BX, CX, SI, DI, R8, R9, R10, R12, R13, R14, R15, DX
+};
+
+static _Thread_local Target target;
+static _Thread_local const int *alloc_order;
+static _Thread_local int num_alloc;
+
+static _Thread_local int uses_pow = 0;
+static _Thread_local int spill_max = 0;
+
+static _Thread_local InsnList code;
+
+
+static Operand reg(int r) {
+    Operand o = { O_REG, 0, r };
+    return o;
+}
+
+static Operand imm(int v) {
+    Operand o = { O_IMM, 0, v };
+    return o;
+}
+
+static Operand tmp(int slot) {
+    Operand o = { O_TMP, 0, slot };
+    return o;
+}
+
+static Operand label(LabelKind kind, int id) {
+    Operand o = { O_LABEL, kind, id };
+    return o;
+}
+
+static Operand proc(Proc p) {
+    Operand o = { O_PROC, 0, p };
+    return o;
+}
+
+static const Operand none = { O_NONE, 0, 0 };
+
+
+static void ins(InsnOp op, Operand dst, Operand src) {
+    if (code.len == code.cap) {
+        code.cap = code.cap ? code.cap * 2 : 1024;
+        code.items = xrealloc(code.items, code.cap * sizeof(Insn));
+    }
+    Insn *in = &code.items[code.len++];
+    in->op = op;
+    in->dst = dst;
+    in->src = src;
 }
 
-typedef struct Str {
-    char *label;
-    char *value;
-    struct Str *next;
-} Str;
+static void ins1(InsnOp op, Operand dst) {
+    ins(op, dst, none);
+}
 
-static Str *strings = NULL;
-static int str_id = 0;
+static void place(LabelKind kind, int id) {
+    STAT_ADD(labels, 1);
+    ins1(I_LABEL, label(kind, id));
+}
 
-static void add_string(const char *s) {
-    for (Str *p = strings; p; p = p->next)
-        if (strcmp(p->value, s) == 0) return;
 
-    Str *n = malloc(sizeof(Str));
-    char buf[32];
-    sprintf(buf, "STR_%d", str_id++);
-    n->label = strdup(buf);
-    n->value = strdup(s);
-    n->next = strings;
-    strings = n;
+/* ---- Per-value and per-block tables, kept between compilations ---- */
+
+static _Thread_local int *parent = NULL;          // union-find over values
+static _Thread_local int *lo = NULL;              // live interval, per value then per class
+static _Thread_local int *hi = NULL;
+static _Thread_local int *vlo = NULL;             // live interval of each value alone
+static _Thread_local int *vhi = NULL;
+static _Thread_local int *member = NULL;          // next value in the same class, circular
+static _Thread_local int *size = NULL;            // members in a class, per class root
+static _Thread_local int *def_blk = NULL;
+static _Thread_local int *uses = NULL;
+static _Thread_local unsigned char *no_dx = NULL;
+static _Thread_local unsigned char *fused = NULL; // compare folded into its branch
+static _Thread_local Operand *loc = NULL;         // per class root
+static _Thread_local int val_cap = 0;
+
+static _Thread_local int *blk_start = NULL;
+static _Thread_local int *seen = NULL;            // liveness walk, last value per block
+static _Thread_local int blk_cap = 0;
+
+static _Thread_local int *clobbers = NULL;        // DX clobbers at positions <= p
+static _Thread_local int pos_cap = 0;
+
+static _Thread_local int *stack = NULL;            // blocks left to visit
+static _Thread_local int stack_len = 0;
+static _Thread_local int stack_cap = 0;
+
+
+static void grow_tables(const IrFunc *f) {
+    if (f->nvals > val_cap) {
+        val_cap = f->nvals * 2;
+        parent = xrealloc(parent, val_cap * sizeof(int));
+        lo = xrealloc(lo, val_cap * sizeof(int));
+        hi = xrealloc(hi, val_cap * sizeof(int));
+        vlo = xrealloc(vlo, val_cap * sizeof(int));
+        vhi = xrealloc(vhi, val_cap * sizeof(int));
+        member = xrealloc(member, val_cap * sizeof(int));
+        size = xrealloc(size, val_cap * sizeof(int));
+        def_blk = xrealloc(def_blk, val_cap * sizeof(int));
+        uses = xrealloc(uses, val_cap * sizeof(int));
+        no_dx = xrealloc(no_dx, val_cap);
+        fused = xrealloc(fused, val_cap);
+        loc = xrealloc(loc, val_cap * sizeof(Operand));
+    }
+    if (f->nblocks > blk_cap) {
+        blk_cap = f->nblocks * 2;
+        blk_start = xrealloc(blk_start, blk_cap * sizeof(int));
+        seen = xrealloc(seen, blk_cap * sizeof(int));
+    }
 }
 
-static char *find_string(const char *s) {
-    for (Str *p = strings; p; p = p->next)
-        if (strcmp(p->value, s) == 0)
-            return p->label;
-    return NULL;
+static void push(int v) {
+    if (stack_len == stack_cap) {
+        stack_cap = stack_cap ? stack_cap * 2 : 256;
+        stack = xrealloc(stack, stack_cap * sizeof(int));
+    }
+    stack[stack_len++] = v;
 }
 
 
+static int find(int v) {
+    while (parent[v] != v) {
+        parent[v] = parent[parent[v]];
+        v = parent[v];
+    }
+    return v;
+}
 
 
-static ASTNode *fold(ASTNode *n) {
-    if (!n || n->type != NODE_BINOP) return n;
+static int blk_end(const IrFunc *f, int b) {
+    return blk_start[b] + 2 * (f->blocks[b].len + 1);
+}
 
-    n->left = fold(n->left);
-    n->right = fold(n->right);
-    if (n->left->type == NODE_LITERAL &&
-        n->right->type == NODE_LITERAL &&
-        n->left->vtype == TYPE_INT &&
-        n->right->vtype == TYPE_INT) {
+static int inst_pos(int b, int k) {
+    return blk_start[b] + 2 * (k + 1);
+}
 
-        int a = n->left->ival;
-        int b = n->right->ival;
-        int r;
 
-        switch (n->op) {
-            case '+': r = a + b; break;
-            case '-': r = a - b; break;
-            case '*': r = a * b; break;
-            case '/': if (b == 0) return n; r = a / b; break;
-            default: return n;
+/*
+ * div by a constant needs the divisor in a register, so it gets a value
+ * of its own. (Powers of two were turned into shifts by constprop.)
+ */
+static void legalize(IrFunc *f) {
+    static _Thread_local IrInst *scratch = NULL;
+    static _Thread_local int scratch_cap = 0;
+
+    for (int i = 0; i < f->nrpo; i++) {
+        int b = f->rpo[i];
+        IrBlock *bb = &f->blocks[b];
+        int need = 0;
+        for (int k = 0; k < bb->len; k++)
+            if (bb->insts[k].op == IR_DIV && bb->insts[k].b.kind != ARG_VAL)
+                need = 1;
+        if (!need) continue;
+
+        int n = bb->len;
+        if (n > scratch_cap) {
+            scratch_cap = n * 2;
+            scratch = xrealloc(scratch, scratch_cap * sizeof(IrInst));
+        }
+        memcpy(scratch, bb->insts, n * sizeof(IrInst));
+        bb->len = 0;
+
+        for (int k = 0; k < n; k++) {
+            IrInst in = scratch[k];
+            if (in.op == IR_DIV && in.b.kind != ARG_VAL) {
+                int t = ir_new_value(f, ATOM_NONE);
+                ir_emit(f, b, IR_COPY, t, in.b, in.b);
+                in.b = ir_val(t);
+            }
+            ir_emit(f, b, in.op, in.dst, in.a, in.b);
         }
-        ASTNode *lit = make_int(r);
-        // free_ast(n); // Prevent double-free since tree structure isn't updated
-        return lit;
     }
-    return n;
 }
 
-static void collect_data(ASTNode *n) {
-    if (!n) return;
 
-    switch (n->type) {
-        case NODE_DECL:
-            add_var(n->name);
-            collect_data(n->left);
-            break;
+static void count_use(IrArg a) {
+    if (a.kind == ARG_VAL)
+        uses[a.val]++;
+    else if (a.kind == ARG_STR)
+        add_string(a.val);
+}
 
-        case NODE_FOR:
-            add_var(n->name);
-            collect_data(n->left);
-            collect_data(n->right);
-            collect_data(n->body);
-            break;
+/* Positions, definitions, use counts, and which compares fuse */
+static int number(const IrFunc *f) {
+    int pos = 0;
+    for (int i = 0; i < f->nrpo; i++) {
+        int b = f->rpo[i];
+        blk_start[b] = pos;
+        seen[b] = 0;
+        pos = blk_end(f, b) + 2;
+    }
 
-        case NODE_LITERAL:
-            if (n->vtype == TYPE_STRING)
-                add_string(n->sval);
-            break;
+    for (int v = 0; v < f->nvals; v++) {
+        parent[v] = v;
+        lo[v] = INT_MAX;
+        hi[v] = -1;
+        def_blk[v] = -1;
+        uses[v] = 0;
+        no_dx[v] = 0;
+        fused[v] = 0;
+    }
 
-        case NODE_BINOP:
-            collect_data(n->left);
-            collect_data(n->right);
-            break;
+    for (int i = 0; i < f->nrpo; i++) {
+        int b = f->rpo[i];
+        const IrBlock *bb = &f->blocks[b];
+
+        for (int p = 0; p < bb->nphis; p++) {
+            const IrInst *phi = &bb->phis[p];
+            if (phi->op != IR_PHI) continue;
+            def_blk[phi->dst] = b;
+            lo[phi->dst] = hi[phi->dst] = blk_start[b];
+            for (int k = 0; k < bb->npreds; k++)
+                count_use(phi->phi[k]);
+        }
+        for (int k = 0; k < bb->len; k++) {
+            const IrInst *in = &bb->insts[k];
+            if (in->op == IR_NOP) continue;
+            if (in->dst) {
+                def_blk[in->dst] = b;
+                lo[in->dst] = hi[in->dst] = inst_pos(b, k);
+            }
+            count_use(in->a);
+            count_use(in->b);
+            if (in->op == IR_DIV && in->b.kind == ARG_VAL)
+                no_dx[in->b.val] = 1;
+        }
+    }
 
-        case NODE_PRINT:
-            collect_data(n->left);
-            break;
+    for (int i = 0; i < f->nrpo; i++) {
+        const IrBlock *bb = &f->blocks[f->rpo[i]];
+        int k = bb->len - 1;
+        if (k < 0 || bb->insts[k].op != IR_BR || bb->insts[k].a.kind != ARG_VAL)
+            continue;
+        int c = bb->insts[k].a.val;
+        while (--k >= 0 && bb->insts[k].op == IR_NOP)
+            ;
+        if (k >= 0 && bb->insts[k].dst == c && ir_is_compare(bb->insts[k].op) &&
+            uses[c] == 1)
+            fused[c] = 1;
+    }
+    return pos;
+}
 
-        case NODE_IF:
-            collect_data(n->cond);
-            collect_data(n->body);
-            collect_data(n->else_body);
-            break;
 
-        case NODE_STMT_LIST:
-            collect_data(n->left);
-            collect_data(n->right);
-            break;
+static void extend(int v, int p) {
+    if (p < lo[v]) lo[v] = p;
+    if (p > hi[v]) hi[v] = p;
+}
 
-        case NODE_BLOCK:
-            collect_data(n->body);
-            break;
+// v is used at pos in block b: it is live from its def up to there
+static void live_use(const IrFunc *f, int v, int b, int pos) {
+    extend(v, pos);
+    int d = def_blk[v];
+    if (b == d || d < 0 || seen[b] == v) return;
+
+    seen[b] = v;
+    extend(v, blk_start[b]);
+    stack_len = 0;
+    for (int i = 0; i < f->blocks[b].npreds; i++)
+        push(f->blocks[b].preds[i]);
+
+    while (stack_len) {
+        int p = stack[--stack_len];
+        if (f->blocks[p].order < 0) continue;
+
+        // Live out of p, which may be a use block reached by a back edge
+        extend(v, blk_end(f, p));
+        if (p == d || seen[p] == v) continue;
+
+        seen[p] = v;
+        extend(v, blk_start[p]);
+        for (int i = 0; i < f->blocks[p].npreds; i++)
+            push(f->blocks[p].preds[i]);
+    }
+}
 
-        default:
-            break;
+static void liveness(const IrFunc *f) {
+    for (int i = 0; i < f->nrpo; i++) {
+        int b = f->rpo[i];
+        const IrBlock *bb = &f->blocks[b];
+
+        for (int p = 0; p < bb->nphis; p++) {
+            const IrInst *phi = &bb->phis[p];
+            if (phi->op != IR_PHI) continue;
+            for (int k = 0; k < bb->npreds; k++) {
+                int pred = bb->preds[k];
+                if (phi->phi[k].kind == ARG_VAL)
+                    live_use(f, phi->phi[k].val, pred, blk_end(f, pred));
+            }
+        }
+        for (int k = 0; k < bb->len; k++) {
+            const IrInst *in = &bb->insts[k];
+            if (in->op == IR_NOP) continue;
+            if (in->a.kind == ARG_VAL)
+                live_use(f, in->a.val, b, inst_pos(b, k));
+            if (in->b.kind == ARG_VAL)
+                live_use(f, in->b.val, b, inst_pos(b, k));
+        }
     }
 }
 
-static void gen_expr(ASTNode *n) {
-    if (!n) return;
 
-    if (!n) return;
+static int overlap(int x, int y) {
+    return vlo[x] < vhi[y] && vlo[y] < vhi[x];
+}
 
-    n = fold(n);
+// Whether any member of class x is live where one of class y is
+static int interferes(int x, int y) {
+    if (size[x] * size[y] > 4096)
+        return 1;
+
+    int a = x;
+    do {
+        int b = y;
+        do {
+            if (overlap(a, b)) return 1;
+            b = member[b];
+        } while (b != y);
+        a = member[a];
+    } while (a != x);
+    return 0;
+}
 
-    switch (n->type) {
-        case NODE_LITERAL:
-            emit("    mov ax, %d", n->ival);
-            break;
+/*
+ * A phi and an argument can share a location when no member of one
+ * class is live at the same time as a member of the other. The class
+ * is then allocated as one interval over all of its members.
+ */
+static void coalesce(const IrFunc *f) {
+    for (int v = 0; v < f->nvals; v++) {
+        member[v] = v;
+        size[v] = 1;
+        vlo[v] = lo[v];
+        vhi[v] = hi[v];
+    }
 
-        case NODE_ID:
-            emit("    mov ax, [%s]", n->name);
-            break;
+    for (int i = 0; i < f->nrpo; i++) {
+        const IrBlock *bb = &f->blocks[f->rpo[i]];
+        for (int p = 0; p < bb->nphis; p++) {
+            const IrInst *phi = &bb->phis[p];
+            if (phi->op != IR_PHI) continue;
+
+            for (int k = 0; k < bb->npreds; k++) {
+                if (phi->phi[k].kind != ARG_VAL) continue;
+                int x = find(phi->dst), y = find(phi->phi[k].val);
+                if (x == y || interferes(x, y))
+                    continue;
+
+                parent[y] = x;
+                int t = member[x];
+                member[x] = member[y];
+                member[y] = t;
+                size[x] += size[y];
+                if (lo[y] < lo[x]) lo[x] = lo[y];
+                if (hi[y] > hi[x]) hi[x] = hi[y];
+                no_dx[x] |= no_dx[y];
+            }
+        }
+    }
+}
 
-        case NODE_BINOP:
-            gen_expr(n->left);
-            emit("    push ax");
-            gen_expr(n->right);
-            emit("    pop bx");
-
-            switch (n->op) {
-                case '+': emit("    add ax, bx"); break;
-                case '-': 
-                    emit("    sub bx, ax");
-                    emit("    mov ax, bx");
-                    break;
-                case '*': emit("    mul bx"); break;
-                case '/':
-                    emit("    xor dx, dx");
-                    emit("    div bx");
-                    break;
-                case '>': {
-                    int l = label_id++;
-                    emit("    cmp bx, ax");
-                    emit("    jg L_TRUE_%d", l);
-                    emit("    mov ax, 0");
-                    emit("    jmp L_END_%d", l);
-                    emit("L_TRUE_%d:", l);
-                    emit("    mov ax, 1");
-                    emit("L_END_%d:", l);
-                    break;
-                }
-                case '<': {
-                    int l = label_id++;
-                    emit("    cmp bx, ax");
-                    emit("    jl L_TRUE_%d", l);
-                    emit("    mov ax, 0");
-                    emit("    jmp L_END_%d", l);
-                    emit("L_TRUE_%d:", l);
-                    emit("    mov ax, 1");
-                    emit("L_END_%d:", l);
-                    break;
-                }
-                case 'G': {
-                    int l = label_id++;
-                    emit("    cmp bx, ax");
-                    emit("    jge L_TRUE_%d", l);
-                    emit("    mov ax, 0");
-                    emit("    jmp L_END_%d", l);
-                    emit("L_TRUE_%d:", l);
-                    emit("    mov ax, 1");
-                    emit("L_END_%d:", l);
-                    break;
-                }
-                case 'L': {
-                    int l = label_id++;
-                    emit("    cmp bx, ax");
-                    emit("    jle L_TRUE_%d", l);
-                    emit("    mov ax, 0");
-                    emit("    jmp L_END_%d", l);
-                    emit("L_TRUE_%d:", l);
-                    emit("    mov ax, 1");
-                    emit("L_END_%d:", l);
-                    break;
-                }
-                case 'E': {
-                    int l = label_id++;
-                    emit("    cmp bx, ax");
-                    emit("    je L_TRUE_%d", l);
-                    emit("    mov ax, 0");
-                    emit("    jmp L_END_%d", l);
-                    emit("L_TRUE_%d:", l);
-                    emit("    mov ax, 1");
-                    emit("L_END_%d:", l);
-                    break;
-                }
-                case 'N': {
-                    int l = label_id++;
-                    emit("    cmp bx, ax");
-                    emit("    jne L_TRUE_%d", l);
-                    emit("    mov ax, 0");
-                    emit("    jmp L_END_%d", l);
-                    emit("L_TRUE_%d:", l);
-                    emit("    mov ax, 1");
-                    emit("L_END_%d:", l);
+
+// Instructions that overwrite DX on the current target
+static int clobbers_dx(int op) {
+    if (op == IR_DIV)
+        return 1;
+    return target == TARGET_8086 && (op == IR_MUL || op == IR_PRINTS);
+}
+
+static int by_start(const void *x, const void *y) {
+    return lo[*(const int *)x] - lo[*(const int *)y];
+}
+
+static int dx_ok(int c) {
+    if (no_dx[c]) return 0;
+    return hi[c] - 1 < lo[c] || clobbers[hi[c] - 1] == clobbers[lo[c]];
+}
+
+static void allocate(const IrFunc *f, int npos) {
+    static _Thread_local int *order = NULL, *spilled = NULL, *free_slots = NULL;
+    static _Thread_local int *slot_end = NULL;
+    static _Thread_local int order_cap = 0;
+
+    if (npos + 1 > pos_cap) {
+        pos_cap = (npos + 1) * 2;
+        clobbers = xrealloc(clobbers, pos_cap * sizeof(int));
+    }
+    memset(clobbers, 0, (npos + 1) * sizeof(int));
+    for (int i = 0; i < f->nrpo; i++) {
+        int b = f->rpo[i];
+        const IrBlock *bb = &f->blocks[b];
+        for (int k = 0; k < bb->len; k++) {
+            if (clobbers_dx(bb->insts[k].op))
+                clobbers[inst_pos(b, k)] = 1;
+        }
+    }
+    for (int p = 1; p <= npos; p++)
+        clobbers[p] += clobbers[p - 1];
+
+    if (f->nvals > order_cap) {
+        order_cap = f->nvals * 2;
+        order = xrealloc(order, order_cap * sizeof(int));
+        spilled = xrealloc(spilled, order_cap * sizeof(int));
+        free_slots = xrealloc(free_slots, order_cap * sizeof(int));
+        slot_end = xrealloc(slot_end, order_cap * sizeof(int));
+    }
+
+    int n = 0;
+    for (int v = 1; v < f->nvals; v++)
+        if (find(v) == v && hi[v] >= 0 && !fused[v])
+            order[n++] = v;
+    qsort(order, n, sizeof(int), by_start);
+
+    int holder[NUM_REGS];
+    for (int r = 0; r < NUM_REGS; r++)
+        holder[r] = -1;
+    int nspilled = 0, nfree = 0;
+    spill_max = 0;
+
+    for (int i = 0; i < n; i++) {
+        int c = order[i];
+
+        // An interval may start where another one ends
+        for (int r = 0; r < NUM_REGS; r++)
+            if (holder[r] >= 0 && hi[holder[r]] <= lo[c])
+                holder[r] = -1;
+        for (int s = 0; s < nspilled; s++) {
+            if (hi[spilled[s]] <= lo[c]) {
+                slot_end[loc[spilled[s]].val] = hi[spilled[s]];
+                free_slots[nfree++] = loc[spilled[s]].val;
+                spilled[s--] = spilled[--nspilled];
+            }
+        }
+
+        int use_dx = dx_ok(c);
+        int r = -1, victim = -1;
+        for (int j = 0; j < num_alloc && r < 0; j++) {
+            int cand = alloc_order[j];
+            if (cand == DX && !use_dx) continue;
+            if (holder[cand] < 0)
+                r = cand;
+            else if (victim < 0 || hi[holder[cand]] > hi[holder[victim]])
+                victim = cand;
+        }
+
+        // Out of registers: whichever interval ends last goes to memory
+        int spill = c;
+        if (r < 0 && victim >= 0 && hi[holder[victim]] > hi[c]) {
+            spill = holder[victim];
+            r = victim;
+        }
+        if (r >= 0) {
+            holder[r] = c;
+            loc[c] = reg(r);
+        }
+        if (r < 0 || spill != c) {
+            // A victim is in memory over its whole interval, so its slot
+            // must have been free since before the victim started
+            int slot = -1;
+            for (int s = nfree - 1; s >= 0 && slot < 0; s--) {
+                if (slot_end[free_slots[s]] <= lo[spill]) {
+                    slot = free_slots[s];
+                    free_slots[s] = free_slots[--nfree];
                 }
             }
-            break;
-        default:
-            break;
+            if (slot < 0)
+                slot = spill_max++;
+            loc[spill] = tmp(slot);
+            spilled[nspilled++] = spill;
+        }
     }
 }
 
-static void gen_stmt(ASTNode *n) {
-    if (!n) return;
 
-    switch (n->type) {
-        case NODE_STMT_LIST:
-            gen_stmt(n->left);
-            gen_stmt(n->right);
-            break;
+/* ---- Selection ---- */
 
-        case NODE_DECL:
-            gen_expr(n->left);
-            emit("    mov [%s], ax", n->name);
-            break;
+static Operand arg(IrArg a) {
+    switch (a.kind) {
+        case ARG_CONST:
+            return imm(a.val);
+        case ARG_STR: {
+            Operand o = { O_STR, 0, find_string(a.val) };
+            return o;
+        }
+        case ARG_VAL:
+            return loc[find(a.val)];
+    }
+    return none;
+}
+
+static Operand val(int v) {
+    return loc[find(v)];
+}
+
+static int is_imm(Operand o) {
+    return o.kind == O_IMM || o.kind == O_STR;
+}
+
+static int same(Operand a, Operand b) {
+    return a.kind == b.kind && a.val == b.val;
+}
+
+static void move(Operand d, Operand s) {
+    if (same(d, s)) return;
+    if (d.kind == O_TMP && s.kind == O_TMP) {
+        ins(I_MOV, reg(AX), s);
+        s = reg(AX);
+    }
+    ins(I_MOV, d, s);
+}
+
+
+static InsnOp alu_op(int op) {
+    switch (op) {
+        case IR_ADD: return I_ADD;
+        case IR_SUB: return I_SUB;
+        case IR_SHL: return I_SHL;
+        default:     return I_SHR;
+    }
+}
+
+static void alu(InsnOp op, Operand d, Operand b) {
+    if (op == I_ADD && b.kind == O_IMM && b.val == 1)
+        ins1(I_INC, d);
+    else
+        ins(op, d, b);
+}
+
+// d = a op b, in place where the locations allow it
+static void gen_alu(int irop, Operand d, Operand a, Operand b) {
+    InsnOp op = alu_op(irop);
+    int both_mem = d.kind == O_TMP && (same(d, a) ? b : a).kind == O_TMP;
+
+    if (same(d, a) && !both_mem) {
+        alu(op, d, b);
+    } else if (irop == IR_ADD && same(d, b) && !both_mem) {
+        alu(op, d, a);
+    } else if (d.kind == O_REG && !same(d, b)) {
+        move(d, a);
+        alu(op, d, b);
+    } else {
+        ins(I_MOV, reg(AX), a);
+        alu(op, reg(AX), b);
+        ins(I_MOV, d, reg(AX));
+    }
+}
+
+static void gen_mul(Operand d, Operand a, Operand b) {
+    if (is_imm(b) && !is_imm(a)) {
+        Operand t = a;
+        a = b;
+        b = t;
+    }
+    ins(I_MOV, reg(AX), a);
+    if (is_imm(b)) {
+        ins(I_MOV, reg(DX), b);
+        b = reg(DX);
+    }
+    ins1(I_MUL, b);
+    ins(I_MOV, d, reg(AX));
+}
+
+// Back to the 16-bit range after an x86-64 result that may leave it
+static void normalize(Operand d) {
+    if (target != TARGET_X64) return;
+    if (d.kind == O_REG) {
+        ins(I_MOVSX, d, d);
+    } else {
+        ins(I_MOVSX, reg(AX), d);
+        ins(I_MOV, d, reg(AX));
+    }
+}
+
+// x86-64: the low word of a, zero-extended into r
+static void load_word(Operand r, Operand a) {
+    if (is_imm(a))
+        ins(I_MOV, r, imm(a.val & 0xFFFF));
+    else
+        ins(I_MOVZX, r, a);
+}
+
+static void gen_imul(Operand d, Operand a, Operand b) {
+    if (same(d, b) || (is_imm(a) && !is_imm(b))) {
+        Operand t = a;
+        a = b;
+        b = t;
+    }
+    Operand r = d.kind == O_REG ? d : reg(AX);
+    move(r, a);
+    ins(I_IMUL, r, b);
+    normalize(r);
+    move(d, r);
+}
+
+// Unsigned 16-bit divide, like the 8086 div
+static void gen_div_x64(Operand d, Operand a, Operand b) {
+    load_word(reg(AX), a);
+    load_word(reg(R11), b);
+    ins(I_XOR, reg(DX), reg(DX));
+    ins1(I_DIV, reg(R11));
+    ins(I_MOVSX, reg(AX), reg(AX));
+    ins(I_MOV, d, reg(AX));
+}
+
+// Logical shift of the low word; by at least 1 it stays in range
+static void gen_shr_x64(Operand d, Operand a, Operand b) {
+    Operand r = d.kind == O_REG ? d : reg(AX);
+    load_word(r, a);
+    ins(I_SHR, r, b);
+    if (b.val == 0)
+        normalize(r);
+    move(d, r);
+}
+
+static void push_arg(Operand a) {
+    if (is_imm(a)) {
+        ins(I_MOV, reg(AX), a);
+        a = reg(AX);
+    }
+    ins1(I_PUSH, a);
+}
+
+
+static InsnOp jump_if(int op) {
+    switch (op) {
+        case IR_GT: return I_JG;
+        case IR_LT: return I_JL;
+        case IR_GE: return I_JGE;
+        case IR_LE: return I_JLE;
+        case IR_EQ: return I_JE;
+        default:    return I_JNE;
+    }
+}
 
-        case NODE_PRINT:
-            if (n->left->type == NODE_LITERAL &&
-                n->left->vtype == TYPE_STRING) {
-                char *lbl = find_string(n->left->sval);
-                emit("    mov dx, offset %s", lbl);
-                emit("    mov ah, 09h");
-                emit("    int 21h");
+static InsnOp negate(InsnOp j) {
+    switch (j) {
+        case I_JG:  return I_JLE;
+        case I_JLE: return I_JG;
+        case I_JL:  return I_JGE;
+        case I_JGE: return I_JL;
+        case I_JE:  return I_JNE;
+        default:    return I_JE;
+    }
+}
+
+// a < b is b > a
+static int mirror(int op) {
+    switch (op) {
+        case IR_GT: return IR_LT;
+        case IR_LT: return IR_GT;
+        case IR_GE: return IR_LE;
+        case IR_LE: return IR_GE;
+        default:    return op;
+    }
+}
+
+// Emits the cmp and returns the jump taken when the compare holds
+static InsnOp gen_cmp(const IrInst *in) {
+    Operand a = arg(in->a), b = arg(in->b);
+    int op = in->op;
+
+    if (is_imm(a) && !is_imm(b)) {
+        Operand t = a;
+        a = b;
+        b = t;
+        op = mirror(op);
+    }
+    if (is_imm(a) || (a.kind == O_TMP && b.kind == O_TMP)) {
+        ins(I_MOV, reg(AX), a);
+        a = reg(AX);
+    }
+    ins(I_CMP, a, b);
+    return jump_if(op);
+}
+
+
+/* Parallel copies for the phis of block h on the edge from p */
+typedef struct Move {
+    Operand dst;
+    Operand src;
+} Move;
+
+static _Thread_local Move *moves = NULL;
+static _Thread_local int moves_cap = 0;
+
+static int collect_moves(const IrFunc *f, int p, int h) {
+    const IrBlock *hb = &f->blocks[h];
+    int k = 0;
+    while (hb->preds[k] != p)
+        k++;
+
+    if (hb->nphis > moves_cap) {
+        moves_cap = hb->nphis * 2;
+        moves = xrealloc(moves, moves_cap * sizeof(Move));
+    }
+
+    int n = 0;
+    for (int i = 0; i < hb->nphis; i++) {
+        const IrInst *phi = &hb->phis[i];
+        if (phi->op != IR_PHI) continue;
+        Move m = { val(phi->dst), arg(phi->phi[k]) };
+        if (!same(m.dst, m.src))
+            moves[n++] = m;
+    }
+    return n;
+}
+
+/*
+ * A move can go once no other pending move still reads its
+ * destination. When only cycles are left, one destination is saved in
+ * AX first; memory-to-memory moves then go through the stack.
+ */
+static void gen_copies(const IrFunc *f, int p, int h) {
+    int n = collect_moves(f, p, h);
+
+    while (n) {
+        int progress = 0;
+        for (int i = 0; i < n; i++) {
+            int blocked = 0;
+            for (int j = 0; j < n && !blocked; j++)
+                blocked = j != i && same(moves[j].src, moves[i].dst);
+            if (blocked) continue;
+
+            Move m = moves[i];
+            if (m.dst.kind == O_TMP && m.src.kind == O_TMP) {
+                ins1(I_PUSH, m.src);
+                ins1(I_POP, m.dst);
             } else {
-                gen_expr(n->left);
-                emit("    call print_int");
+                ins(I_MOV, m.dst, m.src);
             }
-            break;
+            moves[i--] = moves[--n];
+            progress = 1;
+        }
+        if (progress || !n) continue;
 
-        case NODE_IF: {
-            int id = label_id++;
-            char f[32], e[32];
-            sprintf(f, "IF_FALSE_%d", id);
-            sprintf(e, "IF_END_%d", id);
-
-            gen_expr(n->cond);
-            emit("    cmp ax, 0");
-            emit("    je %s", f);
-            gen_stmt(n->body);
-            emit("    jmp %s", e);
-            emit("%s:", f);
-            gen_stmt(n->else_body);
-            emit("%s:", e);
+        Operand saved = moves[0].dst;
+        ins(I_MOV, reg(AX), saved);
+        for (int j = 0; j < n; j++)
+            if (same(moves[j].src, saved))
+                moves[j].src = reg(AX);
+    }
+}
+
+
+typedef struct Stub {
+    int from;
+    int to;
+} Stub;
+
+static _Thread_local Stub *stubs = NULL;
+static _Thread_local int nstubs = 0;
+static _Thread_local int stubs_cap = 0;
+
+// Where a branch from p to h should jump: the block or an edge stub
+static Operand edge_target(const IrFunc *f, int p, int h) {
+    if (!collect_moves(f, p, h))
+        return label(LBL_BLOCK, h);
+
+    if (nstubs == stubs_cap) {
+        stubs_cap = stubs_cap ? stubs_cap * 2 : 64;
+        stubs = xrealloc(stubs, stubs_cap * sizeof(Stub));
+    }
+    stubs[nstubs].from = p;
+    stubs[nstubs].to = h;
+    return label(LBL_EDGE, nstubs++);
+}
+
+
+static void gen_branch(const IrFunc *f, int b, int next, const IrInst *br,
+                       const IrInst *cmp) {
+    const IrBlock *bb = &f->blocks[b];
+    int t = bb->succ[0], e = bb->succ[1];
+
+    InsnOp j;
+    if (cmp) {
+        j = gen_cmp(cmp);
+    } else if (br->a.kind == ARG_VAL) {
+        ins(I_CMP, arg(br->a), imm(0));
+        j = I_JNE;
+    } else {
+        // Constant condition, left over when constprop does not run
+        int to = br->a.val ? t : e;
+        gen_copies(f, b, to);
+        if (to != next)
+            ins1(I_JMP, label(LBL_BLOCK, to));
+        return;
+    }
+
+    if (e == next) {
+        ins1(j, edge_target(f, b, t));
+        gen_copies(f, b, e);
+    } else if (t == next) {
+        ins1(negate(j), edge_target(f, b, e));
+        gen_copies(f, b, t);
+    } else {
+        ins1(j, edge_target(f, b, t));
+        gen_copies(f, b, e);
+        ins1(I_JMP, label(LBL_BLOCK, e));
+    }
+}
+
+
+static void gen_inst(const IrInst *in) {
+    Operand d = in->dst ? val(in->dst) : none;
+    Operand a = arg(in->a), b = arg(in->b);
+
+    switch (in->op) {
+        case IR_COPY:
+            move(d, a);
             break;
-        }
 
+        case IR_SHR:
+            if (target == TARGET_X64) {
+                gen_shr_x64(d, a, b);
+                break;
+            }
+            gen_alu(in->op, d, a, b);
+            break;
 
-        case NODE_FOR: {
-            int id = label_id++;
-            char s[32], e[32];
-            sprintf(s, "FOR_%d", id);
-            sprintf(e, "END_FOR_%d", id);
+        case IR_ADD:
+        case IR_SUB:
+        case IR_SHL:
+            gen_alu(in->op, d, a, b);
+            normalize(d);
+            break;
 
-            gen_expr(n->left);
-            emit("    mov [%s], ax", n->name);
+        case IR_MUL:
+            if (target == TARGET_X64)
+                gen_imul(d, a, b);
+            else
+                gen_mul(d, a, b);
+            break;
 
-            emit("%s:", s);
-            emit("    mov ax, [%s]", n->name);
-            emit("    cmp ax, %d", n->right->ival);
-            emit("    jg %s", e);
+        case IR_DIV:
+            if (target == TARGET_X64) {
+                gen_div_x64(d, a, b);
+                break;
+            }
+            ins(I_MOV, reg(AX), a);
+            ins(I_XOR, reg(DX), reg(DX));
+            ins1(I_DIV, b);
+            ins(I_MOV, d, reg(AX));
+            break;
 
-            gen_stmt(n->body);
+        case IR_POW:
+            push_arg(a);
+            push_arg(b);
+            ins1(I_CALL, proc(PROC_POW_INT));
+            ins(I_MOV, d, reg(AX));
+            uses_pow = 1;
+            break;
 
-            emit("    inc word ptr [%s]", n->name);
-            emit("    jmp %s", s);
-            emit("%s:", e);
+        case IR_GT: case IR_LT: case IR_GE:
+        case IR_LE: case IR_EQ: case IR_NE: {
+            int id = label_id++;
+            InsnOp j = gen_cmp(in);
+            ins(I_MOV, d, imm(1));
+            ins1(j, label(LBL_CMP_END, id));
+            ins(I_MOV, d, imm(0));
+            place(LBL_CMP_END, id);
             break;
         }
 
-        case NODE_BLOCK:
-            gen_stmt(n->body);
+        case IR_PRINT:
+            if (!same(a, reg(AX)))
+                ins(I_MOV, reg(AX), a);
+            ins1(I_CALL, proc(PROC_PRINT_INT));
+            break;
+
+        case IR_PRINTS:
+            if (target == TARGET_X64) {
+                ins(I_MOV, reg(AX), a);
+                ins1(I_CALL, proc(PROC_PRINT_STR));
+                break;
+            }
+            ins(I_MOV, reg(DX), a);
+            ins(I_MOV, reg(AH), imm(0x09));
+            ins1(I_INT, imm(0x21));
             break;
 
         default:
@@ -332,40 +1038,164 @@ static void gen_stmt(ASTNode *n) {
     }
 }
 
-void generate_code(ASTNode *root, const char *outfile) {
-    out = fopen(outfile, "w");
-    if (!out) exit(1);
 
+static void select_code(const IrFunc *f) {
+    nstubs = 0;
+    int ret_jump = -1;
 
-    vars = NULL;
-    strings = NULL;
-    label_id = 0;
-    str_id = 0;
+    for (int i = 0; i < f->nrpo; i++) {
+        int b = f->rpo[i];
+        int next = i + 1 < f->nrpo ? f->rpo[i + 1] : -1;
+        const IrBlock *bb = &f->blocks[b];
 
-    collect_data(root);
+        place(LBL_BLOCK, b);
+        const IrInst *cmp = NULL;
+        for (int k = 0; k < bb->len; k++) {
+            const IrInst *in = &bb->insts[k];
+            switch (in->op) {
+                case IR_NOP:
+                    break;
 
-    emit(".model small");
-    emit(".stack 100h");
-    emit(".data");
+                case IR_JMP:
+                    gen_copies(f, b, bb->succ[0]);
+                    if (bb->succ[0] != next)
+                        ins1(I_JMP, label(LBL_BLOCK, bb->succ[0]));
+                    break;
 
-    for (Var *v = vars; v; v = v->next)
-        emit("%s dw ?", v->name);
+                case IR_BR:
+                    gen_branch(f, b, next, in, cmp);
+                    break;
 
-    for (Str *s = strings; s; s = s->next)
-        emit("%s db \"%s$\"", s->label, s->value);
+                case IR_RET:
+                    ret_jump = code.len;
+                    ins1(I_JMP, label(LBL_EXIT, 0));
+                    break;
 
-    emit(".code");
-    emit("main proc");
-    emit("    mov ax, 0003h");
-    emit("    int 10h");
+                default:
+                    if (in->dst && fused[in->dst])
+                        cmp = in;
+                    else
+                        gen_inst(in);
+                    break;
+            }
+        }
+    }
+
+    // Edge stubs go after the last block, which exits past them
+    for (int s = 0; s < nstubs; s++) {
+        place(LBL_EDGE, s);
+        gen_copies(f, stubs[s].from, stubs[s].to);
+        ins1(I_JMP, label(LBL_BLOCK, stubs[s].to));
+    }
+    if (!nstubs && ret_jump == code.len - 1)
+        code.items[ret_jump].op = I_NOP;
+    place(LBL_EXIT, 0);
+}
 
-    gen_stmt(root);
 
-    emit("    mov ah, 4Ch");
-    emit("    int 21h");
-    emit("main endp");
+static const char *op_name[] = {
+    "nop", "", "mov", "add", "sub", "cmp", "xor", "shl", "shr", "mul",
+    "imul", "div", "movsx", "movzx", "inc", "push", "pop", "call", "int",
+    "jmp", "je", "jne", "jg", "jge", "jl", "jle"
+};
+
+static const char *label_name[LBL_KINDS] = {
+    "B", "E", "L_END", "EXIT"
+};
 
+static const char *proc_name[] = { "print_int", "pow_int", "print_str" };
+
+
+static void put_hex(int v) {
+    static const char digits[] = "0123456789ABCDEF";
+    ob_putc(out, digits[(v >> 4) & 15]);
+    ob_putc(out, digits[v & 15]);
+    ob_putc(out, 'h');
+}
+
+// word ptr is spelled out where no register gives the operand size
+static void put_operand(const Operand *o, int sized) {
+    switch (o->kind) {
+        case O_REG:
+            ob_puts(out, reg_name[o->val]);
+            break;
+        case O_IMM:
+            ob_int(out, o->val);
+            break;
+        case O_TMP:
+            if (sized) ob_puts(out, "word ptr ");
+            ob_puts(out, "[TMP_");
+            ob_int(out, o->val);
+            ob_putc(out, ']');
+            break;
+        case O_STR:
+            ob_puts(out, "offset STR_");
+            ob_int(out, o->val);
+            break;
+        case O_LABEL:
+            ob_puts(out, label_name[o->lbl]);
+            ob_putc(out, '_');
+            ob_int(out, o->val);
+            break;
+        case O_PROC:
+            ob_puts(out, proc_name[o->val]);
+            break;
+    }
+}
+
+static void print_code(const InsnList *c) {
+    for (int i = 0; i < c->len; i++) {
+        const Insn *in = &c->items[i];
+
+        if (in->op == I_NOP)
+            continue;
+        if (in->op == I_LABEL) {
+            put_operand(&in->dst, 0);
+            ob_puts(out, ":\n");
+            continue;
+        }
+
+        // The 8086 only shifts by 1 or CL, so shl r, k is spelled out
+        if ((in->op == I_SHL || in->op == I_SHR) && in->src.val != 1) {
+            for (int k = 0; k < in->src.val; k++) {
+                ob_puts(out, "    ");
+                ob_puts(out, op_name[in->op]);
+                ob_putc(out, ' ');
+                put_operand(&in->dst, 0);
+                ob_puts(out, ", 1\n");
+            }
+            continue;
+        }
+
+        ob_puts(out, "    ");
+        ob_puts(out, op_name[in->op]);
+        ob_putc(out, ' ');
+
+        // DOS services and AH take their numbers in hex
+        if (in->op == I_INT ||
+            (in->dst.kind == O_REG && in->dst.val == AH && in->src.kind == O_IMM)) {
+            if (in->op != I_INT) {
+                put_operand(&in->dst, 0);
+                ob_puts(out, ", ");
+            }
+            put_hex(in->op == I_INT ? in->dst.val : in->src.val);
+        } else if (in->src.kind == O_NONE) {
+            put_operand(&in->dst, 1);
+        } else {
+            put_operand(&in->dst, 0);
+            ob_puts(out, ", ");
+            put_operand(&in->src, 0);
+        }
+        ob_putc(out, '\n');
+    }
+}
+
+static void emit_runtime(void) {
+    // Values stay in BX, CX and DX across calls
     emit("print_int proc");
+    emit("    push bx");
+    emit("    push cx");
+    emit("    push dx");
     emit("    mov bx, 10");
     emit("    xor cx, cx");
     emit("L1:");
@@ -381,9 +1211,115 @@ void generate_code(ASTNode *root, const char *outfile) {
     emit("    mov ah, 02h");
     emit("    int 21h");
     emit("    loop L2");
+    emit("    pop dx");
+    emit("    pop cx");
+    emit("    pop bx");
     emit("    ret");
     emit("print_int endp");
 
+    if (!uses_pow) return;
+
+    // AX = [bp+6] ^ [bp+4], every other register is preserved
+    emit("pow_int proc");
+    emit("    push bp");
+    emit("    mov bp, sp");
+    emit("    push cx");
+    emit("    push dx");
+    emit("    mov cx, [bp+4]");
+    emit("    mov ax, 1");
+    emit("POW_LOOP:");
+    emit("    cmp cx, 0");
+    emit("    jle POW_DONE");
+    emit("    mul word ptr [bp+6]");
+    emit("    dec cx");
+    emit("    jmp POW_LOOP");
+    emit("POW_DONE:");
+    emit("    pop dx");
+    emit("    pop cx");
+    emit("    pop bp");
+    emit("    ret 4");
+    emit("pow_int endp");
+}
+
+
+// Instruction selection and the peephole pass, leaving the result in code
+static void select_program(IrFunc *f, Target t) {
+    pool_reset(&strings);
+    label_id = 0;
+    uses_pow = 0;
+
+    target = t;
+    if (t == TARGET_X64) {
+        alloc_order = alloc_x64;
+        num_alloc = (int)(sizeof(alloc_x64) / sizeof(alloc_x64[0]));
+    } else {
+        alloc_order = alloc_8086;
+        num_alloc = (int)(sizeof(alloc_8086) / sizeof(alloc_8086[0]));
+    }
+
+    legalize(f);
+    grow_tables(f);
+    int npos = number(f);
+    liveness(f);
+    coalesce(f);
+    allocate(f, npos);
+
+    // The body goes first so the data section knows the spill slots
+    code.len = 0;
+    select_code(f);
+    peephole(&code);
+
+#if defined(NOVA_STATS)
+    for (int i = 0; i < code.len; i++)
+        if (code.items[i].op != I_NOP && code.items[i].op != I_LABEL)
+            compile_stats.insns++;
+#endif
+}
+
+
+void generate_code(IrFunc *f, OutBuf *ob, Target t) {
+    select_program(f, t);
+    STAT_PHASE(PHASE_EMIT);
+    size_t start = ob->len;
+
+    if (t == TARGET_X64) {
+        x64_write(ob, &code, strings.items, strings.len, spill_max, uses_pow);
+        STAT_ADD(bytes, ob->len - start);
+        return;
+    }
+
+    out = ob;
+    emit(".model small");
+    emit(".stack 100h");
+    emit(".data");
+
+    for (int i = 0; i < strings.len; i++)
+        emit("STR_%d db \"%s$\"", i, atom_str(strings.items[i]));
+
+    for (int i = 0; i < spill_max; i++)
+        emit("TMP_%d dw ?", i);
+
+    emit(".code");
+    emit("main proc");
+    emit("    mov ax, 0003h");
+    emit("    int 10h");
+
+    print_code(&code);
+
+    emit("    mov ah, 4Ch");
+    emit("    int 21h");
+    emit("main endp");
+
+    emit_runtime();
+
     emit("end main");
-    fclose(out);
+    out = NULL;
+    STAT_ADD(bytes, ob->len - start);
+}
+
+
+int run_code(IrFunc *f, FILE *out) {
+    select_program(f, TARGET_X64);
+    STAT_PHASE(PHASE_EMIT);
+    return jit_run(&code, strings.items, strings.len, spill_max, out);
 }
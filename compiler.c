@@ -0,0 +1,142 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.tab.h"
+
+
+/*
+ * The compiler as a library call: source text in, assembly or program
+ * output plus messages out. The command line and the --serve loop both
+ * go through compile_program, which can be called any number of times
+ * with the same context; the tree, the IR and the tables keep their
+ * storage between calls and are reset at the start of each one.
+ *
+ * A context holds everything a compilation owns. The passes keep only
+ * scratch arrays of their own, and those are per thread, so threads
+ * can compile in parallel with one context each. Atoms are per thread
+ * too: a tree is only meaningful on the thread that built it.
+ */
+
+
+static int interpret_tree(const AST *t, FILE *out) {
+    STAT_PHASE(PHASE_RUN);
+    VmProgram prog;
+    vm_init(&prog);
+    vm_compile(&prog, t);
+    int rc = vm_run(&prog, out);
+    vm_free(&prog);
+    return rc;
+}
+
+
+void compiler_init(CompilerContext *ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+    ast_init(&ctx->ast);
+    sym_init(&ctx->symbols);
+    ir_init(&ctx->ir);
+    lex_init(ctx);
+}
+
+
+void compiler_free(CompilerContext *ctx) {
+    free(ctx->tokens);
+    lex_free(ctx);
+    ir_free(&ctx->ir);
+    sym_free(&ctx->symbols);
+    ast_free(&ctx->ast);
+}
+
+
+// Parses and checks src into ctx->ast, or reads the tree from the cache
+static int front_end(CompilerContext *ctx, const char *src, size_t len,
+                     const CompileOptions *opt, CacheFile *cache,
+                     const AST **tree, AST *view) {
+    int cached = opt->cache_dir && cache_open(cache, opt->cache_dir, src, len);
+
+    if (cached) {
+        // The interpreter only reads the tree, so it can use the mapping
+        if (opt->mode == MODE_INTERPRET && cache_view(cache, view))
+            *tree = view;
+        else
+            cache_load(cache, &ctx->ast);
+        diag_status(ctx, "Checked tree loaded from %s\n", cache->path);
+        return 0;
+    }
+
+    ctx->lexer = opt->lexer;
+    ctx->parser = opt->parser;
+    if (parse_source(ctx, src, len, 1) != 0) {
+        diag_error(ctx, "Parsing failed\n");
+        return 1;
+    }
+
+    diag_status(ctx, "Lexical analysis successful\n");
+    diag_status(ctx, "Tokens created\n");
+    diag_status(ctx, "Syntax analysis successful\n");
+    diag_status(ctx, "Parse tree created\n");
+
+    STAT_PHASE(PHASE_CHECK);
+    if (semantic_check(ctx) > 0) {
+        diag_error(ctx, "Compilation failed due to semantic errors\n");
+        return 1;
+    }
+
+    if (opt->cache_dir && cache_save(cache, &ctx->ast) != 0)
+        diag_error(ctx, "Cannot write %s\n", cache->path);
+    return 0;
+}
+
+
+int compile_program(CompilerContext *ctx, const char *src, size_t len,
+                    const CompileOptions *opt, OutBuf *out, OutBuf *msgs) {
+    AST *t = &ctx->ast;
+    ast_reset(t);
+    ctx->msgs = msgs;
+
+    const AST *tree = t;
+    AST view;
+    CacheFile cache;
+    memset(&cache, 0, sizeof(cache));
+
+    int rc = front_end(ctx, src, len, opt, &cache, &tree, &view);
+    if (rc == 0 && opt->mode == MODE_INTERPRET)
+        rc = interpret_tree(tree, opt->run_out);
+    else if (rc == 0)
+        rc = compile_tree(ctx, opt, out);
+
+    STAT_PHASE(PHASE_NONE);
+    cache_close(&cache);
+    ctx->msgs = NULL;
+    return rc;
+}
+
+
+int compile_tree(CompilerContext *ctx, const CompileOptions *opt, OutBuf *out) {
+    AST *t = &ctx->ast;
+    int rc = 0;
+
+    // The interpreter is the reference, it runs the tree as checked
+    if (opt->mode == MODE_INTERPRET)
+        return interpret_tree(t, opt->run_out);
+
+    STAT_PHASE(PHASE_FOLD);
+    optimize(t);
+    STAT_PHASE(PHASE_IR);
+    ir_lower(&ctx->ir, t);
+    ir_optimize(&ctx->ir);
+    if (opt->dump_ir)
+        ir_dump(&ctx->ir, opt->dump_ir);
+
+    STAT_PHASE(PHASE_SELECT);
+    if (opt->mode == MODE_RUN) {
+        // Hosts the JIT cannot target fall back to the interpreter
+        rc = run_code(&ctx->ir, opt->run_out);
+        if (rc < 0)
+            rc = interpret_tree(t, opt->run_out);
+    } else {
+        generate_code(&ctx->ir, out, opt->target);
+    }
+    return rc != 0;
+}
@@ -0,0 +1,50 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+
+/*
+ * Compiler messages. The command line prints status lines on stdout
+ * and errors on stderr; a caller compiling from a buffer can collect
+ * both, in order, in a buffer of its own instead (ctx->msgs). With
+ * ctx->quiet set only the errors are kept.
+ */
+
+static void put(CompilerContext *ctx, FILE *f, const char *fmt, va_list args) {
+    OutBuf *captured = ctx->msgs;
+    if (!captured) {
+        vfprintf(f, fmt, args);
+        return;
+    }
+
+    va_list again;
+    va_copy(again, args);
+    int n = vsnprintf(NULL, 0, fmt, again);
+    va_end(again);
+    if (n <= 0) return;
+
+    ob_reserve(captured, (size_t)n + 1);
+    vsnprintf(captured->data + captured->len, (size_t)n + 1, fmt, args);
+    captured->len += n;
+}
+
+
+void diag_status(CompilerContext *ctx, const char *fmt, ...) {
+    if (ctx->quiet) return;
+
+    va_list args;
+    va_start(args, fmt);
+    put(ctx, stdout, fmt, args);
+    va_end(args);
+}
+
+
+void diag_error(CompilerContext *ctx, const char *fmt, ...) {
+    ctx->error_count++;
+
+    va_list args;
+    va_start(args, fmt);
+    put(ctx, stderr, fmt, args);
+    va_end(args);
+}
@@ -0,0 +1,544 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.tab.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS 1
+#endif
+
+
+/*
+ * Hand-written scanner, used instead of the flex one in lexer.l unless
+ * ctx->lexer is LEX_FLEX. It returns the same tokens, values and errors
+ * as the flex rules, longest match included:
+ *
+ *   - "<" starts a comment whenever a ">" follows anywhere later, and
+ *     the comment ends at the first one
+ *   - strings may hold newlines but not a backslash before one, and an
+ *     unterminated quote is a lexical error of its own
+ *   - only NEWLINE tokens and the newlines in comments count lines
+ *
+ * The runs that make up most of a source file are found 16 (SSE2) or
+ * 32 (AVX2) bytes at a time: blanks, identifier characters, the end of
+ * a "$" comment, the end of a "<...>" comment with the newlines in it,
+ * and the next quote or backslash in a string. AVX2 is used when the
+ * CPU has it, SSE2 otherwise on x86, plain loops elsewhere. The vector
+ * loops never read past the end of the input, which may be a mapping.
+ */
+
+typedef struct Kernels {
+    const char *(*skip_blanks)(const char *p, const char *end);
+    const char *(*skip_ident)(const char *p, const char *end);
+    const char *(*find_byte)(const char *p, const char *end, char c);
+    const char *(*find_quote)(const char *p, const char *end);
+    const char *(*find_gt)(const char *p, const char *end, int *lines);
+} Kernels;
+
+
+/* ---- Plain loops, also the tails of the vector ones ---- */
+
+static int is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static int is_ident(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+static const char *skip_blanks_scalar(const char *p, const char *end) {
+    while (p < end && is_blank(*p))
+        p++;
+    return p;
+}
+
+static const char *skip_ident_scalar(const char *p, const char *end) {
+    while (p < end && is_ident(*p))
+        p++;
+    return p;
+}
+
+static const char *find_byte_scalar(const char *p, const char *end, char c) {
+    while (p < end && *p != c)
+        p++;
+    return p;
+}
+
+static const char *find_quote_scalar(const char *p, const char *end) {
+    while (p < end && *p != '"' && *p != '\\')
+        p++;
+    return p;
+}
+
+static const char *find_gt_scalar(const char *p, const char *end, int *lines) {
+    for (; p < end && *p != '>'; p++)
+        if (*p == '\n')
+            (*lines)++;
+    return p;
+}
+
+static const Kernels scalar_kernels = {
+    skip_blanks_scalar, skip_ident_scalar, find_byte_scalar,
+    find_quote_scalar, find_gt_scalar
+};
+
+
+/* ---- SSE2 ---- */
+
+#if defined(__SSE2__)
+
+static unsigned ident_mask16(__m128i v) {
+    // Signed compares; bytes over 0x7f are negative and match nothing
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i under = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), under));
+}
+
+static const char *skip_blanks_sse2(const char *p, const char *end) {
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i blank = _mm_or_si128(_mm_or_si128(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+        unsigned other = ~(unsigned)_mm_movemask_epi8(blank) & 0xffff;
+        if (other)
+            return p + __builtin_ctz(other);
+    }
+    return skip_blanks_scalar(p, end);
+}
+
+static const char *skip_ident_sse2(const char *p, const char *end) {
+    for (; end - p >= 16; p += 16) {
+        unsigned other = ~ident_mask16(_mm_loadu_si128((const __m128i *)p)) & 0xffff;
+        if (other)
+            return p + __builtin_ctz(other);
+    }
+    return skip_ident_scalar(p, end);
+}
+
+static const char *find_byte_sse2(const char *p, const char *end, char c) {
+    __m128i key = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        unsigned hit = (unsigned)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), key));
+        if (hit)
+            return p + __builtin_ctz(hit);
+    }
+    return find_byte_scalar(p, end, c);
+}
+
+static const char *find_quote_sse2(const char *p, const char *end) {
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned hit = (unsigned)_mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+        if (hit)
+            return p + __builtin_ctz(hit);
+    }
+    return find_quote_scalar(p, end);
+}
+
+static const char *find_gt_sse2(const char *p, const char *end, int *lines) {
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned gt = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+        unsigned nl = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        if (gt) {
+            *lines += __builtin_popcount(nl & ((gt & -gt) - 1));
+            return p + __builtin_ctz(gt);
+        }
+        *lines += __builtin_popcount(nl);
+    }
+    return find_gt_scalar(p, end, lines);
+}
+
+static const Kernels sse2_kernels = {
+    skip_blanks_sse2, skip_ident_sse2, find_byte_sse2,
+    find_quote_sse2, find_gt_sse2
+};
+
+#endif
+
+
+/* ---- AVX2, compiled for it whatever the build flags ---- */
+
+#if defined(HAVE_AVX2_KERNELS)
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static unsigned ident_mask32(__m256i v) {
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    __m256i under = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(alpha, digit), under));
+}
+
+AVX2 static const char *skip_blanks_avx2(const char *p, const char *end) {
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i blank = _mm256_or_si256(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+        unsigned other = ~(unsigned)_mm256_movemask_epi8(blank);
+        if (other)
+            return p + __builtin_ctz(other);
+    }
+    return skip_blanks_scalar(p, end);
+}
+
+AVX2 static const char *skip_ident_avx2(const char *p, const char *end) {
+    for (; end - p >= 32; p += 32) {
+        unsigned other = ~ident_mask32(_mm256_loadu_si256((const __m256i *)p));
+        if (other)
+            return p + __builtin_ctz(other);
+    }
+    return skip_ident_scalar(p, end);
+}
+
+AVX2 static const char *find_byte_avx2(const char *p, const char *end, char c) {
+    __m256i key = _mm256_set1_epi8(c);
+    for (; end - p >= 32; p += 32) {
+        unsigned hit = (unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), key));
+        if (hit)
+            return p + __builtin_ctz(hit);
+    }
+    return find_byte_scalar(p, end, c);
+}
+
+AVX2 static const char *find_quote_avx2(const char *p, const char *end) {
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned hit = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))));
+        if (hit)
+            return p + __builtin_ctz(hit);
+    }
+    return find_quote_scalar(p, end);
+}
+
+AVX2 static const char *find_gt_avx2(const char *p, const char *end, int *lines) {
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned gt = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+        unsigned nl = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        if (gt) {
+            *lines += __builtin_popcount(nl & ((gt & -gt) - 1));
+            return p + __builtin_ctz(gt);
+        }
+        *lines += __builtin_popcount(nl);
+    }
+    return find_gt_scalar(p, end, lines);
+}
+
+static const Kernels avx2_kernels = {
+    skip_blanks_avx2, skip_ident_avx2, find_byte_avx2,
+    find_quote_avx2, find_gt_avx2
+};
+
+#endif
+
+
+static const Kernels *pick_kernels(LexerKind kind) {
+#if defined(HAVE_AVX2_KERNELS)
+    if (kind == LEX_FAST && __builtin_cpu_supports("avx2"))
+        return &avx2_kernels;
+#endif
+#if defined(__SSE2__)
+    if (kind != LEX_FAST_SCALAR)
+        return &sse2_kernels;
+#endif
+    (void)kind;
+    return &scalar_kernels;
+}
+
+const char *fast_lex_kernels(LexerKind kind) {
+    const Kernels *k = pick_kernels(kind);
+#if defined(HAVE_AVX2_KERNELS)
+    if (k == &avx2_kernels) return "avx2";
+#endif
+#if defined(__SSE2__)
+    if (k == &sse2_kernels) return "sse2";
+#endif
+    return "plain";
+}
+
+
+/* ---- Tokens ---- */
+
+void fast_lex_free(FastLexer *lx) {
+    free(lx->scratch);
+    lx->scratch = NULL;
+    lx->scratch_cap = 0;
+}
+
+void fast_lex_set_input(FastLexer *lx, const char *src, size_t len, LexerKind kind) {
+    lx->src = src;
+    lx->len = len;
+    lx->pos = 0;
+    lx->kernels = pick_kernels(kind);
+
+    // Past the last '>': a '<' before it starts a comment
+    lx->comment_end = 0;
+    for (size_t i = len; i > 0; i--)
+        if (src[i - 1] == '>') {
+            lx->comment_end = i;
+            break;
+        }
+}
+
+
+static char *scratch(FastLexer *lx, size_t n) {
+    if (n > lx->scratch_cap) {
+        lx->scratch_cap = n > 256 ? n : 256;
+        lx->scratch = xrealloc(lx->scratch, lx->scratch_cap);
+    }
+    return lx->scratch;
+}
+
+// atoi and atof want a terminated string
+static const char *number_text(FastLexer *lx, const char *s, size_t n) {
+    char *buf = scratch(lx, n + 1);
+    memcpy(buf, s, n);
+    buf[n] = '\0';
+    return buf;
+}
+
+static int keyword(const char *s, size_t n) {
+    switch (n) {
+        case 2:
+            if (s[0] == 'i' && s[1] == 'f') return IF;
+            if (s[0] == 't' && s[1] == 'o') return TO;
+            break;
+        case 3:
+            if (memcmp(s, "let", 3) == 0) return LET;
+            if (memcmp(s, "for", 3) == 0) return FOR;
+            break;
+        case 4:
+            if (memcmp(s, "else", 4) == 0) return ELSE;
+            break;
+        case 5:
+            if (memcmp(s, "print", 5) == 0) return PRINT;
+            break;
+    }
+    return ID;
+}
+
+static char unescape(char c) {
+    switch (c) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        default:  return c;
+    }
+}
+
+// End of the string at s (past the closing quote), or NULL if the
+// rule does not match there. *escaped is set if it holds a backslash
+static const char *string_end(const Kernels *k, const char *s, const char *end,
+                              int *escaped) {
+    *escaped = 0;
+    for (const char *p = s + 1; ; p += 2) {
+        p = k->find_quote(p, end);
+        if (p == end) return NULL;
+        if (*p == '"') return p + 1;
+        if (p + 1 == end || p[1] == '\n') return NULL;
+        *escaped = 1;
+    }
+}
+
+static Atom string_atom(FastLexer *lx, const char *s, const char *e, int escaped) {
+    if (!escaped)
+        return intern(s + 1, (size_t)(e - s) - 2);
+
+    char *buf = scratch(lx, (size_t)(e - s));
+    size_t j = 0;
+    for (const char *p = s + 1; p < e - 1; p++) {
+        if (*p == '\\') {
+            p++;
+            buf[j++] = unescape(*p);
+        } else {
+            buf[j++] = *p;
+        }
+    }
+    return intern(buf, j);
+}
+
+
+static int scan(CompilerContext *ctx, TokenValue *lval) {
+    FastLexer *lx = &ctx->fast;
+    const Kernels *k = lx->kernels;
+    const char *src = lx->src;
+    const char *end = src + lx->len;
+    const char *p = src + lx->pos;
+
+    for (;;) {
+        // Mostly a single space between tokens; only runs go to the kernel
+        if (p < end && is_blank(*p) && ++p < end && is_blank(*p))
+            p = k->skip_blanks(p, end);
+        if (p == end) {
+            lx->start = lx->pos = lx->len;
+            return 0;
+        }
+
+        const char *s = p;
+        char c = *p++;
+        int tok = 0;
+
+        switch (c) {
+            case '\n':
+                ctx->line_no++;
+                tok = NEWLINE;
+                break;
+
+            case '$':
+                p = k->find_byte(p, end, '\n');
+                continue;
+
+            case '<':
+                if ((size_t)(s - src) + 1 < lx->comment_end) {
+                    p = k->find_gt(p, end, &ctx->line_no) + 1;
+                    continue;
+                }
+                if (p < end && *p == '=') {
+                    p++;
+                    tok = LE;
+                } else {
+                    tok = LT;
+                }
+                break;
+
+            case '>':
+                if (p < end && *p == '=') {
+                    p++;
+                    tok = GE;
+                } else {
+                    tok = GT;
+                }
+                break;
+
+            case '=':
+                if (p < end && *p == '=') {
+                    p++;
+                    tok = EQ;
+                } else {
+                    tok = ASSIGN;
+                }
+                break;
+
+            case '!':
+                if (p < end && *p == '=') {
+                    p++;
+                    tok = NE;
+                }
+                break;
+
+            case '+': tok = PLUS; break;
+            case '-': tok = MINUS; break;
+            case '*': tok = MUL; break;
+            case '/': tok = DIV; break;
+            case '^': tok = POW; break;
+            case '(': tok = LPAREN; break;
+            case ')': tok = RPAREN; break;
+            case '[': tok = LBRACKET; break;
+            case ']': tok = RBRACKET; break;
+
+            case '"': {
+                int escaped;
+                const char *e = string_end(k, s, end, &escaped);
+                if (e) {
+                    lval->atom = string_atom(lx, s, e, escaped);
+                    p = e;
+                    tok = STRING_LITERAL;
+                }
+                break;
+            }
+
+            case '\'':
+                if (end - s >= 3 && s[1] != '\\' && s[1] != '\'' && s[2] == '\'') {
+                    lval->cval = s[1];
+                    p = s + 3;
+                    tok = CHAR_LITERAL;
+                } else if (end - s >= 4 && s[1] == '\\' && s[2] != '\n' && s[3] == '\'') {
+                    lval->cval = s[2] == '0' ? '\0' : unescape(s[2]);
+                    p = s + 4;
+                    tok = CHAR_LITERAL;
+                }
+                break;
+
+            default:
+                if (c >= '0' && c <= '9') {
+                    while (p < end && *p >= '0' && *p <= '9')
+                        p++;
+                    if (end - p >= 2 && *p == '.' && p[1] >= '0' && p[1] <= '9') {
+                        for (p += 2; p < end && *p >= '0' && *p <= '9'; p++)
+                            ;
+                        lval->fval = atof(number_text(lx, s, (size_t)(p - s)));
+                        tok = FLOAT_LITERAL;
+                    } else {
+                        lval->ival = atoi(number_text(lx, s, (size_t)(p - s)));
+                        tok = INT_LITERAL;
+                    }
+                } else if (is_ident(c)) {
+                    p = k->skip_ident(p, end);
+                    tok = keyword(s, (size_t)(p - s));
+                    if (tok == ID)
+                        lval->atom = intern(s, (size_t)(p - s));
+                }
+                break;
+        }
+
+        if (tok) {
+            lx->start = (size_t)(s - src);
+            lx->pos = (size_t)(p - src);
+            return tok;
+        }
+
+        // Anything else is one unrecognized character, like flex's "."
+        p = s + 1;
+        lex_error(ctx, c);
+    }
+}
+
+
+int fast_lex(YYSTYPE *lval, CompilerContext *ctx) {
+    TokenValue v;
+    int tok = scan(ctx, &v);
+    switch (tok) {
+        case INT_LITERAL: lval->ival = v.ival; break;
+        case FLOAT_LITERAL: lval->fval = v.fval; break;
+        case CHAR_LITERAL: lval->cval = v.cval; break;
+        case STRING_LITERAL:
+        case ID: lval->atom = v.atom; break;
+    }
+    return tok;
+}
+
+// The same for lex_all, straight into the token array
+int fast_lex_token(CompilerContext *ctx, Token *t) {
+    STAT_ADD(tokens, 1);
+    t->value.ival = 0;
+    t->kind = (short)scan(ctx, &t->value);
+    t->line = ctx->line_no;
+    t->offset = (unsigned)ctx->fast.start;
+    t->length = (unsigned)(ctx->fast.pos - ctx->fast.start);
+    return t->kind;
+}
@@ -0,0 +1,479 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.tab.h"
+
+
+/*
+ * Incremental compilation for an editor that sends the whole buffer on
+ * every change.
+ *
+ * The source is cut into chunks of whole top-level statements with a
+ * scan that follows the lexer's rules (see split). A chunk that matches
+ * one of the session's chunks from the previous call, in the unchanged
+ * prefix or suffix of the buffer, keeps its parsed statements; only the
+ * chunks in between are lexed and parsed again, into the session's own
+ * tree. Parsed statements never change, so a later call can use them.
+ *
+ * A chunk's semantic check depends only on its statements and on the
+ * names and types declared at the top level before it. That set is kept
+ * as a hash, env: a chunk that checked cleanly under the same env is not
+ * walked again, its lets are just declared.
+ *
+ * The back end optimizes and allocates registers over the whole
+ * program, so its output for one statement depends on the others and
+ * cannot be reused piecemeal. The assembly of the last program is kept
+ * instead and returned as is when the statements are the same (an edit
+ * to a comment or to blank lines).
+ *
+ * The session tree only grows; once it holds more dead nodes than live
+ * ones it is dropped and everything is parsed again.
+ */
+
+typedef struct Span {
+    size_t start;
+    size_t len;
+    int line;
+    unsigned long long hash;
+} Span;
+
+static _Thread_local Span *spans = NULL;
+static _Thread_local int nspans = 0;
+static _Thread_local int spans_cap = 0;
+
+
+static unsigned long long mix(unsigned long long h, unsigned long long v) {
+    h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    return h * 0xff51afd7ed558ccdull;
+}
+
+static unsigned long long hash_text(const char *s, size_t len) {
+    unsigned long long h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+
+void incr_init(IncrSession *s) {
+    memset(s, 0, sizeof(*s));
+    ast_init(&s->parsed);
+    ob_init(&s->asm_text);
+}
+
+
+static void drop_chunk(IncrChunk *c) {
+    free(c->decl_names);
+    free(c->decl_types);
+    c->decl_names = NULL;
+    c->decl_types = NULL;
+}
+
+void incr_free(IncrSession *s) {
+    for (int i = 0; i < s->nchunks; i++)
+        drop_chunk(&s->chunks[i]);
+    free(s->chunks);
+    free(s->next);
+    ast_free(&s->parsed);
+    ob_free(&s->asm_text);
+    memset(s, 0, sizeof(*s));
+}
+
+
+/* ---- Splitting ---- */
+
+static void add_span(size_t start, size_t end, int line, const char *src) {
+    if (nspans == spans_cap) {
+        spans_cap = spans_cap ? spans_cap * 2 : 256;
+        spans = xrealloc(spans, spans_cap * sizeof(Span));
+    }
+    Span *sp = &spans[nspans++];
+    sp->start = start;
+    sp->len = end - start;
+    sp->line = line;
+    sp->hash = hash_text(src + start, end - start);
+}
+
+// End of the string literal at i, or 0 where the lexer sees a lone '"'
+static size_t string_end(const char *src, size_t i, size_t len) {
+    for (i++; i < len; i++) {
+        if (src[i] == '"')
+            return i + 1;
+        if (src[i] == '\\' && (i + 1 == len || src[++i] == '\n'))
+            return 0;
+    }
+    return 0;
+}
+
+static size_t char_end(const char *src, size_t i, size_t len) {
+    if (i + 2 < len && src[i + 1] != '\\' && src[i + 1] != '\'' && src[i + 2] == '\'')
+        return i + 3;
+    if (i + 3 < len && src[i + 1] == '\\' && src[i + 2] != '\n' && src[i + 3] == '\'')
+        return i + 4;
+    return 0;
+}
+
+/*
+ * A chunk ends at a newline outside brackets, strings and comments, and
+ * takes the blank and comment lines after it, so a parse error at its
+ * end is reported on the same line as in the whole file. A "[" as the
+ * next token continues the statement: if, else and for may put their
+ * block on the next line. Line numbers are counted like the lexer does,
+ * which skips the newlines inside literals.
+ */
+static void split(const char *src, size_t len) {
+    size_t last_gt = 0;
+    for (size_t i = len; i > 0; i--)
+        if (src[i - 1] == '>') {
+            last_gt = i;
+            break;
+        }
+
+    nspans = 0;
+    size_t start = 0, cut = 0, i = 0;
+    int line = 1, start_line = 1, cut_line = 1, depth = 0, at_cut = 0;
+
+    while (i < len) {
+        char c = src[i];
+
+        if (c == '\n') {
+            i++;
+            line++;
+            if (depth == 0) {
+                at_cut = 1;
+                cut = i;
+                cut_line = line;
+            }
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\r') {
+            i++;
+            continue;
+        }
+        if (c == '$') {
+            while (i < len && src[i] != '\n')
+                i++;
+            continue;
+        }
+        if (c == '<' && last_gt > i + 1) {
+            // A comment runs to the next '>' whenever there is one
+            for (i++; src[i] != '>'; i++)
+                if (src[i] == '\n')
+                    line++;
+            i++;
+            continue;
+        }
+
+        // The first token after a cut starts the next chunk
+        if (at_cut) {
+            at_cut = 0;
+            if (c != '[') {
+                add_span(start, cut, start_line, src);
+                start = cut;
+                start_line = cut_line;
+            }
+        }
+
+        size_t end = c == '"' ? string_end(src, i, len) :
+                     c == '\'' ? char_end(src, i, len) : 0;
+        if (end) {
+            i = end;
+            continue;
+        }
+        if (c == '[')
+            depth++;
+        else if (c == ']' && depth > 0)
+            depth--;
+        i++;
+    }
+    if (start < len)
+        add_span(start, len, start_line, src);
+}
+
+
+/* ---- Parsing ---- */
+
+static unsigned long long tree_hash(const AST *t, NodeId n, unsigned long long h) {
+    if (!n) return mix(h, 0);
+
+    h = mix(h, ((unsigned long long)t->kind[n] << 8) | t->aux[n]);
+    switch (t->kind[n]) {
+        case NODE_STMT_LIST:
+        case NODE_BLOCK: {
+            const NodeId *items = ast_items(t, n);
+            h = mix(h, t->b[n]);
+            for (unsigned i = 0; i < t->b[n]; i++)
+                h = tree_hash(t, items[i], h);
+            return h;
+        }
+        case NODE_DECL:
+            return tree_hash(t, t->b[n], mix(h, t->a[n]));
+        case NODE_PRINT:
+            return tree_hash(t, t->a[n], h);
+        case NODE_IF:
+            h = tree_hash(t, t->a[n], h);
+            h = tree_hash(t, t->b[n], h);
+            return tree_hash(t, t->c[n], h);
+        case NODE_FOR:
+            h = tree_hash(t, t->b[n], mix(h, t->a[n]));
+            h = tree_hash(t, ast_for_to(t, n), h);
+            return tree_hash(t, ast_for_body(t, n), h);
+        case NODE_BINOP:
+            h = tree_hash(t, t->a[n], h);
+            return tree_hash(t, t->b[n], h);
+        default:
+            return mix(h, t->a[n]);
+    }
+}
+
+// Parses one chunk into the session tree; 0 on a syntax error
+static int parse_chunk(CompilerContext *ctx, IncrSession *s, const char *src,
+                       const Span *sp, IncrChunk *c) {
+    unsigned errors = ctx->error_count;
+    AST own = ctx->ast;
+
+    ctx->ast = s->parsed;
+    ctx->ast.pending_len = 0;
+    ctx->ast.root = NODE_NONE;
+    unsigned before = ctx->ast.count;
+
+    int rc = parse_source(ctx, src + sp->start, sp->len, sp->line);
+
+    s->parsed = ctx->ast;
+    ctx->ast = own;
+    if (rc != 0) return 0;
+
+    const AST *t = &s->parsed;
+    NodeId root = t->root;
+    memset(c, 0, sizeof(*c));
+    c->hash = sp->hash;
+    c->len = sp->len;
+    c->clean = ctx->error_count == errors;
+    c->items = root ? t->a[root] : 0;
+    c->nitems = root ? t->b[root] : 0;
+    c->nodes = t->count - before;
+
+    c->tree = mix(0, c->nitems);
+    for (unsigned i = 0; i < c->nitems; i++)
+        c->tree = tree_hash(t, t->extra[c->items + i], c->tree);
+    s->live += c->nodes;
+    return 1;
+}
+
+static int same_chunk(const IncrChunk *c, const Span *sp) {
+    return c->clean && c->hash == sp->hash && c->len == sp->len;
+}
+
+static IncrChunk *next_chunk(IncrSession *s, int n) {
+    if (n >= s->next_cap) {
+        s->next_cap = s->next_cap ? s->next_cap * 2 : 256;
+        s->next = xrealloc(s->next, s->next_cap * sizeof(IncrChunk));
+    }
+    return &s->next[n];
+}
+
+/*
+ * Rebuilds the chunk list for the new source. The chunks in the common
+ * prefix and suffix are moved over, the ones in between parsed. After a
+ * syntax error the list holds what parsed; it need not match the source,
+ * since chunks are only ever reused by content.
+ */
+static int update_chunks(CompilerContext *ctx, IncrSession *s, const char *src) {
+    int old = s->nchunks;
+    int pre = 0, suf = 0;
+
+    while (pre < old && pre < nspans && same_chunk(&s->chunks[pre], &spans[pre]))
+        pre++;
+    while (suf < old - pre && suf < nspans - pre &&
+           same_chunk(&s->chunks[old - 1 - suf], &spans[nspans - 1 - suf]))
+        suf++;
+
+    int n = 0, ok = 1;
+    for (int i = 0; i < pre; i++)
+        *next_chunk(s, n++) = s->chunks[i];
+    for (int i = pre; i < nspans - suf; i++) {
+        if (!parse_chunk(ctx, s, src, &spans[i], next_chunk(s, n))) {
+            ok = 0;
+            break;
+        }
+        n++;
+        s->reparsed++;
+    }
+    for (int i = old - suf; i < old; i++)
+        *next_chunk(s, n++) = s->chunks[i];
+
+    for (int i = pre; i < old - suf; i++) {
+        s->live -= s->chunks[i].nodes;
+        drop_chunk(&s->chunks[i]);
+    }
+
+    IncrChunk *tmp = s->chunks;
+    int tmp_cap = s->chunk_cap;
+    s->chunks = s->next;
+    s->chunk_cap = s->next_cap;
+    s->nchunks = n;
+    s->next = tmp;
+    s->next_cap = tmp_cap;
+    return ok;
+}
+
+
+/* ---- Checking ---- */
+
+static unsigned long long binding(Atom name, SymbolType type) {
+    return mix((unsigned long long)name, type);
+}
+
+static void record_decls(CompilerContext *ctx, const AST *t, IncrChunk *c) {
+    c->ndecls = 0;
+    for (unsigned i = 0; i < c->nitems; i++) {
+        NodeId n = t->extra[c->items + i];
+        if (t->kind[n] != NODE_DECL) continue;
+
+        c->decl_names = xrealloc(c->decl_names, (c->ndecls + 1) * sizeof(Atom));
+        c->decl_types = xrealloc(c->decl_types, (c->ndecls + 1) * sizeof(SymbolType));
+        c->decl_names[c->ndecls] = t->a[n];
+        c->decl_types[c->ndecls] = sym_lookup(&ctx->symbols, t->a[n])->type;
+        c->ndecls++;
+    }
+}
+
+/*
+ * env is a sum over the top-level bindings, so it does not depend on the
+ * order of the lets. After a chunk with errors the table no longer
+ * matches env and nothing later is reused.
+ */
+static int check_chunks(CompilerContext *ctx, IncrSession *s) {
+    const AST *t = &ctx->ast;
+    unsigned long long env = 0;
+    int trusted = 1;
+
+    semantic_begin(ctx);
+    for (int i = 0; i < s->nchunks; i++) {
+        IncrChunk *c = &s->chunks[i];
+
+        if (trusted && c->checked && c->env == env) {
+            for (unsigned k = 0; k < c->ndecls; k++)
+                sym_insert(&ctx->symbols, c->decl_names[k], c->decl_types[k]);
+        } else {
+            int errors = ctx->semantic_errors;
+            for (unsigned k = 0; k < c->nitems; k++)
+                semantic_check_stmt(ctx, t->extra[c->items + k]);
+            s->rechecked++;
+
+            c->checked = trusted && ctx->semantic_errors == errors;
+            c->env = env;
+            if (!c->checked) {
+                trusted = 0;
+                continue;
+            }
+            record_decls(ctx, t, c);
+        }
+
+        for (unsigned k = 0; k < c->ndecls; k++)
+            env += binding(c->decl_names[k], c->decl_types[k]);
+    }
+
+    // Trusted chunks are not walked again, keep the types written on prints
+    memcpy(s->parsed.aux, t->aux, s->parsed.count);
+    return semantic_end(ctx);
+}
+
+
+/* ---- Compiling ---- */
+
+static void copy_tree(AST *dst, const AST *src) {
+    ast_reset(dst);
+    ast_reserve(dst, src->count, src->extra_len);
+    memcpy(dst->kind, src->kind, src->count);
+    memcpy(dst->aux, src->aux, src->count);
+    memcpy(dst->a, src->a, src->count * sizeof(unsigned));
+    memcpy(dst->b, src->b, src->count * sizeof(unsigned));
+    memcpy(dst->c, src->c, src->count * sizeof(unsigned));
+    memcpy(dst->extra, src->extra, src->extra_len * sizeof(NodeId));
+    dst->count = src->count;
+    dst->extra_len = src->extra_len;
+}
+
+// The program as one statement list after the chunks' own nodes
+static void build_program(CompilerContext *ctx, const IncrSession *s) {
+    AST *t = &ctx->ast;
+    unsigned total = 0;
+
+    copy_tree(t, &s->parsed);
+    unsigned mark = ast_list_begin(t);
+    for (int i = 0; i < s->nchunks; i++) {
+        const IncrChunk *c = &s->chunks[i];
+        for (unsigned k = 0; k < c->nitems; k++)
+            ast_list_push(t, s->parsed.extra[c->items + k]);
+        total += c->nitems;
+    }
+    t->root = total ? make_stmt_list(t, mark) : NODE_NONE;
+}
+
+
+int compile_incremental(CompilerContext *ctx, IncrSession *s,
+                        const char *src, size_t len,
+                        const CompileOptions *opt, OutBuf *out, OutBuf *msgs) {
+    ctx->msgs = msgs;
+    ctx->lexer = opt->lexer;
+    ctx->parser = opt->parser;
+    s->reparsed = 0;
+    s->rechecked = 0;
+
+    // Mostly dead nodes: start over with an empty tree
+    if (s->parsed.count > 2 * s->live + 4096) {
+        for (int i = 0; i < s->nchunks; i++)
+            drop_chunk(&s->chunks[i]);
+        s->nchunks = 0;
+        s->live = 0;
+        ast_reset(&s->parsed);
+    }
+
+    split(src, len);
+    if (!update_chunks(ctx, s, src)) {
+        diag_error(ctx, "Parsing failed\n");
+        s->program = 0;
+        ctx->msgs = NULL;
+        return 1;
+    }
+
+    diag_status(ctx, "Lexical analysis successful\n");
+    diag_status(ctx, "Tokens created\n");
+    diag_status(ctx, "Syntax analysis successful\n");
+    diag_status(ctx, "Parse tree created\n");
+
+    unsigned long long program = mix(0, opt->target + 1);
+    for (int i = 0; i < s->nchunks; i++)
+        program = mix(program, s->chunks[i].tree);
+    int keep = opt->mode == MODE_ASM && !opt->dump_ir;
+
+    if (keep && program == s->program) {
+        diag_status(ctx, "Semantic analysis successful\n");
+        ob_write(out, s->asm_text.data, s->asm_text.len);
+        ctx->msgs = NULL;
+        return 0;
+    }
+
+    build_program(ctx, s);
+    int rc = 0;
+    if (check_chunks(ctx, s) > 0) {
+        diag_error(ctx, "Compilation failed due to semantic errors\n");
+        rc = 1;
+    } else {
+        rc = compile_tree(ctx, opt, out);
+    }
+
+    s->program = 0;
+    if (rc == 0 && keep) {
+        s->program = program;
+        ob_reset(&s->asm_text);
+        ob_write(&s->asm_text, out->data, out->len);
+    }
+    ctx->msgs = NULL;
+    return rc;
+}
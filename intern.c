@@ -0,0 +1,124 @@
+#include "ast.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+
+typedef struct AtomEntry {
+    const char *str;
+    unsigned len;
+    unsigned hash;
+} AtomEntry;
+
+
+// Each thread has its own table; strings live until intern_free
+static _Thread_local Arena intern_arena;
+
+static _Thread_local AtomEntry *atoms = NULL;     // indexed by atom, slot 0 is ATOM_NONE
+static _Thread_local int atom_cap = 0;
+static _Thread_local int atom_next = 1;
+
+static _Thread_local Atom *slots = NULL;          // open addressing, 0 = empty
+static _Thread_local unsigned slot_mask = 0;
+
+
+static unsigned hash_bytes(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+static void grow_slots(void) {
+    unsigned cap = slot_mask ? (slot_mask + 1) * 2 : 1024;
+    Atom *n = calloc(cap, sizeof(Atom));
+    if (!n) {
+        fprintf(stderr, "Fatal error: out of memory\n");
+        exit(1);
+    }
+
+    for (Atom a = 1; a < atom_next; a++) {
+        unsigned i = atoms[a].hash & (cap - 1);
+        while (n[i])
+            i = (i + 1) & (cap - 1);
+        n[i] = a;
+    }
+
+    free(slots);
+    slots = n;
+    slot_mask = cap - 1;
+}
+
+
+Atom intern(const char *s, size_t len) {
+    unsigned h = hash_bytes(s, len);
+
+    if (slots) {
+        unsigned i = h & slot_mask;
+        for (Atom a; (a = slots[i]); i = (i + 1) & slot_mask) {
+            AtomEntry *e = &atoms[a];
+            if (e->hash == h && e->len == len && memcmp(e->str, s, len) == 0)
+                return a;
+        }
+    }
+
+    // Keep the load factor under one half
+    if ((unsigned)atom_next * 2 >= slot_mask + 1)
+        grow_slots();
+
+    if (atom_next >= atom_cap) {
+        atom_cap = atom_cap ? atom_cap * 2 : 1024;
+        atoms = xrealloc(atoms, atom_cap * sizeof(AtomEntry));
+    }
+
+    Atom a = atom_next++;
+    atoms[a].str = arena_strndup(&intern_arena, s, len);
+    atoms[a].len = len;
+    atoms[a].hash = h;
+
+    unsigned i = h & slot_mask;
+    while (slots[i])
+        i = (i + 1) & slot_mask;
+    slots[i] = a;
+    return a;
+}
+
+
+Atom intern_cstr(const char *s) {
+    return intern(s, strlen(s));
+}
+
+
+const char *atom_str(Atom a) {
+    return a > 0 && a < atom_next ? atoms[a].str : "";
+}
+
+
+unsigned atom_len(Atom a) {
+    return a > 0 && a < atom_next ? atoms[a].len : 0;
+}
+
+
+unsigned atom_hash(Atom a) {
+    return atoms[a].hash;
+}
+
+
+int atom_count(void) {
+    return atom_next - 1;
+}
+
+
+void intern_free(void) {
+    arena_free(&intern_arena);
+    free(atoms);
+    free(slots);
+    atoms = NULL;
+    atom_cap = 0;
+    atom_next = 1;
+    slots = NULL;
+    slot_mask = 0;
+}
@@ -0,0 +1,667 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * AST to SSA lowering and the CFG utilities the passes share.
+ *
+ * SSA is built on the fly while lowering (Braun et al., "Simple and
+ * Efficient Construction of Static Single Assignment Form"): the
+ * current value of every variable is tracked per block, and reading a
+ * variable a block does not define looks through its predecessors,
+ * placing a phi where they meet. Blocks whose predecessors are not all
+ * known yet (loop headers) get placeholder phis that are completed when
+ * the block is sealed. Trivial phis are left for copyprop.
+ *
+ * Variables are flat by atom, like the slots the code used to live in:
+ * a `let` in an inner block updates the same variable.
+ */
+
+void ir_init(IrFunc *f) {
+    memset(f, 0, sizeof(*f));
+    arena_init(&f->arena);
+    ir_reset(f);
+}
+
+
+void ir_reset(IrFunc *f) {
+    // Block arrays are kept for the next compilation
+    for (int b = 0; b < f->nblocks; b++) {
+        f->blocks[b].nphis = 0;
+        f->blocks[b].len = 0;
+        f->blocks[b].npreds = 0;
+    }
+    f->nblocks = 0;
+    f->nrpo = 0;
+    f->nvals = 1;
+    arena_reset(&f->arena);
+}
+
+
+void ir_free(IrFunc *f) {
+    for (int b = 0; b < f->block_cap; b++) {
+        free(f->blocks[b].phis);
+        free(f->blocks[b].insts);
+        free(f->blocks[b].preds);
+    }
+    free(f->blocks);
+    free(f->rpo);
+    free(f->val_var);
+    arena_free(&f->arena);
+    memset(f, 0, sizeof(*f));
+}
+
+
+int ir_new_block(IrFunc *f) {
+    if (f->nblocks == f->block_cap) {
+        int old = f->block_cap;
+        f->block_cap = old ? old * 2 : 64;
+        f->blocks = xrealloc(f->blocks, f->block_cap * sizeof(IrBlock));
+        memset(f->blocks + old, 0, (f->block_cap - old) * sizeof(IrBlock));
+    }
+
+    IrBlock *b = &f->blocks[f->nblocks];
+    b->nphis = 0;
+    b->len = 0;
+    b->npreds = 0;
+    b->nsucc = 0;
+    b->idom = -1;
+    b->order = -1;
+    b->sealed = 0;
+    return f->nblocks++;
+}
+
+
+int ir_new_value(IrFunc *f, Atom var) {
+    if (f->nvals >= f->val_cap) {
+        f->val_cap = f->val_cap ? f->val_cap * 2 : 1024;
+        f->val_var = xrealloc(f->val_var, f->val_cap * sizeof(Atom));
+    }
+    f->val_var[f->nvals] = var;
+    return f->nvals++;
+}
+
+
+IrInst *ir_emit(IrFunc *f, int block, IrOp op, int dst, IrArg a, IrArg b) {
+    IrBlock *bb = &f->blocks[block];
+    if (bb->len == bb->cap) {
+        bb->cap = bb->cap ? bb->cap * 2 : 16;
+        bb->insts = xrealloc(bb->insts, bb->cap * sizeof(IrInst));
+    }
+
+    IrInst *in = &bb->insts[bb->len++];
+    in->op = op;
+    in->dst = dst;
+    in->a = a;
+    in->b = b;
+    in->phi = NULL;
+    return in;
+}
+
+
+static int new_phi(IrFunc *f, int block, Atom var) {
+    IrBlock *bb = &f->blocks[block];
+    if (bb->nphis == bb->phi_cap) {
+        bb->phi_cap = bb->phi_cap ? bb->phi_cap * 2 : 8;
+        bb->phis = xrealloc(bb->phis, bb->phi_cap * sizeof(IrInst));
+    }
+
+    IrInst *phi = &bb->phis[bb->nphis];
+    memset(phi, 0, sizeof(*phi));
+    phi->op = IR_PHI;
+    phi->dst = ir_new_value(f, var);
+    return bb->nphis++;
+}
+
+
+void ir_add_edge(IrFunc *f, int from, int to) {
+    IrBlock *t = &f->blocks[to];
+    if (t->npreds == t->pred_cap) {
+        t->pred_cap = t->pred_cap ? t->pred_cap * 2 : 4;
+        t->preds = xrealloc(t->preds, t->pred_cap * sizeof(int));
+    }
+    t->preds[t->npreds++] = from;
+    f->blocks[from].succ[f->blocks[from].nsucc++] = to;
+}
+
+
+void ir_remove_edge(IrFunc *f, int from, int to) {
+    IrBlock *fb = &f->blocks[from];
+    for (int i = 0; i < fb->nsucc; i++) {
+        if (fb->succ[i] == to) {
+            fb->succ[i] = fb->succ[--fb->nsucc];
+            break;
+        }
+    }
+
+    IrBlock *tb = &f->blocks[to];
+    for (int i = 0; i < tb->npreds; i++) {
+        if (tb->preds[i] != from) continue;
+
+        for (int j = i + 1; j < tb->npreds; j++)
+            tb->preds[j - 1] = tb->preds[j];
+        for (int p = 0; p < tb->nphis; p++) {
+            IrArg *args = tb->phis[p].phi;
+            for (int j = i + 1; j < tb->npreds; j++)
+                args[j - 1] = args[j];
+        }
+        tb->npreds--;
+        break;
+    }
+}
+
+
+int ir_fold(int op, int a, int b, int *r) {
+    switch (op) {
+        case IR_ADD: *r = (short)(a + b); return 1;
+        case IR_SUB: *r = (short)(a - b); return 1;
+        case IR_MUL: *r = (short)(a * b); return 1;
+
+        case IR_DIV:
+            if ((unsigned short)b == 0) return 0;
+            *r = (short)((unsigned short)a / (unsigned short)b);
+            return 1;
+
+        case IR_POW: {
+            int p = 1;
+            for (int i = 0; i < b; i++)
+                p = (short)(p * a);
+            *r = p;
+            return 1;
+        }
+
+        case IR_SHL: *r = (short)((unsigned short)a << b); return 1;
+        case IR_SHR: *r = (short)((unsigned short)a >> b); return 1;
+
+        case IR_GT: *r = a > b; return 1;
+        case IR_LT: *r = a < b; return 1;
+        case IR_GE: *r = a >= b; return 1;
+        case IR_LE: *r = a <= b; return 1;
+        case IR_EQ: *r = a == b; return 1;
+        case IR_NE: *r = a != b; return 1;
+    }
+    return 0;
+}
+
+
+/* ---- SSA construction ---- */
+
+typedef struct DefSlot {
+    int block;              // -1 = empty
+    Atom var;
+    IrArg val;
+} DefSlot;
+
+typedef struct Pending {
+    int block;
+    Atom var;
+    int phi;
+} Pending;
+
+static _Thread_local DefSlot *defs = NULL;        // (block, var) -> current value
+static _Thread_local unsigned def_mask = 0;
+static _Thread_local unsigned def_used = 0;
+
+static _Thread_local Pending *pending = NULL;     // phis of unsealed blocks
+static _Thread_local int pending_len = 0;
+static _Thread_local int pending_cap = 0;
+
+static _Thread_local int cur;                     // block being filled
+
+
+static unsigned def_hash(int block, Atom var) {
+    return ((unsigned)block * 2654435761u) ^ ((unsigned)var * 40503u);
+}
+
+static DefSlot *def_slot(int block, Atom var) {
+    unsigned i = def_hash(block, var) & def_mask;
+    while (defs[i].block >= 0 && (defs[i].block != block || defs[i].var != var))
+        i = (i + 1) & def_mask;
+    return &defs[i];
+}
+
+static void defs_clear(unsigned cap) {
+    defs = xrealloc(defs, cap * sizeof(DefSlot));
+    for (unsigned i = 0; i < cap; i++)
+        defs[i].block = -1;
+    def_mask = cap - 1;
+    def_used = 0;
+}
+
+static void write_var(Atom var, int block, IrArg v) {
+    if ((def_used + 1) * 2 > def_mask + 1) {
+        DefSlot *old = defs;
+        unsigned old_cap = def_mask + 1;
+        defs = NULL;
+        defs_clear(old_cap * 2);
+        for (unsigned i = 0; i < old_cap; i++) {
+            if (old[i].block < 0) continue;
+            *def_slot(old[i].block, old[i].var) = old[i];
+            def_used++;
+        }
+        free(old);
+    }
+
+    DefSlot *s = def_slot(block, var);
+    if (s->block < 0) {
+        s->block = block;
+        s->var = var;
+        def_used++;
+    }
+    s->val = v;
+}
+
+
+static IrArg read_var(IrFunc *f, Atom var, int block);
+
+static void add_phi_operands(IrFunc *f, Atom var, int block, int phi) {
+    int n = f->blocks[block].npreds;
+    IrArg *args = arena_alloc(&f->arena, (n ? n : 1) * sizeof(IrArg));
+
+    // Reading may add phis to this block, so look the phi up afterwards
+    for (int i = 0; i < n; i++)
+        args[i] = read_var(f, var, f->blocks[block].preds[i]);
+    f->blocks[block].phis[phi].phi = args;
+}
+
+static IrArg read_var(IrFunc *f, Atom var, int block) {
+    DefSlot *s = def_slot(block, var);
+    if (s->block >= 0)
+        return s->val;
+
+    IrBlock *bb = &f->blocks[block];
+    IrArg v;
+
+    if (!bb->sealed) {
+        int phi = new_phi(f, block, var);
+        if (pending_len == pending_cap) {
+            pending_cap = pending_cap ? pending_cap * 2 : 64;
+            pending = xrealloc(pending, pending_cap * sizeof(Pending));
+        }
+        pending[pending_len].block = block;
+        pending[pending_len].var = var;
+        pending[pending_len].phi = phi;
+        pending_len++;
+        v = ir_val(bb->phis[phi].dst);
+    } else if (bb->npreds == 0) {
+        // Never assigned on this path: memory started out zeroed
+        v = ir_const(0);
+    } else if (bb->npreds == 1) {
+        v = read_var(f, var, bb->preds[0]);
+    } else {
+        int phi = new_phi(f, block, var);
+        v = ir_val(f->blocks[block].phis[phi].dst);
+        write_var(var, block, v);
+        add_phi_operands(f, var, block, phi);
+    }
+
+    write_var(var, block, v);
+    return v;
+}
+
+static void seal(IrFunc *f, int block) {
+    int keep = 0;
+    for (int i = 0; i < pending_len; i++) {
+        Pending p = pending[i];
+        if (p.block == block)
+            add_phi_operands(f, p.var, p.block, p.phi);
+        else
+            pending[keep++] = p;
+    }
+    pending_len = keep;
+    f->blocks[block].sealed = 1;
+}
+
+
+/* ---- Lowering ---- */
+
+static int binop_to_ir(char op) {
+    switch (op) {
+        case '+': return IR_ADD;
+        case '-': return IR_SUB;
+        case '*': return IR_MUL;
+        case '/': return IR_DIV;
+        case '^': return IR_POW;
+        case '>': return IR_GT;
+        case '<': return IR_LT;
+        case 'G': return IR_GE;
+        case 'L': return IR_LE;
+        case 'E': return IR_EQ;
+        default:  return IR_NE;
+    }
+}
+
+
+static IrArg lower_expr(IrFunc *f, const AST *t, NodeId n) {
+    switch (t->kind[n]) {
+        case NODE_LITERAL: {
+            if (t->aux[n] == TYPE_STRING) {
+                IrArg s = { ARG_STR, (int)t->a[n] };
+                return s;
+            }
+            return ir_const((int)t->a[n]);
+        }
+
+        case NODE_ID:
+            return read_var(f, t->a[n], cur);
+
+        case NODE_BINOP: {
+            IrArg a = lower_expr(f, t, t->a[n]);
+            IrArg b = lower_expr(f, t, t->b[n]);
+            int d = ir_new_value(f, ATOM_NONE);
+            ir_emit(f, cur, binop_to_ir(t->aux[n]), d, a, b);
+            return ir_val(d);
+        }
+
+        default:
+            return ir_const(0);
+    }
+}
+
+
+static const IrArg no_arg = { ARG_NONE, 0 };
+
+static void jump(IrFunc *f, int to) {
+    ir_emit(f, cur, IR_JMP, 0, no_arg, no_arg);
+    ir_add_edge(f, cur, to);
+}
+
+static void branch(IrFunc *f, IrArg cond, int yes, int no) {
+    ir_emit(f, cur, IR_BR, 0, cond, no_arg);
+    ir_add_edge(f, cur, yes);
+    ir_add_edge(f, cur, no);
+}
+
+
+static void lower_stmt(IrFunc *f, const AST *t, NodeId n);
+
+/*
+ * for var = from to bound [ body ] becomes
+ *
+ *   cur:     var = from; limit = bound; br var <= limit, pre, exit
+ *   pre:     jmp body
+ *   body:    ...; var = var + 1; br var <= limit, body, exit
+ *   exit:
+ *
+ * The bound is evaluated once. `pre` is the loop's preheader, the place
+ * licm moves invariant code to.
+ */
+static void lower_for(IrFunc *f, const AST *t, NodeId n) {
+    Atom var = t->a[n];
+
+    write_var(var, cur, lower_expr(f, t, t->b[n]));
+    IrArg limit = lower_expr(f, t, ast_for_to(t, n));
+
+    int pre = ir_new_block(f);
+    int body = ir_new_block(f);
+    int exit = ir_new_block(f);
+
+    int c = ir_new_value(f, ATOM_NONE);
+    ir_emit(f, cur, IR_LE, c, read_var(f, var, cur), limit);
+    branch(f, ir_val(c), pre, exit);
+
+    seal(f, pre);
+    cur = pre;
+    jump(f, body);
+
+    cur = body;
+    lower_stmt(f, t, ast_for_body(t, n));
+
+    int next = ir_new_value(f, var);
+    ir_emit(f, cur, IR_ADD, next, read_var(f, var, cur), ir_const(1));
+    write_var(var, cur, ir_val(next));
+
+    c = ir_new_value(f, ATOM_NONE);
+    ir_emit(f, cur, IR_LE, c, ir_val(next), limit);
+    branch(f, ir_val(c), body, exit);
+
+    seal(f, body);
+    seal(f, exit);
+    cur = exit;
+}
+
+
+static void lower_stmt(IrFunc *f, const AST *t, NodeId n) {
+    if (!n) return;
+
+    switch (t->kind[n]) {
+        case NODE_STMT_LIST:
+        case NODE_BLOCK:
+            for (unsigned i = 0; i < t->b[n]; i++)
+                lower_stmt(f, t, t->extra[t->a[n] + i]);
+            break;
+
+        case NODE_DECL: {
+            IrArg v = lower_expr(f, t, t->b[n]);
+            if (v.kind == ARG_VAL && !f->val_var[v.val])
+                f->val_var[v.val] = t->a[n];
+            write_var(t->a[n], cur, v);
+            break;
+        }
+
+        case NODE_PRINT: {
+            IrArg v = lower_expr(f, t, t->a[n]);
+            ir_emit(f, cur, t->aux[n] == TYPE_STRING ? IR_PRINTS : IR_PRINT, 0,
+                    v, no_arg);
+            break;
+        }
+
+        case NODE_IF: {
+            IrArg cond = lower_expr(f, t, t->a[n]);
+            int yes = ir_new_block(f);
+            int join = ir_new_block(f);
+            int no = t->c[n] ? ir_new_block(f) : join;
+
+            branch(f, cond, yes, no);
+            seal(f, yes);
+            cur = yes;
+            lower_stmt(f, t, t->b[n]);
+            jump(f, join);
+
+            if (t->c[n]) {
+                seal(f, no);
+                cur = no;
+                lower_stmt(f, t, t->c[n]);
+                jump(f, join);
+            }
+
+            seal(f, join);
+            cur = join;
+            break;
+        }
+
+        case NODE_FOR:
+            lower_for(f, t, n);
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+void ir_lower(IrFunc *f, const AST *t) {
+    ir_reset(f);
+    defs_clear(1024);
+    pending_len = 0;
+
+    cur = ir_new_block(f);
+    f->blocks[cur].sealed = 1;
+    lower_stmt(f, t, t->root);
+    ir_emit(f, cur, IR_RET, 0, no_arg, no_arg);
+
+    ir_compute_order(f);
+    ir_compute_dominators(f);
+}
+
+
+/* ---- CFG order and dominators ---- */
+
+void ir_compute_order(IrFunc *f) {
+    static _Thread_local int *stack = NULL, *next_succ = NULL;
+    static _Thread_local int cap = 0;
+
+    if (f->nblocks > cap) {
+        cap = f->nblocks;
+        stack = xrealloc(stack, cap * sizeof(int));
+        next_succ = xrealloc(next_succ, cap * sizeof(int));
+    }
+    f->rpo = xrealloc(f->rpo, (f->nblocks ? f->nblocks : 1) * sizeof(int));
+
+    for (int b = 0; b < f->nblocks; b++) {
+        f->blocks[b].order = -1;
+        next_succ[b] = -1;
+    }
+
+    // Iterative DFS; postorder is written from the back of rpo
+    int sp = 0, post = f->nblocks;
+    stack[sp++] = 0;
+    next_succ[0] = 0;
+    while (sp) {
+        int b = stack[sp - 1];
+        IrBlock *bb = &f->blocks[b];
+        if (next_succ[b] < bb->nsucc) {
+            int s = bb->succ[next_succ[b]++];
+            if (next_succ[s] < 0) {
+                next_succ[s] = 0;
+                stack[sp++] = s;
+            }
+        } else {
+            f->rpo[--post] = b;
+            sp--;
+        }
+    }
+
+    f->nrpo = f->nblocks - post;
+    memmove(f->rpo, f->rpo + post, f->nrpo * sizeof(int));
+    for (int i = 0; i < f->nrpo; i++)
+        f->blocks[f->rpo[i]].order = i;
+}
+
+
+static int intersect(const IrFunc *f, int a, int b) {
+    while (a != b) {
+        while (f->blocks[a].order > f->blocks[b].order)
+            a = f->blocks[a].idom;
+        while (f->blocks[b].order > f->blocks[a].order)
+            b = f->blocks[b].idom;
+    }
+    return a;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+void ir_compute_dominators(IrFunc *f) {
+    for (int b = 0; b < f->nblocks; b++)
+        f->blocks[b].idom = -1;
+    if (!f->nrpo) return;
+
+    f->blocks[0].idom = 0;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 1; i < f->nrpo; i++) {
+            int b = f->rpo[i];
+            IrBlock *bb = &f->blocks[b];
+            int idom = -1;
+
+            for (int p = 0; p < bb->npreds; p++) {
+                int pred = bb->preds[p];
+                if (f->blocks[pred].order < 0 || f->blocks[pred].idom < 0)
+                    continue;
+                idom = idom < 0 ? pred : intersect(f, pred, idom);
+            }
+            if (idom != bb->idom) {
+                bb->idom = idom;
+                changed = 1;
+            }
+        }
+    }
+    f->blocks[0].idom = -1;
+}
+
+
+int ir_dominates(const IrFunc *f, int a, int b) {
+    while (b >= 0 && f->blocks[b].order > f->blocks[a].order)
+        b = f->blocks[b].idom;
+    return b == a;
+}
+
+
+/* ---- Dump ---- */
+
+static const char *ir_op_name[] = {
+    "nop", "copy", "add", "sub", "mul", "div", "pow", "shl", "shr",
+    "gt", "lt", "ge", "le", "eq", "ne", "phi", "print", "prints",
+    "jmp", "br", "ret"
+};
+
+static void dump_arg(const IrArg *a, FILE *out) {
+    switch (a->kind) {
+        case ARG_VAL:   fprintf(out, "v%d", a->val); break;
+        case ARG_CONST: fprintf(out, "%d", a->val); break;
+        case ARG_STR:   fprintf(out, "\"%s\"", atom_str(a->val)); break;
+        default: break;
+    }
+}
+
+static void dump_var(const IrFunc *f, int v, FILE *out) {
+    if (f->val_var[v])
+        fprintf(out, "    ; %s", atom_str(f->val_var[v]));
+    fprintf(out, "\n");
+}
+
+void ir_dump(const IrFunc *f, FILE *out) {
+    for (int i = 0; i < f->nrpo; i++) {
+        int b = f->rpo[i];
+        const IrBlock *bb = &f->blocks[b];
+
+        fprintf(out, "B%d:", b);
+        if (bb->npreds) {
+            fprintf(out, "    ; preds");
+            for (int p = 0; p < bb->npreds; p++)
+                fprintf(out, " B%d", bb->preds[p]);
+        }
+        fprintf(out, "\n");
+
+        for (int p = 0; p < bb->nphis; p++) {
+            const IrInst *phi = &bb->phis[p];
+            if (phi->op != IR_PHI) continue;
+            fprintf(out, "    v%d = phi", phi->dst);
+            for (int k = 0; k < bb->npreds; k++) {
+                fprintf(out, k ? ", [" : " [");
+                dump_arg(&phi->phi[k], out);
+                fprintf(out, ", B%d]", bb->preds[k]);
+            }
+            dump_var(f, phi->dst, out);
+        }
+
+        for (int k = 0; k < bb->len; k++) {
+            const IrInst *in = &bb->insts[k];
+            if (in->op == IR_NOP) continue;
+
+            fprintf(out, "    ");
+            if (in->dst)
+                fprintf(out, "v%d = ", in->dst);
+            fprintf(out, "%s", ir_op_name[in->op]);
+            if (in->a.kind) {
+                fprintf(out, " ");
+                dump_arg(&in->a, out);
+            }
+            if (in->b.kind) {
+                fprintf(out, ", ");
+                dump_arg(&in->b, out);
+            }
+            if (in->op == IR_JMP)
+                fprintf(out, " B%d", bb->succ[0]);
+            else if (in->op == IR_BR)
+                fprintf(out, ", B%d, B%d", bb->succ[0], bb->succ[1]);
+
+            if (in->dst)
+                dump_var(f, in->dst, out);
+            else
+                fprintf(out, "\n");
+        }
+    }
+}
@@ -0,0 +1,748 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/*
+ * Optimization passes over the SSA IR and the pass manager that runs
+ * them in a configurable order.
+ *
+ * Passes that replace a value with another record it in repl[] and
+ * rewrite every use at the end (apply_repl), so instructions never need
+ * def-use chains. Removed instructions and phis become IR_NOP in place.
+ * A pass that changes the CFG recomputes rpo and dominators before it
+ * returns; the others leave them valid.
+ */
+
+static _Thread_local IrArg *repl = NULL;          // by value, kind ARG_NONE = keep
+static _Thread_local int *def_block = NULL;       // by value
+static _Thread_local int val_cap = 0;
+
+static void grow_value_maps(const IrFunc *f) {
+    if (f->nvals > val_cap) {
+        val_cap = f->nvals * 2;
+        repl = xrealloc(repl, val_cap * sizeof(IrArg));
+        def_block = xrealloc(def_block, val_cap * sizeof(int));
+    }
+}
+
+static void repl_clear(const IrFunc *f) {
+    grow_value_maps(f);
+    memset(repl, 0, f->nvals * sizeof(IrArg));
+}
+
+static IrArg resolve(IrArg a) {
+    while (a.kind == ARG_VAL && repl[a.val].kind != ARG_NONE)
+        a = repl[a.val];
+    return a;
+}
+
+static void replace(int v, IrArg with) {
+    repl[v] = with;
+}
+
+static void apply_repl(IrFunc *f) {
+    for (int i = 0; i < f->nrpo; i++) {
+        IrBlock *bb = &f->blocks[f->rpo[i]];
+        for (int p = 0; p < bb->nphis; p++) {
+            if (bb->phis[p].op != IR_PHI) continue;
+            for (int k = 0; k < bb->npreds; k++)
+                bb->phis[p].phi[k] = resolve(bb->phis[p].phi[k]);
+        }
+        for (int k = 0; k < bb->len; k++) {
+            bb->insts[k].a = resolve(bb->insts[k].a);
+            bb->insts[k].b = resolve(bb->insts[k].b);
+        }
+    }
+}
+
+static int same_arg(IrArg x, IrArg y) {
+    return x.kind == y.kind && x.val == y.val;
+}
+
+/* The single argument a phi merges, ignoring references to itself */
+static int phi_unique(const IrBlock *bb, const IrInst *phi, IrArg *out) {
+    int found = 0;
+    for (int k = 0; k < bb->npreds; k++) {
+        IrArg a = resolve(phi->phi[k]);
+        if (a.kind == ARG_VAL && a.val == phi->dst) continue;
+        if (found && !same_arg(a, *out)) return 0;
+        *out = a;
+        found = 1;
+    }
+    if (!found)
+        *out = ir_const(0);
+    return 1;
+}
+
+static void index_defs(const IrFunc *f) {
+    grow_value_maps(f);
+    for (int i = 0; i < f->nrpo; i++) {
+        int b = f->rpo[i];
+        const IrBlock *bb = &f->blocks[b];
+        for (int p = 0; p < bb->nphis; p++)
+            def_block[bb->phis[p].dst] = b;
+        for (int k = 0; k < bb->len; k++)
+            if (bb->insts[k].dst)
+                def_block[bb->insts[k].dst] = b;
+    }
+}
+
+
+/* ---- Constant propagation ---- */
+
+static int log2_exact(int v) {
+    unsigned u = (unsigned short)v;
+    if (!u || (u & (u - 1))) return -1;
+    int k = 0;
+    while ((1u << k) < u)
+        k++;
+    return k;
+}
+
+/*
+ * x + 0, x - 0, x * 1, x / 1 -> x; x * 0 -> 0; multiplies and divides
+ * by a power of two become shifts. Returns 1 if in was rewritten.
+ */
+static int simplify(IrInst *in) {
+    IrArg a = in->a, b = in->b;
+    int bc = b.kind == ARG_CONST;
+
+    if (in->op == IR_MUL && a.kind == ARG_CONST && !bc) {
+        in->a = b;
+        in->b = a;
+        a = in->a;
+        b = in->b;
+        bc = 1;
+    }
+    if (in->op == IR_ADD && a.kind == ARG_CONST && a.val == 0) {
+        replace(in->dst, b);
+        in->op = IR_NOP;
+        return 1;
+    }
+    if (!bc) return 0;
+
+    switch (in->op) {
+        case IR_ADD:
+        case IR_SUB:
+            if (b.val != 0) return 0;
+            break;
+
+        case IR_MUL:
+            if (b.val == 0) {
+                replace(in->dst, ir_const(0));
+                in->op = IR_NOP;
+                return 1;
+            }
+            if (b.val == 1) break;
+            if (log2_exact(b.val) < 0) return 0;
+            in->op = IR_SHL;
+            in->b = ir_const(log2_exact(b.val));
+            return 1;
+
+        case IR_DIV:
+            if (b.val == 1) break;
+            if (log2_exact(b.val) < 0) return 0;
+            in->op = IR_SHR;
+            in->b = ir_const(log2_exact(b.val));
+            return 1;
+
+        case IR_SHL:
+        case IR_SHR:
+            if (b.val != 0) return 0;
+            break;
+
+        default:
+            return 0;
+    }
+
+    replace(in->dst, a);
+    in->op = IR_NOP;
+    return 1;
+}
+
+static void drop_unreachable(IrFunc *f) {
+    for (int b = 0; b < f->nblocks; b++) {
+        IrBlock *bb = &f->blocks[b];
+        if (bb->order >= 0) continue;
+
+        while (bb->nsucc)
+            ir_remove_edge(f, b, bb->succ[0]);
+        bb->len = 0;
+        bb->nphis = 0;
+    }
+}
+
+static int constprop_block(IrFunc *f, int b) {
+    IrBlock *bb = &f->blocks[b];
+    int changed = 0;
+
+    for (int p = 0; p < bb->nphis; p++) {
+        IrInst *phi = &bb->phis[p];
+        IrArg u;
+        if (phi->op == IR_PHI && phi_unique(bb, phi, &u) && u.kind == ARG_CONST) {
+            replace(phi->dst, u);
+            phi->op = IR_NOP;
+            changed = 1;
+        }
+    }
+
+    for (int k = 0; k < bb->len; k++) {
+        IrInst *in = &bb->insts[k];
+        in->a = resolve(in->a);
+        in->b = resolve(in->b);
+
+        if (in->op == IR_BR && in->a.kind == ARG_CONST) {
+            int keep = in->a.val ? bb->succ[0] : bb->succ[1];
+            int drop = in->a.val ? bb->succ[1] : bb->succ[0];
+            in->op = IR_JMP;
+            in->a.kind = ARG_NONE;
+            if (keep != drop)
+                ir_remove_edge(f, b, drop);
+            bb = &f->blocks[b];
+            changed = 1;
+            continue;
+        }
+        if (!ir_is_removable(in)) continue;
+
+        int r;
+        if (in->op == IR_COPY && in->a.kind == ARG_CONST) {
+            replace(in->dst, in->a);
+            in->op = IR_NOP;
+            changed = 1;
+        } else if (in->a.kind == ARG_CONST && in->b.kind == ARG_CONST &&
+                   ir_fold(in->op, in->a.val, in->b.val, &r)) {
+            replace(in->dst, ir_const(r));
+            in->op = IR_NOP;
+            changed = 1;
+        } else if (simplify(in)) {
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+static void pass_constprop(IrFunc *f) {
+    repl_clear(f);
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < f->nrpo; i++)
+            changed |= constprop_block(f, f->rpo[i]);
+
+        if (changed) {
+            ir_compute_order(f);
+            drop_unreachable(f);
+            ir_compute_order(f);
+        }
+    }
+    apply_repl(f);
+    ir_compute_dominators(f);
+}
+
+
+/* ---- Copy propagation ---- */
+
+static void pass_copyprop(IrFunc *f) {
+    repl_clear(f);
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < f->nrpo; i++) {
+            IrBlock *bb = &f->blocks[f->rpo[i]];
+
+            for (int p = 0; p < bb->nphis; p++) {
+                IrInst *phi = &bb->phis[p];
+                IrArg u;
+                if (phi->op == IR_PHI && phi_unique(bb, phi, &u)) {
+                    replace(phi->dst, u);
+                    phi->op = IR_NOP;
+                    changed = 1;
+                }
+            }
+            for (int k = 0; k < bb->len; k++) {
+                IrInst *in = &bb->insts[k];
+                if (in->op == IR_COPY) {
+                    replace(in->dst, resolve(in->a));
+                    in->op = IR_NOP;
+                    changed = 1;
+                }
+            }
+        }
+    }
+    apply_repl(f);
+}
+
+
+/* ---- Common subexpression elimination ---- */
+
+/*
+ * Walks the dominator tree with a scoped hash of (op, a, b): an
+ * expression computed in a block is available in every block it
+ * dominates. Entries are removed in the reverse order they were added,
+ * which keeps linear probing consistent.
+ */
+typedef struct Expr {
+    unsigned char op;
+    IrArg a;
+    IrArg b;
+    int dst;                // 0 = empty
+} Expr;
+
+static _Thread_local Expr *exprs = NULL;
+static _Thread_local unsigned expr_mask = 0;
+static _Thread_local unsigned *expr_log = NULL;   // slots in insertion order
+static _Thread_local int expr_log_len = 0;
+static _Thread_local int expr_log_cap = 0;
+
+static _Thread_local int *dom_child = NULL;       // children of each block, by first[]
+static _Thread_local int *dom_first = NULL;
+static _Thread_local int *walk = NULL;            // dfs stack, entries are ~b on exit
+static _Thread_local int dom_cap = 0;
+
+
+static unsigned expr_hash(int op, IrArg a, IrArg b) {
+    unsigned h = (unsigned)op * 31u;
+    h = (h ^ ((unsigned)a.kind << 16 ^ (unsigned)a.val)) * 2654435761u;
+    h = (h ^ ((unsigned)b.kind << 16 ^ (unsigned)b.val)) * 2654435761u;
+    return h ^ (h >> 15);
+}
+
+static unsigned expr_slot(int op, IrArg a, IrArg b) {
+    unsigned i = expr_hash(op, a, b) & expr_mask;
+    while (exprs[i].dst && !(exprs[i].op == op && same_arg(exprs[i].a, a) &&
+                             same_arg(exprs[i].b, b)))
+        i = (i + 1) & expr_mask;
+    return i;
+}
+
+static int commutes(int op) {
+    return op == IR_ADD || op == IR_MUL || op == IR_EQ || op == IR_NE;
+}
+
+static void build_dom_tree(const IrFunc *f) {
+    if (f->nblocks + 1 > dom_cap) {
+        dom_cap = (f->nblocks + 1) * 2;
+        dom_child = xrealloc(dom_child, dom_cap * sizeof(int));
+        dom_first = xrealloc(dom_first, dom_cap * sizeof(int));
+        walk = xrealloc(walk, dom_cap * 2 * sizeof(int));
+    }
+
+    // Children of b are dom_child[dom_first[b] .. dom_first[b + 1]]
+    memset(dom_first, 0, (f->nblocks + 1) * sizeof(int));
+    for (int i = 1; i < f->nrpo; i++)
+        dom_first[f->blocks[f->rpo[i]].idom + 1]++;
+    for (int b = 0; b < f->nblocks; b++)
+        dom_first[b + 1] += dom_first[b];
+
+    // walk[] is free until the dfs starts; children end up in rpo order
+    memcpy(walk, dom_first, f->nblocks * sizeof(int));
+    for (int i = 1; i < f->nrpo; i++) {
+        int b = f->rpo[i];
+        dom_child[walk[f->blocks[b].idom]++] = b;
+    }
+}
+
+
+static void pass_cse(IrFunc *f) {
+    if (!f->nrpo) return;
+    repl_clear(f);
+    build_dom_tree(f);
+
+    unsigned need = 64;
+    while (need < (unsigned)f->nvals * 2)
+        need *= 2;
+    if (need > expr_mask + 1 || !exprs) {
+        exprs = xrealloc(exprs, need * sizeof(Expr));
+        expr_mask = need - 1;
+    }
+    memset(exprs, 0, (expr_mask + 1) * sizeof(Expr));
+    if (f->nvals > expr_log_cap) {
+        expr_log_cap = f->nvals;
+        expr_log = xrealloc(expr_log, expr_log_cap * sizeof(unsigned));
+    }
+    expr_log_len = 0;
+
+    static _Thread_local int *marks = NULL;
+    static _Thread_local int marks_cap = 0;
+    if (f->nblocks > marks_cap) {
+        marks_cap = f->nblocks;
+        marks = xrealloc(marks, marks_cap * sizeof(int));
+    }
+
+    int sp = 0;
+    walk[sp++] = 0;
+    while (sp) {
+        int e = walk[--sp];
+        if (e < 0) {
+            // Leaving the block: forget what it made available
+            int b = ~e;
+            while (expr_log_len > marks[b])
+                exprs[expr_log[--expr_log_len]].dst = 0;
+            continue;
+        }
+
+        IrBlock *bb = &f->blocks[e];
+        marks[e] = expr_log_len;
+        for (int k = 0; k < bb->len; k++) {
+            IrInst *in = &bb->insts[k];
+            in->a = resolve(in->a);
+            in->b = resolve(in->b);
+            if (!ir_is_pure(in->op) || in->op == IR_COPY) continue;
+
+            IrArg a = in->a, b = in->b;
+            if (commutes(in->op) && (a.kind > b.kind ||
+                                     (a.kind == b.kind && a.val > b.val))) {
+                a = in->b;
+                b = in->a;
+            }
+
+            unsigned s = expr_slot(in->op, a, b);
+            if (exprs[s].dst) {
+                replace(in->dst, ir_val(exprs[s].dst));
+                in->op = IR_NOP;
+            } else {
+                exprs[s].op = in->op;
+                exprs[s].a = a;
+                exprs[s].b = b;
+                exprs[s].dst = in->dst;
+                expr_log[expr_log_len++] = s;
+            }
+        }
+
+        walk[sp++] = ~e;
+        for (int c = dom_first[e + 1] - 1; c >= dom_first[e]; c--)
+            walk[sp++] = dom_child[c];
+    }
+    apply_repl(f);
+}
+
+
+/* ---- Loop-invariant code motion ---- */
+
+/*
+ * Natural loops are found from back edges (a branch to a block that
+ * dominates it) and handled innermost first, so code hoisted out of an
+ * inner loop lands in its preheader, inside the outer loop, and can
+ * move again. Only loops with a dedicated preheader are touched; the
+ * lowering gives every for loop one.
+ *
+ * A pure instruction is invariant when its operands are constants or
+ * defined outside the loop. A division could fault, and a print before
+ * it in the loop would then be lost, so it moves only if its divisor is
+ * a nonzero constant.
+ *
+ * Each loop is marked again when its turn comes, collecting its blocks,
+ * so the work per loop is proportional to its size rather than to the
+ * whole function.
+ */
+typedef struct Loop {
+    int header;
+    int size;
+} Loop;
+
+static _Thread_local int *loop_of = NULL;         // by block, header of the loop being scanned
+static _Thread_local int *work = NULL;
+static _Thread_local int *body = NULL;            // blocks of that loop
+static _Thread_local Loop *loops = NULL;
+static _Thread_local int loop_cap = 0;
+
+
+static int loop_size_cmp(const void *x, const void *y) {
+    return ((const Loop *)x)->size - ((const Loop *)y)->size;
+}
+
+// Marks the body of the loop headed by h with h and lists its blocks
+// in body, returns its size
+static int mark_loop(IrFunc *f, int h) {
+    int n = 0, size = 1;
+    loop_of[h] = h;
+    body[0] = h;
+
+    IrBlock *hb = &f->blocks[h];
+    for (int p = 0; p < hb->npreds; p++) {
+        int latch = hb->preds[p];
+        if (f->blocks[latch].order >= 0 && ir_dominates(f, h, latch) &&
+            loop_of[latch] != h) {
+            loop_of[latch] = h;
+            work[n++] = latch;
+            body[size++] = latch;
+        }
+    }
+    while (n) {
+        IrBlock *bb = &f->blocks[work[--n]];
+        for (int p = 0; p < bb->npreds; p++) {
+            int q = bb->preds[p];
+            if (loop_of[q] != h && f->blocks[q].order >= 0) {
+                loop_of[q] = h;
+                work[n++] = q;
+                body[size++] = q;
+            }
+        }
+    }
+    return size;
+}
+
+static int operand_outside(IrArg a, int h) {
+    return a.kind != ARG_VAL || loop_of[def_block[a.val]] != h;
+}
+
+static _Thread_local const IrBlock *sort_blocks;
+
+static int by_order(const void *x, const void *y) {
+    return sort_blocks[*(const int *)x].order - sort_blocks[*(const int *)y].order;
+}
+
+static void move_before_terminator(IrFunc *f, int to, IrInst in) {
+    IrBlock *tb = &f->blocks[to];
+    int n = tb->len;
+    ir_emit(f, to, in.op, in.dst, in.a, in.b);
+    tb = &f->blocks[to];
+    IrInst term = tb->insts[n - 1];
+    tb->insts[n - 1] = tb->insts[n];
+    tb->insts[n] = term;
+}
+
+static void hoist(IrFunc *f, int h, int size) {
+    IrBlock *hb = &f->blocks[h];
+    int pre = -1;
+    for (int p = 0; p < hb->npreds; p++) {
+        int q = hb->preds[p];
+        if (loop_of[q] == h) continue;
+        if (pre >= 0) return;
+        pre = q;
+    }
+    if (pre < 0 || f->blocks[pre].nsucc != 1)
+        return;
+
+    // In rpo order definitions come before their uses inside the loop
+    sort_blocks = f->blocks;
+    qsort(body, size, sizeof(int), by_order);
+
+    for (int i = 0; i < size; i++) {
+        int b = body[i];
+        IrBlock *bb = &f->blocks[b];
+        for (int k = 0; k < bb->len; k++) {
+            IrInst *in = &bb->insts[k];
+            if (!ir_is_removable(in) || ir_is_compare(in->op) ||
+                !operand_outside(in->a, h) || !operand_outside(in->b, h))
+                continue;
+
+            IrInst copy = *in;
+            in->op = IR_NOP;
+            move_before_terminator(f, pre, copy);
+            def_block[copy.dst] = pre;
+            bb = &f->blocks[b];
+        }
+    }
+}
+
+static void hoist_loop(IrFunc *f, int h) {
+    int size = mark_loop(f, h);
+    hoist(f, h, size);
+
+    // Clear only what was marked, the rest is still -1
+    for (int i = 0; i < size; i++)
+        loop_of[body[i]] = -1;
+}
+
+static void pass_licm(IrFunc *f) {
+    if (f->nblocks > loop_cap) {
+        loop_cap = f->nblocks;
+        loop_of = xrealloc(loop_of, loop_cap * sizeof(int));
+        work = xrealloc(work, loop_cap * sizeof(int));
+        body = xrealloc(body, loop_cap * sizeof(int));
+        loops = xrealloc(loops, loop_cap * sizeof(Loop));
+    }
+    index_defs(f);
+
+    int nloops = 0;
+    for (int i = 0; i < f->nblocks; i++)
+        loop_of[i] = -1;
+    for (int i = 0; i < f->nrpo; i++) {
+        int h = f->rpo[i];
+        IrBlock *hb = &f->blocks[h];
+        for (int p = 0; p < hb->npreds; p++) {
+            int q = hb->preds[p];
+            if (f->blocks[q].order >= 0 && ir_dominates(f, h, q)) {
+                loops[nloops].header = h;
+                loops[nloops].size = mark_loop(f, h);
+                nloops++;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < f->nblocks; i++)
+        loop_of[i] = -1;
+
+    qsort(loops, nloops, sizeof(Loop), loop_size_cmp);
+    for (int i = 0; i < nloops; i++)
+        hoist_loop(f, loops[i].header);
+}
+
+
+/* ---- Dead code elimination ---- */
+
+static void pass_dce(IrFunc *f) {
+    static _Thread_local unsigned char *live = NULL;
+    static _Thread_local IrInst **def = NULL;
+    static _Thread_local int *stack = NULL;
+    static _Thread_local int cap = 0;
+
+    if (f->nvals > cap) {
+        cap = f->nvals * 2;
+        live = xrealloc(live, cap);
+        def = xrealloc(def, cap * sizeof(IrInst *));
+        stack = xrealloc(stack, cap * sizeof(int));
+    }
+    memset(live, 0, f->nvals);
+    memset(def, 0, f->nvals * sizeof(IrInst *));
+    index_defs(f);
+
+    int sp = 0;
+    for (int i = 0; i < f->nrpo; i++) {
+        IrBlock *bb = &f->blocks[f->rpo[i]];
+        for (int p = 0; p < bb->nphis; p++)
+            if (bb->phis[p].op == IR_PHI)
+                def[bb->phis[p].dst] = &bb->phis[p];
+
+        for (int k = 0; k < bb->len; k++) {
+            IrInst *in = &bb->insts[k];
+            if (in->dst)
+                def[in->dst] = in;
+            if (in->op == IR_NOP || ir_is_removable(in)) continue;
+
+            // Prints, branches and divisions that may trap are the roots
+            if (in->a.kind == ARG_VAL && !live[in->a.val]) {
+                live[in->a.val] = 1;
+                stack[sp++] = in->a.val;
+            }
+        }
+    }
+
+    while (sp) {
+        int v = stack[--sp];
+        IrInst *in = def[v];
+        if (!in) continue;
+
+        if (in->op == IR_PHI) {
+            int b = def_block[v];
+            for (int k = 0; k < f->blocks[b].npreds; k++) {
+                IrArg a = in->phi[k];
+                if (a.kind == ARG_VAL && !live[a.val]) {
+                    live[a.val] = 1;
+                    stack[sp++] = a.val;
+                }
+            }
+            continue;
+        }
+        if (in->a.kind == ARG_VAL && !live[in->a.val]) {
+            live[in->a.val] = 1;
+            stack[sp++] = in->a.val;
+        }
+        if (in->b.kind == ARG_VAL && !live[in->b.val]) {
+            live[in->b.val] = 1;
+            stack[sp++] = in->b.val;
+        }
+    }
+
+    for (int i = 0; i < f->nrpo; i++) {
+        IrBlock *bb = &f->blocks[f->rpo[i]];
+        for (int p = 0; p < bb->nphis; p++)
+            if (!live[bb->phis[p].dst])
+                bb->phis[p].op = IR_NOP;
+        for (int k = 0; k < bb->len; k++)
+            if (ir_is_removable(&bb->insts[k]) && !live[bb->insts[k].dst])
+                bb->insts[k].op = IR_NOP;
+    }
+}
+
+
+/* ---- Pass manager ---- */
+
+typedef struct Pass {
+    const char *name;
+    void (*run)(IrFunc *f);
+} Pass;
+
+static const Pass passes[] = {
+    { "constprop", pass_constprop },
+    { "copyprop",  pass_copyprop },
+    { "cse",       pass_cse },
+    { "licm",      pass_licm },
+    { "dce",       pass_dce },
+};
+
+#define NUM_PASSES (int)(sizeof(passes) / sizeof(passes[0]))
+#define MAX_PIPELINE 32
+
+// Set up front; the times are counted per thread
+static _Thread_local double pass_seconds[NUM_PASSES];
+static _Thread_local unsigned pass_runs[NUM_PASSES];
+
+static int pipeline[MAX_PIPELINE] = { 0, 1, 2, 3, 1, 4 };
+static int pipeline_len = 6;
+
+
+int ir_set_passes(const char *list) {
+    int order[MAX_PIPELINE];
+    int n = 0;
+
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        int found = -1;
+        for (int p = 0; p < NUM_PASSES; p++)
+            if (strlen(passes[p].name) == len &&
+                strncmp(list, passes[p].name, len) == 0)
+                found = p;
+
+        if (len == 0) {
+            // Empty entries, as in "--passes=", are skipped
+        } else if (found < 0 || n == MAX_PIPELINE) {
+            return 0;
+        } else {
+            order[n++] = found;
+        }
+        list += len;
+        if (*list == ',')
+            list++;
+    }
+
+    memcpy(pipeline, order, n * sizeof(int));
+    pipeline_len = n;
+    return 1;
+}
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void ir_optimize(IrFunc *f) {
+    for (int i = 0; i < pipeline_len; i++) {
+        int p = pipeline[i];
+        double start = now();
+        passes[p].run(f);
+        pass_seconds[p] += now() - start;
+        pass_runs[p]++;
+    }
+}
+
+
+void ir_report_times(FILE *out) {
+    double total = 0;
+    for (int p = 0; p < NUM_PASSES; p++)
+        total += pass_seconds[p];
+
+    fprintf(out, "Pass times: %.3f ms\n", total * 1e3);
+    for (int p = 0; p < NUM_PASSES; p++)
+        fprintf(out, "  %-10s %4u runs %10.3f ms\n", passes[p].name,
+                pass_runs[p], pass_seconds[p] * 1e3);
+}
@@ -0,0 +1,518 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+
+/*
+ * In-process execution: the instruction list selected for x86-64 is
+ * encoded straight into machine code, copied to a fresh mapping that is
+ * then made executable, and called. Nothing is written to disk and no
+ * assembler, linker or process is involved.
+ *
+ * Spill slots live in a heap array addressed off RBP, strings are
+ * length-prefixed blocks whose addresses are loaded with movabs. The
+ * three runtime procedures are trampolines into C: they save every
+ * register the generated code expects to survive a call, align the
+ * stack and pass the output stream and AX to a helper.
+ *
+ * Every divide first tests its divisor. Zero jumps to a fourth stub that
+ * puts back the stack pointer saved on entry and returns 1 through the
+ * epilogue, and jit_run reports the error the way the VM does.
+ *
+ * Jumps always take the rel32 form, so one pass plus fixups is enough.
+ */
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+// Hardware register numbers
+enum {
+    X_AX, X_CX, X_DX, X_BX, X_SP, X_BP, X_SI, X_DI,
+    X_R8, X_R9, X_R10, X_R11
+};
+
+static const unsigned char hw[NUM_REGS] = {
+    X_AX, X_BX, X_CX, X_DX, X_SI, X_DI, 0xFF,
+    8, 9, 10, 11, 12, 13, 14, 15
+};
+
+#if defined(_WIN32)
+enum { X_ARG0 = X_CX, X_ARG1 = X_DX };
+#else
+enum { X_ARG0 = X_DI, X_ARG1 = X_SI };
+#endif
+
+typedef struct Fixup {
+    int at;             // offset of the rel32 field
+    int key;            // label_key, or -1 - Proc
+} Fixup;
+
+static _Thread_local OutBuf bin;
+static _Thread_local OutBuf data;
+
+static _Thread_local int *label_pos = NULL;
+static _Thread_local int label_cap = 0;
+static _Thread_local Fixup *fixups = NULL;
+static _Thread_local int nfixups = 0;
+static _Thread_local int fixups_cap = 0;
+static _Thread_local int64_t *str_off = NULL;
+static _Thread_local int str_cap = 0;
+
+
+static void byte(int b) {
+    ob_putc(&bin, (char)b);
+}
+
+static void dword(int32_t v) {
+    ob_write(&bin, (const char *)&v, 4);
+}
+
+static void qword(int64_t v) {
+    ob_write(&bin, (const char *)&v, 8);
+}
+
+
+static int is_rm(const Operand *o) {
+    return (o->kind == O_REG && o->val != AH) || o->kind == O_TMP;
+}
+
+/*
+ * REX prefix, opcode (one byte, or 0x0F and a second) and ModRM for
+ * register field r and r/m operand o. A spill slot is [rbp + 8n].
+ */
+static void insn_rm(int w, int r, const Operand *o, unsigned opc) {
+    int b = o->kind == O_REG ? hw[o->val] : X_BP;
+    int rex = 0x40 | w << 3 | (r >> 3) << 2 | b >> 3;
+    if (rex != 0x40)
+        byte(rex);
+    if (opc > 0xFF)
+        byte(opc >> 8);
+    byte(opc & 0xFF);
+
+    if (o->kind == O_REG) {
+        byte(0xC0 | (r & 7) << 3 | (b & 7));
+    } else if (o->val < 16) {
+        byte(0x45 | (r & 7) << 3);
+        byte(o->val * 8);
+    } else {
+        byte(0x85 | (r & 7) << 3);
+        dword(o->val * 8);
+    }
+}
+
+static void movabs(int r, int64_t v) {
+    byte(0x48 | r >> 3);
+    byte(0xB8 | (r & 7));
+    qword(v);
+}
+
+static void push_hw(int r) {
+    if (r >= 8)
+        byte(0x41);
+    byte(0x50 | (r & 7));
+}
+
+static void pop_hw(int r) {
+    if (r >= 8)
+        byte(0x41);
+    byte(0x58 | (r & 7));
+}
+
+static void rel32(int key) {
+    if (nfixups == fixups_cap) {
+        fixups_cap = fixups_cap ? fixups_cap * 2 : 256;
+        fixups = xrealloc(fixups, fixups_cap * sizeof(Fixup));
+    }
+    fixups[nfixups].at = (int)bin.len;
+    fixups[nfixups].key = key;
+    nfixups++;
+    dword(0);
+}
+
+
+// The stub a zero divisor jumps to, numbered after the Procs
+#define DIV_ERROR 3
+#define NUM_STUBS 4
+
+
+/* Group-1 arithmetic: /digit for an immediate, then the r/m,r and r,r/m opcodes */
+static int alu(int op, const Operand *d, const Operand *s) {
+    static const unsigned char digit[] = { 0, 5, 7, 6 };
+    static const unsigned char to_rm[] = { 0x01, 0x29, 0x39, 0x31 };
+    static const unsigned char to_reg[] = { 0x03, 0x2B, 0x3B, 0x33 };
+    int k = op == I_ADD ? 0 : op == I_SUB ? 1 : op == I_CMP ? 2 : 3;
+
+    if (!is_rm(d)) return 0;
+    if (s->kind == O_IMM) {
+        if (s->val >= -128 && s->val <= 127) {
+            insn_rm(1, digit[k], d, 0x83);
+            byte(s->val);
+        } else {
+            insn_rm(1, digit[k], d, 0x81);
+            dword(s->val);
+        }
+    } else if (d->kind == O_REG && is_rm(s)) {
+        insn_rm(1, hw[d->val], s, to_reg[k]);
+    } else if (s->kind == O_REG && s->val != AH) {
+        insn_rm(1, hw[s->val], d, to_rm[k]);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Returns 0 for an instruction outside the x86-64 subset
+static int encode(const Insn *in) {
+    const Operand *d = &in->dst, *s = &in->src;
+
+    switch (in->op) {
+        case I_NOP:
+            return 1;
+
+        case I_LABEL:
+            label_pos[label_key(d)] = (int)bin.len;
+            return 1;
+
+        case I_MOV:
+            if (s->kind == O_STR) {
+                int r = d->kind == O_REG ? hw[d->val] : X_R11;
+                movabs(r, (int64_t)(intptr_t)(data.data + str_off[s->val]));
+                if (d->kind == O_TMP)
+                    insn_rm(1, X_R11, d, 0x89);
+            } else if (s->kind == O_IMM && is_rm(d)) {
+                insn_rm(1, 0, d, 0xC7);
+                dword(s->val);
+            } else if (d->kind == O_REG && is_rm(s)) {
+                insn_rm(1, hw[d->val], s, 0x8B);
+            } else if (d->kind == O_TMP && s->kind == O_REG) {
+                insn_rm(1, hw[s->val], d, 0x89);
+            } else {
+                return 0;
+            }
+            return 1;
+
+        case I_ADD:
+        case I_SUB:
+        case I_CMP:
+        case I_XOR:
+            return alu(in->op, d, s);
+
+        case I_SHL:
+        case I_SHR:
+            if (!is_rm(d) || s->kind != O_IMM) return 0;
+            insn_rm(1, in->op == I_SHL ? 4 : 5, d, 0xC1);
+            byte(s->val);
+            return 1;
+
+        case I_IMUL:
+            if (d->kind != O_REG) return 0;
+            if (s->kind == O_IMM) {
+                insn_rm(1, hw[d->val], d, 0x69);
+                dword(s->val);
+            } else if (is_rm(s)) {
+                insn_rm(1, hw[d->val], s, 0x0FAF);
+            } else {
+                return 0;
+            }
+            return 1;
+
+        case I_DIV:
+            if (!is_rm(d)) return 0;
+            insn_rm(1, 7, d, 0x83);                     // cmp d, 0
+            byte(0);
+            byte(0x0F);                                 // je div_error
+            byte(0x84);
+            rel32(-1 - DIV_ERROR);
+            insn_rm(1, 6, d, 0xF7);
+            return 1;
+
+        case I_MOVSX:
+        case I_MOVZX:
+            if (d->kind != O_REG || !is_rm(s)) return 0;
+            insn_rm(in->op == I_MOVSX, hw[d->val], s,
+                    in->op == I_MOVSX ? 0x0FBF : 0x0FB7);
+            return 1;
+
+        case I_INC:
+            if (!is_rm(d)) return 0;
+            insn_rm(1, 0, d, 0xFF);
+            return 1;
+
+        case I_PUSH:
+            if (d->kind == O_REG && d->val != AH) {
+                push_hw(hw[d->val]);
+            } else if (d->kind == O_TMP) {
+                insn_rm(0, 6, d, 0xFF);
+            } else if (d->kind == O_IMM) {
+                byte(0x68);
+                dword(d->val);
+            } else {
+                return 0;
+            }
+            return 1;
+
+        case I_POP:
+            if (d->kind == O_REG && d->val != AH)
+                pop_hw(hw[d->val]);
+            else if (d->kind == O_TMP)
+                insn_rm(0, 0, d, 0x8F);
+            else
+                return 0;
+            return 1;
+
+        case I_CALL:
+            byte(0xE8);
+            rel32(-1 - d->val);
+            return 1;
+
+        case I_JMP:
+            byte(0xE9);
+            rel32(label_key(d));
+            return 1;
+
+        case I_JE: case I_JNE: case I_JG:
+        case I_JGE: case I_JL: case I_JLE: {
+            static const unsigned char cc[] = { 0x84, 0x85, 0x8F, 0x8D, 0x8C, 0x8E };
+            byte(0x0F);
+            byte(cc[in->op - I_JE]);
+            rel32(label_key(d));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* ---- Runtime, called through the trampolines ---- */
+
+static void rt_print_int(FILE *out, int64_t v) {
+    fprintf(out, "%u", (unsigned)(v & 0xFFFF));
+}
+
+static void rt_print_str(FILE *out, const int64_t *s) {
+    fwrite(s + 1, 1, (size_t)s[0], out);
+}
+
+static int64_t rt_pow(int64_t base, int64_t exp) {
+    int r;
+    ir_fold(IR_POW, (int)base, (int)exp, &r);
+    return r;
+}
+
+
+// Caller-saved registers, restored in reverse order
+static const unsigned char saved[] = { X_CX, X_DX, X_SI, X_DI, X_R8, X_R9, X_R10 };
+#define NSAVED ((int)(sizeof(saved) / sizeof(saved[0])))
+
+/*
+ * Saves the registers a call may clobber, keeps the old stack pointer
+ * above a 16-byte aligned frame with shadow space for Win64, and calls
+ * fn(ARG0, ARG1). pow_int takes its arguments from the stack, base
+ * first, and pops them on return.
+ */
+static void trampoline(Proc p, void *fn, FILE *out) {
+    for (int i = 0; i < NSAVED; i++)
+        push_hw(saved[i]);
+
+    if (p == PROC_POW_INT) {
+        // mov arg0, [rsp + 8*(NSAVED+2)]; mov arg1, [rsp + 8*(NSAVED+1)]
+        byte(0x48 | (X_ARG0 >> 3) << 2);
+        byte(0x8B);
+        byte(0x44 | (X_ARG0 & 7) << 3);
+        byte(0x24);
+        byte(8 * (NSAVED + 2));
+        byte(0x48 | (X_ARG1 >> 3) << 2);
+        byte(0x8B);
+        byte(0x44 | (X_ARG1 & 7) << 3);
+        byte(0x24);
+        byte(8 * (NSAVED + 1));
+    } else {
+        static const Operand ax = { O_REG, 0, AX };
+        movabs(X_ARG0, (int64_t)(intptr_t)out);
+        insn_rm(1, X_ARG1, &ax, 0x8B);
+    }
+
+    byte(0x49); byte(0x89); byte(0xE3);                 // mov r11, rsp
+    byte(0x48); byte(0x83); byte(0xE4); byte(0xF0);     // and rsp, -16
+    push_hw(X_R11);
+    push_hw(X_R11);
+    byte(0x48); byte(0x83); byte(0xEC); byte(0x20);     // sub rsp, 32
+    movabs(X_AX, (int64_t)(intptr_t)fn);
+    byte(0xFF); byte(0xD0);                             // call rax
+    byte(0x48); byte(0x8B); byte(0x64); byte(0x24); byte(0x20);  // mov rsp, [rsp + 32]
+
+    for (int i = NSAVED - 1; i >= 0; i--)
+        pop_hw(saved[i]);
+    if (p == PROC_POW_INT) {
+        byte(0xC2); byte(0x10); byte(0x00);             // ret 16
+    } else {
+        byte(0xC3);
+    }
+}
+
+
+// Callee-saved registers of both ABIs that the generated code may use
+static const unsigned char kept[] = {
+    X_BX, X_BP, X_SI, X_DI, 12, 13, 14, 15
+};
+#define NKEPT ((int)(sizeof(kept) / sizeof(kept[0])))
+
+
+static void *map_code(const char *p, size_t n) {
+#if defined(_WIN32)
+    DWORD old;
+    void *m = VirtualAlloc(NULL, n, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!m) return NULL;
+    memcpy(m, p, n);
+    if (!VirtualProtect(m, n, PAGE_EXECUTE_READ, &old)) {
+        VirtualFree(m, 0, MEM_RELEASE);
+        return NULL;
+    }
+    FlushInstructionCache(GetCurrentProcess(), m, n);
+    return m;
+#else
+    void *m = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) return NULL;
+    memcpy(m, p, n);
+    if (mprotect(m, n, PROT_READ | PROT_EXEC) != 0) {
+        munmap(m, n);
+        return NULL;
+    }
+    return m;
+#endif
+}
+
+static void unmap_code(void *m, size_t n) {
+#if defined(_WIN32)
+    (void)n;
+    VirtualFree(m, 0, MEM_RELEASE);
+#else
+    munmap(m, n);
+#endif
+}
+
+
+int jit_run(const InsnList *code, const Atom *strings, int nstrings,
+            int spills, FILE *out) {
+    // Strings first, so the code can embed their final addresses
+    ob_reset(&data);
+    if (nstrings > str_cap) {
+        str_cap = nstrings * 2;
+        str_off = xrealloc(str_off, str_cap * sizeof(int64_t));
+    }
+    for (int i = 0; i < nstrings; i++) {
+        int64_t n = atom_len(strings[i]);
+        static const char pad[8];
+        str_off[i] = (int64_t)data.len;
+        ob_write(&data, (const char *)&n, 8);
+        ob_write(&data, atom_str(strings[i]), (size_t)n);
+        ob_write(&data, pad, (size_t)(-n & 7));
+    }
+    if (!data.data)
+        ob_reserve(&data, 8);
+
+    int nkeys = 0;
+    for (int i = 0; i < code->len; i++) {
+        const Insn *in = &code->items[i];
+        if (in->op == I_LABEL || insn_is_jump(in->op))
+            if (label_key(&in->dst) >= nkeys)
+                nkeys = label_key(&in->dst) + 1;
+    }
+    if (nkeys > label_cap) {
+        label_cap = nkeys * 2;
+        label_pos = xrealloc(label_pos, label_cap * sizeof(int));
+    }
+    memset(label_pos, -1, nkeys * sizeof(int));
+
+    ob_reset(&bin);
+    nfixups = 0;
+
+    // One slot past the spills keeps the stack pointer for div_error
+    const Operand sp_slot = { O_TMP, 0, spills };
+    int64_t *slots = calloc(spills + 1, sizeof(int64_t));
+    if (!slots) {
+        fprintf(stderr, "Fatal error: out of memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < NKEPT; i++)
+        push_hw(kept[i]);
+    movabs(X_BP, (int64_t)(intptr_t)slots);
+    insn_rm(1, X_SP, &sp_slot, 0x89);                   // mov [slot], rsp
+
+    for (int i = 0; i < code->len; i++) {
+        if (!encode(&code->items[i])) {
+            free(slots);
+            return -1;
+        }
+    }
+
+    byte(0x31); byte(0xC0);                             // xor eax, eax
+    int epilogue = (int)bin.len;
+    for (int i = NKEPT - 1; i >= 0; i--)
+        pop_hw(kept[i]);
+    byte(0xC3);
+
+    int proc_pos[NUM_STUBS];
+    void *fns[3] = {
+        (void *)rt_print_int, (void *)rt_pow, (void *)rt_print_str
+    };
+    for (int p = 0; p < 3; p++) {
+        proc_pos[p] = (int)bin.len;
+        trampoline((Proc)p, fns[p], out);
+    }
+
+    proc_pos[DIV_ERROR] = (int)bin.len;
+    insn_rm(1, X_SP, &sp_slot, 0x8B);                   // mov rsp, [slot]
+    byte(0xB8);                                         // mov eax, 1
+    dword(1);
+    byte(0xE9);                                         // jmp epilogue
+    dword(epilogue - ((int)bin.len + 4));
+
+    for (int i = 0; i < nfixups; i++) {
+        int key = fixups[i].key;
+        int to = key < 0 ? proc_pos[-1 - key] : label_pos[key];
+        if (to < 0) {
+            free(slots);
+            return -1;
+        }
+        int32_t rel = to - (fixups[i].at + 4);
+        memcpy(bin.data + fixups[i].at, &rel, 4);
+    }
+
+    void *m = map_code(bin.data, bin.len);
+    if (!m) {
+        free(slots);
+        return -1;
+    }
+
+    STAT_ADD(bytes, bin.len);
+    STAT_PHASE(PHASE_RUN);
+    int (*entry)(void);
+    memcpy(&entry, &m, sizeof(entry));
+    int rc = entry();
+    fflush(out);
+    if (rc)
+        fprintf(stderr, "Runtime error: division by zero\n");
+
+    unmap_code(m, bin.len);
+    free(slots);
+    return rc;
+}
+
+#else
+
+int jit_run(const InsnList *code, const Atom *strings, int nstrings,
+            int spills, FILE *out) {
+    (void)code; (void)strings; (void)nstrings; (void)spills; (void)out;
+    return -1;
+}
+
+#endif
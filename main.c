@@ -1,33 +1,362 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "ast.h"
 
-#include "parser.tab.h"
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
 
-extern ASTNode *root;
 
+static void read_all(FILE *f, OutBuf *ob) {
+    size_t n;
+    do {
+        ob_reserve(ob, 64 * 1024);
+        n = fread(ob->data + ob->len, 1, ob->cap - ob->len, f);
+        ob->len += n;
+    } while (n > 0);
+}
 
-int main(void) {
-    if (yyparse() != 0) {
-        fprintf(stderr, "Parsing failed\n");
-        return 1;
+
+// Reads exactly n bytes; 0 if the input ends first
+static int read_exact(FILE *f, OutBuf *ob, size_t n) {
+    ob_reserve(ob, n);
+    if (fread(ob->data + ob->len, 1, n, f) != n) return 0;
+    ob->len += n;
+    return 1;
+}
+
+
+/*
+ * --serve: compile requests from stdin until it closes. A request is
+ *
+ *   <asm|run|interpret> <8086|x86-64> <length> [<session>]\n<source>
+ *
+ * and the reply on stdout is
+ *
+ *   <status> <output length> <message length>\n<output><messages>
+ *
+ * where the output is the assembly, or what the program printed in the
+ * run modes. Anything else the compiler writes goes to stderr.
+ *
+ * Requests naming a session are compiled incrementally against the
+ * previous source of that session (see incr.c). The least recently used
+ * of MAX_SESSIONS sessions is dropped to make room for a new one.
+ * Sessions hold atoms from one request to the next; while there are
+ * none, the atom table is dropped before each request so a long-lived
+ * worker does not keep every name it has seen.
+ */
+#define MAX_SESSIONS 16
+
+typedef struct Session {
+    char id[64];            // "" = free
+    unsigned long used;     // request number of the last use
+    IncrSession incr;
+} Session;
+
+static Session sessions[MAX_SESSIONS];
+
+static int any_session(void) {
+    for (int i = 0; i < MAX_SESSIONS; i++)
+        if (sessions[i].id[0])
+            return 1;
+    return 0;
+}
+
+static IncrSession *find_session(const char *id, unsigned long request) {
+    Session *s = &sessions[0];
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (strcmp(sessions[i].id, id) == 0) {
+            s = &sessions[i];
+            s->used = request;
+            return &s->incr;
+        }
+        if (sessions[i].used < s->used)
+            s = &sessions[i];
     }
-    
-    printf("Lexical analysis successful\n");
-    printf("Tokens created\n");
-    printf("Syntax analysis successful\n");
-    printf("Parse tree created\n");
 
-    semantic_check(root);
-    if (semantic_errors > 0) {
-        fprintf(stderr, "Compilation failed due to semantic errors\n");
-        free_ast(root);
+    if (s->id[0])
+        incr_free(&s->incr);
+    incr_init(&s->incr);
+    snprintf(s->id, sizeof(s->id), "%s", id);
+    s->used = request;
+    return &s->incr;
+}
+
+static int serve(CompilerContext *ctx, CompileOptions opt) {
+    fflush(stdout);
+    FILE *proto = fdopen(dup(1), "wb");
+    dup2(2, 1);
+    if (!proto) {
+        fprintf(stderr, "Cannot write to stdout\n");
         return 1;
     }
+#if defined(_WIN32)
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+    OutBuf src, out, msgs;
+    ob_init(&src);
+    ob_init(&out);
+    ob_init(&msgs);
+
+    char line[128], mode[16], target[16], id[64];
+    unsigned long len, request = 0;
+    while (fgets(line, sizeof(line), stdin)) {
+        int fields = sscanf(line, "%15s %15s %lu %63s", mode, target, &len, id);
+        if (fields < 3) {
+            fprintf(stderr, "Bad request: %s", line);
+            break;
+        }
+        request++;
+
+        ob_reset(&src);
+        ob_reset(&out);
+        ob_reset(&msgs);
+        if (!read_exact(stdin, &src, len)) break;
+
+        if (strcmp(mode, "run") == 0)
+            opt.mode = MODE_RUN;
+        else if (strcmp(mode, "interpret") == 0)
+            opt.mode = MODE_INTERPRET;
+        else
+            opt.mode = MODE_ASM;
+        opt.target = strcmp(target, "x86-64") == 0 ? TARGET_X64 : TARGET_8086;
+        if (!any_session())
+            intern_free();
+
+        // Program output is collected in a file and sent back as the output
+        opt.run_out = opt.mode == MODE_ASM ? NULL : tmpfile();
+        if (opt.mode != MODE_ASM && !opt.run_out) {
+            fprintf(stderr, "Cannot create a temporary file\n");
+            break;
+        }
 
-    generate_code(root, "output.asm");
-    printf("Code generated: output.asm\n");
+        int rc = fields == 4
+            ? compile_incremental(ctx, find_session(id, request), src.data, src.len, &opt, &out, &msgs)
+            : compile_program(ctx, src.data, src.len, &opt, &out, &msgs);
+        if (opt.run_out) {
+            rewind(opt.run_out);
+            read_all(opt.run_out, &out);
+            fclose(opt.run_out);
+        }
 
+        fprintf(proto, "%d %lu %lu\n", rc,
+            (unsigned long)out.len, (unsigned long)msgs.len);
+        ob_fwrite(&out, proto);
+        ob_fwrite(&msgs, proto);
+        fflush(proto);
+    }
 
-    free_ast(root);
+    for (int i = 0; i < MAX_SESSIONS; i++)
+        if (sessions[i].id[0])
+            incr_free(&sessions[i].incr);
+    intern_free();
+    fclose(proto);
+    ob_free(&src);
+    ob_free(&out);
+    ob_free(&msgs);
     return 0;
 }
+
+
+static void usage(void) {
+    fprintf(stderr, "Usage: nova.exe [-o <file.asm> | -o -] [options] <program.no | < program.no>\n");
+    fprintf(stderr, "       nova.exe --batch [-j <n>] [-o <dir>] [options] <file.no | dir>...\n");
+    fprintf(stderr, "  --target=<8086|x86-64>  16-bit DOS code (default) or 64-bit Linux code\n");
+    fprintf(stderr, "  --run                   compile to memory and run, output on stdout\n");
+    fprintf(stderr, "  --interpret             run with the bytecode interpreter instead\n");
+    fprintf(stderr, "  --no-peephole[=<rule>]  disable all peephole rules or one of them\n");
+    fprintf(stderr, "  --peephole-stats        report how often each rule fired\n");
+    fprintf(stderr, "  --passes=<list>         IR passes to run, comma separated\n");
+    fprintf(stderr, "  --dump-ir               print the IR after optimization\n");
+    fprintf(stderr, "  --time-passes           report the time spent in each IR pass\n");
+    fprintf(stderr, "  --stats[=json]          report time per phase and counts of the work done\n");
+    fprintf(stderr, "  --cache=<dir>           reuse checked trees stored in dir\n");
+    fprintf(stderr, "  --lexer=<fast|flex>     hand-written vector scanner (default) or flex\n");
+    fprintf(stderr, "  --parser=<fast|bison>   token array and recursive descent (default) or bison\n");
+    fprintf(stderr, "  --serve                 compile requests from stdin, see main.c\n");
+    fprintf(stderr, "  --batch                 compile the files given, each to its own output\n");
+    fprintf(stderr, "  -j <n>, --jobs=<n>      threads for --batch (default: one per core)\n");
+}
+
+
+int main(int argc, char **argv) {
+    const char *outfile = NULL;
+    FILE *asm_out = NULL;
+    CompilerContext ctx;
+    CompileOptions opt;
+    int peep_stats = 0;
+    int time_passes = 0;
+    int stats = 0;          // 1: table, 2: JSON
+    int serving = 0;
+    int batch = 0;
+    int jobs = 0;
+    char **inputs = malloc(argc * sizeof(char *));
+    int ninputs = 0;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.target = TARGET_8086;
+    opt.mode = MODE_ASM;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outfile = argv[++i];
+        } else if (strcmp(argv[i], "--target=8086") == 0) {
+            opt.target = TARGET_8086;
+        } else if (strcmp(argv[i], "--target=x86-64") == 0) {
+            opt.target = TARGET_X64;
+        } else if (strcmp(argv[i], "--run") == 0) {
+            opt.mode = MODE_RUN;
+        } else if (strcmp(argv[i], "--interpret") == 0) {
+            opt.mode = MODE_INTERPRET;
+        } else if (strcmp(argv[i], "--no-peephole") == 0) {
+            peephole_set_rule("all", 0);
+        } else if (strncmp(argv[i], "--no-peephole=", 14) == 0) {
+            if (!peephole_set_rule(argv[i] + 14, 0)) {
+                fprintf(stderr, "Unknown peephole rule: %s\n", argv[i] + 14);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--peephole-stats") == 0) {
+            peep_stats = 1;
+        } else if (strncmp(argv[i], "--passes=", 9) == 0) {
+            if (!ir_set_passes(argv[i] + 9)) {
+                fprintf(stderr, "Unknown pass in: %s\n", argv[i] + 9);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--dump-ir") == 0) {
+            opt.dump_ir = stdout;
+        } else if (strcmp(argv[i], "--time-passes") == 0) {
+            time_passes = 1;
+        } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=json") == 0) {
+#if defined(NOVA_STATS)
+            stats = argv[i][7] ? 2 : 1;
+#else
+            fprintf(stderr, "--stats needs a build with -DNOVA_STATS\n");
+            return 1;
+#endif
+        } else if (strncmp(argv[i], "--cache=", 8) == 0 && argv[i][8]) {
+            opt.cache_dir = argv[i] + 8;
+        } else if (strcmp(argv[i], "--lexer=fast") == 0) {
+            opt.lexer = LEX_FAST;
+        } else if (strcmp(argv[i], "--lexer=flex") == 0) {
+            opt.lexer = LEX_FLEX;
+        } else if (strcmp(argv[i], "--parser=fast") == 0) {
+            opt.parser = PARSER_FAST;
+        } else if (strcmp(argv[i], "--parser=bison") == 0) {
+            opt.parser = PARSER_BISON;
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            serving = 1;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = atoi(argv[i] + 7);
+        } else if (argv[i][0] != '-' && inputs) {
+            inputs[ninputs++] = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!batch && (ninputs > 1 || (ninputs > 0 && serving))) {
+        usage();
+        return 1;
+    }
+    if (stats && (batch || serving)) {
+        fprintf(stderr, "--stats reports on a single program\n");
+        return 1;
+    }
+    if (batch) {
+        if (opt.mode != MODE_ASM || opt.dump_ir) {
+            fprintf(stderr, "--batch only writes assembly\n");
+            return 1;
+        }
+        int rc = run_batch(&opt, inputs, ninputs, outfile, jobs > 0 ? jobs : batch_default_jobs());
+        free(inputs);
+        return rc;
+    }
+    const char *path = ninputs > 0 ? inputs[0] : NULL;
+    free(inputs);
+
+    compiler_init(&ctx);
+    if (serving) {
+        int rc = serve(&ctx, opt);
+        compiler_free(&ctx);
+        return rc;
+    }
+
+    if (!outfile)
+        outfile = opt.target == TARGET_X64 ? "output.s" : "output.asm";
+
+    // With "-o -" stdout carries only the assembly and when running only
+    // the program's output, status goes to stderr
+    if (opt.mode != MODE_ASM || strcmp(outfile, "-") == 0) {
+        fflush(stdout);
+        asm_out = fdopen(dup(1), "wb");
+        dup2(2, 1);
+        if (!asm_out) {
+            fprintf(stderr, "Cannot write to stdout\n");
+            return 1;
+        }
+    }
+    opt.run_out = asm_out;
+
+    OutBuf src, asm_buf;
+    ob_init(&src);
+    ob_init(&asm_buf);
+
+    // A file named on the command line is mapped; pipes and empty files are read
+    size_t size = 0;
+    const char *map = path ? map_file(path, &size) : NULL;
+    if (!map) {
+        FILE *in = path ? fopen(path, "rb") : stdin;
+        if (!in) {
+            fprintf(stderr, "Cannot read %s\n", path);
+            return 1;
+        }
+        read_all(in, &src);
+        if (in != stdin)
+            fclose(in);
+    }
+
+#if defined(NOVA_STATS)
+    stats_reset();
+#endif
+    int rc = map
+        ? compile_program(&ctx, map, size, &opt, &asm_buf, NULL)
+        : compile_program(&ctx, src.data, src.len, &opt, &asm_buf, NULL);
+    if (map)
+        unmap_file((void *)map, size);
+    ob_free(&src);
+
+    if (rc == 0 && opt.mode == MODE_ASM) {
+        if (asm_out ? ob_fwrite(&asm_buf, asm_out) : ob_save(&asm_buf, outfile)) {
+            fprintf(stderr, "Cannot write %s\n", outfile);
+            rc = 1;
+        } else {
+            printf("Code generated: %s\n", asm_out ? "<stdout>" : outfile);
+        }
+    }
+    if (asm_out)
+        fclose(asm_out);
+
+    if (rc == 0 && opt.mode != MODE_INTERPRET) {
+        if (peep_stats)
+            peephole_report(stdout);
+        if (time_passes)
+            ir_report_times(stdout);
+    }
+#if defined(NOVA_STATS)
+    if (stats)
+        stats_report(stdout, stats == 2);
+#endif
+
+    ob_free(&asm_buf);
+    compiler_free(&ctx);
+    return rc;
+}
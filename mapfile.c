@@ -0,0 +1,61 @@
+#include "ast.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+/*
+ * Read-only file mappings, shared by the tree cache and the compiler
+ * inputs. Empty files are never mapped: map_file returns NULL for them
+ * as for files that cannot be opened, and callers read those instead.
+ */
+
+void *map_file(const char *path, size_t *size) {
+#if defined(_WIN32)
+    HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f == INVALID_HANDLE_VALUE) return NULL;
+
+    LARGE_INTEGER n;
+    void *p = NULL;
+    if (GetFileSizeEx(f, &n) && n.QuadPart > 0) {
+        HANDLE m = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m) {
+            p = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(m);
+        }
+        *size = (size_t)n.QuadPart;
+    }
+    CloseHandle(f);
+    return p;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    void *p = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+            p = NULL;
+        *size = st.st_size;
+    }
+    close(fd);
+    return p;
+#endif
+}
+
+void unmap_file(void *p, size_t size) {
+#if defined(_WIN32)
+    (void)size;
+    UnmapViewOfFile(p);
+#else
+    munmap(p, size);
+#endif
+}
@@ -0,0 +1,345 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Constant folding and propagation, run between semantic_check and
+ * generate_code.
+ *
+ * Every variable lives in one global slot in the generated code, so the
+ * environment is flat and keyed by atom regardless of scope. Changes go
+ * through an undo log: branches and loop bodies are processed and then
+ * rolled back, and whatever they assigned is forgotten afterwards.
+ *
+ * Values follow the 8086 code: 16-bit wrap-around and signed compares.
+ * Folded nodes are rewritten in place; subtrees that become unreachable
+ * are reclaimed with the rest of the tree by ast_reset().
+ */
+
+typedef struct Change {
+    Atom name;
+    int known;
+    int value;
+} Change;
+
+static _Thread_local unsigned char *known = NULL;     // indexed by atom
+static _Thread_local int *value = NULL;
+static _Thread_local int env_cap = 0;
+
+static _Thread_local Change *undo = NULL;
+static _Thread_local unsigned undo_len = 0;
+static _Thread_local unsigned undo_cap = 0;
+
+static _Thread_local Atom *killed = NULL;             // scratch for assigned atoms
+static _Thread_local unsigned killed_len = 0;
+static _Thread_local unsigned killed_cap = 0;
+
+
+static void env_set(Atom a, int is_known, int v) {
+    if (undo_len == undo_cap) {
+        undo_cap = undo_cap ? undo_cap * 2 : 256;
+        undo = xrealloc(undo, undo_cap * sizeof(Change));
+    }
+    undo[undo_len].name = a;
+    undo[undo_len].known = known[a];
+    undo[undo_len].value = value[a];
+    undo_len++;
+
+    known[a] = is_known;
+    value[a] = v;
+}
+
+static void env_rollback(unsigned mark) {
+    while (undo_len > mark) {
+        Change *c = &undo[--undo_len];
+        known[c->name] = c->known;
+        value[c->name] = c->value;
+    }
+}
+
+static void kill_push(Atom a) {
+    if (killed_len == killed_cap) {
+        killed_cap = killed_cap ? killed_cap * 2 : 256;
+        killed = xrealloc(killed, killed_cap * sizeof(Atom));
+    }
+    killed[killed_len++] = a;
+}
+
+
+static int wrap16(int v) {
+    return (short)v;
+}
+
+static int is_int(const AST *t, NodeId n) {
+    return t->kind[n] == NODE_LITERAL && t->aux[n] == TYPE_INT;
+}
+
+static void set_int(AST *t, NodeId n, int v) {
+    t->kind[n] = NODE_LITERAL;
+    t->aux[n] = TYPE_INT;
+    t->a[n] = (unsigned)wrap16(v);
+    t->b[n] = 0;
+    t->c[n] = 0;
+}
+
+
+static int eval_binop(char op, int a, int b, int *r) {
+    switch (op) {
+        case '+': *r = a + b; return 1;
+        case '-': *r = a - b; return 1;
+        case '*': *r = a * b; return 1;
+
+        case '/':
+            // The target divides unsigned; only fold where that agrees
+            if (b <= 0 || a < 0) return 0;
+            *r = a / b;
+            return 1;
+
+        case '^': {
+            if (b < 0) return 0;
+            int p = 1;
+            while (b--)
+                p = wrap16(p * a);
+            *r = p;
+            return 1;
+        }
+
+        case '>': *r = a > b; return 1;
+        case '<': *r = a < b; return 1;
+        case 'G': *r = a >= b; return 1;
+        case 'L': *r = a <= b; return 1;
+        case 'E': *r = a == b; return 1;
+        case 'N': *r = a != b; return 1;
+    }
+    return 0;
+}
+
+
+static void fold_expr(AST *t, NodeId n) {
+    if (!n) return;
+
+    switch (t->kind[n]) {
+        case NODE_ID: {
+            Atom name = t->a[n];
+            if (known[name])
+                set_int(t, n, value[name]);
+            break;
+        }
+
+        case NODE_BINOP: {
+            NodeId l = t->a[n], r = t->b[n];
+            fold_expr(t, l);
+            fold_expr(t, r);
+
+            int v;
+            if (is_int(t, l) && is_int(t, r) &&
+                eval_binop(t->aux[n], wrap16(t->a[l]), wrap16(t->a[r]), &v))
+                set_int(t, n, v);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+
+// Atoms a statement may assign, appended to `killed`
+static void collect_assigned(const AST *t, NodeId n) {
+    if (!n) return;
+
+    switch (t->kind[n]) {
+        case NODE_DECL:
+            kill_push(t->a[n]);
+            break;
+
+        case NODE_FOR:
+            kill_push(t->a[n]);
+            collect_assigned(t, ast_for_body(t, n));
+            break;
+
+        case NODE_IF:
+            collect_assigned(t, t->b[n]);
+            collect_assigned(t, t->c[n]);
+            break;
+
+        case NODE_STMT_LIST:
+        case NODE_BLOCK: {
+            const NodeId *items = ast_items(t, n);
+            for (unsigned i = 0; i < t->b[n]; i++)
+                collect_assigned(t, items[i]);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+
+static NodeId opt_stmt(AST *t, NodeId n);
+
+static void opt_list(AST *t, NodeId n) {
+    unsigned first = t->a[n], kept = 0;
+
+    // Drop statements that fold away and splice in surviving branches.
+    // Unrolling appends to t->extra and may move it, so it is indexed
+    // afresh on every access
+    for (unsigned i = 0; i < t->b[n]; i++) {
+        NodeId s = opt_stmt(t, t->extra[first + i]);
+        if (s)
+            t->extra[first + kept++] = s;
+    }
+    t->b[n] = kept;
+}
+
+
+static NodeId opt_branch(AST *t, NodeId body) {
+    unsigned mark = undo_len;
+    opt_stmt(t, body);
+
+    // Remember what the branch assigned, then undo its facts
+    for (unsigned i = mark; i < undo_len; i++)
+        kill_push(undo[i].name);
+    env_rollback(mark);
+    return body;
+}
+
+
+/*
+ * Short loops with constant bounds are replaced by their body repeated
+ * once per iteration, each copy preceded by `let var = <value>` so the
+ * copies fold with the induction variable known. A last assignment
+ * leaves var where the loop would have. A body that assigns var itself
+ * changes the trip count, so such loops are left alone, and so are
+ * loops up to FOR_FOREVER, which never end.
+ */
+#define UNROLL_TRIPS 4
+#define UNROLL_NODES 64
+#define FOR_FOREVER 32767       // the counter wraps before it can pass this bound
+
+static NodeId unroll(AST *t, NodeId n, int lo, int hi) {
+    Atom var = t->a[n];
+    NodeId body = ast_for_body(t, n);
+
+    // Measured as the distance between the bounds, so it cannot overflow
+    if (hi == FOR_FOREVER || (hi >= lo && (unsigned)(hi - lo) >= UNROLL_TRIPS))
+        return NODE_NONE;
+    int trips = hi >= lo ? hi - lo + 1 : 0;
+    if ((unsigned)trips * ast_size(t, body) > UNROLL_NODES)
+        return NODE_NONE;
+
+    unsigned kmark = killed_len;
+    int assigned = 0;
+    collect_assigned(t, body);
+    for (unsigned i = kmark; i < killed_len; i++)
+        assigned |= killed[i] == var;
+    killed_len = kmark;
+    if (assigned)
+        return NODE_NONE;
+
+    unsigned mark = ast_list_begin(t);
+    for (int i = 0; i < trips; i++) {
+        NodeId v = make_int(t, lo + i);
+        ast_list_push(t, make_decl(t, var, v));
+        ast_list_push(t, i == trips - 1 ? body : ast_clone(t, body));
+    }
+    ast_list_push(t, make_decl(t, var, make_int(t, wrap16(lo + trips))));
+    return make_stmt_list(t, mark);
+}
+
+
+static NodeId opt_stmt(AST *t, NodeId n) {
+    if (!n) return n;
+
+    switch (t->kind[n]) {
+        case NODE_STMT_LIST:
+        case NODE_BLOCK:
+            opt_list(t, n);
+            return t->b[n] ? n : NODE_NONE;
+
+        case NODE_DECL: {
+            NodeId e = t->b[n];
+            fold_expr(t, e);
+            if (is_int(t, e))
+                env_set(t->a[n], 1, wrap16(t->a[e]));
+            else
+                env_set(t->a[n], 0, 0);
+            return n;
+        }
+
+        case NODE_PRINT:
+            fold_expr(t, t->a[n]);
+            return n;
+
+        case NODE_IF: {
+            NodeId cond = t->a[n];
+            fold_expr(t, cond);
+
+            if (is_int(t, cond))
+                return opt_stmt(t, t->a[cond] ? t->b[n] : t->c[n]);
+
+            unsigned kmark = killed_len;
+            opt_branch(t, t->b[n]);
+            opt_branch(t, t->c[n]);
+
+            // After the if, anything either branch assigned is unknown
+            for (unsigned i = kmark; i < killed_len; i++)
+                env_set(killed[i], 0, 0);
+            killed_len = kmark;
+            return n;
+        }
+
+        case NODE_FOR: {
+            Atom var = t->a[n];
+            NodeId from = t->b[n], to = ast_for_to(t, n);
+
+            // The bound is evaluated once, after the variable is set
+            fold_expr(t, from);
+            if (is_int(t, from))
+                env_set(var, 1, wrap16(t->a[from]));
+            else
+                env_set(var, 0, 0);
+            fold_expr(t, to);
+
+            if (is_int(t, from) && is_int(t, to)) {
+                NodeId flat = unroll(t, n, wrap16(t->a[from]), wrap16(t->a[to]));
+                if (flat)
+                    return opt_stmt(t, flat);
+            }
+
+            unsigned kmark = killed_len;
+            kill_push(var);
+            collect_assigned(t, ast_for_body(t, n));
+            for (unsigned i = kmark; i < killed_len; i++)
+                env_set(killed[i], 0, 0);
+            killed_len = kmark;
+
+            unsigned mark = undo_len;
+            opt_stmt(t, ast_for_body(t, n));
+            env_rollback(mark);
+            return n;
+        }
+
+        default:
+            return n;
+    }
+}
+
+
+void optimize(AST *t) {
+    int atoms = atom_count() + 1;
+    if (atoms > env_cap) {
+        env_cap = atoms;
+        known = xrealloc(known, env_cap);
+        value = xrealloc(value, env_cap * sizeof(int));
+    }
+    memset(known, 0, atoms);
+    undo_len = 0;
+    killed_len = 0;
+
+    if (t->root)
+        opt_list(t, t->root);
+}
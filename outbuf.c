@@ -0,0 +1,94 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+void ob_init(OutBuf *ob) {
+    ob->data = NULL;
+    ob->len = 0;
+    ob->cap = 0;
+}
+
+
+void ob_reset(OutBuf *ob) {
+    ob->len = 0;
+}
+
+
+void ob_free(OutBuf *ob) {
+    free(ob->data);
+    ob_init(ob);
+}
+
+
+void ob_reserve(OutBuf *ob, size_t n) {
+    if (ob->len + n <= ob->cap) return;
+
+    size_t cap = ob->cap ? ob->cap : 64 * 1024;
+    while (cap < ob->len + n)
+        cap *= 2;
+
+    char *p = realloc(ob->data, cap);
+    if (!p) {
+        fprintf(stderr, "Fatal error: out of memory\n");
+        exit(1);
+    }
+    ob->data = p;
+    ob->cap = cap;
+}
+
+
+void ob_write(OutBuf *ob, const char *s, size_t n) {
+    ob_reserve(ob, n);
+    memcpy(ob->data + ob->len, s, n);
+    ob->len += n;
+}
+
+
+void ob_puts(OutBuf *ob, const char *s) {
+    ob_write(ob, s, strlen(s));
+}
+
+
+void ob_putc(OutBuf *ob, char c) {
+    ob_reserve(ob, 1);
+    ob->data[ob->len++] = c;
+}
+
+
+void ob_int(OutBuf *ob, int v) {
+    char tmp[12];
+    int n = 0;
+    unsigned u = v < 0 ? 0u - (unsigned)v : (unsigned)v;
+
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        tmp[n++] = '-';
+
+    ob_reserve(ob, n);
+    while (n)
+        ob->data[ob->len++] = tmp[--n];
+}
+
+
+int ob_fwrite(const OutBuf *ob, FILE *f) {
+    // The whole output goes out in a single write
+    if (fwrite(ob->data, 1, ob->len, f) != ob->len)
+        return -1;
+    return fflush(f) == 0 ? 0 : -1;
+}
+
+
+int ob_save(const OutBuf *ob, const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+
+    int rc = ob_fwrite(ob, f);
+    if (fclose(f) != 0)
+        rc = -1;
+    return rc;
+}
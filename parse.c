@@ -0,0 +1,398 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.tab.h"
+
+
+/*
+ * The front end without bison: the whole source is lexed into
+ * ctx->tokens first, then a recursive descent parser with precedence
+ * climbing for expressions builds the tree straight from the array.
+ *
+ * It accepts exactly what parser.y accepts and builds the same tree,
+ * node for node: nodes are made in the order bison reduces, and a list
+ * is opened only after its first statement, as in the stmt_list rule.
+ * The precedence declarations make comparisons bind tightest and not
+ * chain, "+" and "-" loosest, "^" right associative.
+ *
+ * Errors come out as bison's would. A syntax error is reported at the
+ * first token no valid program continues with, carrying the line the
+ * scanner was on after reading it. Lexical errors are kept as tokens
+ * while lexing and reported when the parser reaches them, so the ones
+ * behind a syntax error are dropped as before.
+ *
+ * Bison gives up with "memory exhausted" when its stack passes
+ * YYMAXDEPTH (10000). Nesting that could get near that is handed to
+ * yyparse instead, which then fails at the same place it always did.
+ */
+
+int yylex(YYSTYPE *lval, CompilerContext *ctx);
+int fast_lex_token(CompilerContext *ctx, Token *t);
+void yyerror(CompilerContext *ctx, const char *s);
+
+// Bounds on the bison stack entries per level of nesting, and the
+// depth past which yyparse takes over
+#define BLOCK_DEPTH 16
+#define EXPR_DEPTH 3
+#define MAX_DEPTH 4000
+
+
+/* ---- Tokens ---- */
+
+static void reserve_tokens(CompilerContext *ctx, unsigned n) {
+    if (n > ctx->token_cap) {
+        unsigned cap = ctx->token_cap ? ctx->token_cap : 4096;
+        while (cap < n)
+            cap *= 2;
+        ctx->token_cap = cap;
+        ctx->tokens = xrealloc(ctx->tokens, cap * sizeof(Token));
+    }
+}
+
+static Token *push_token(CompilerContext *ctx, int kind) {
+    reserve_tokens(ctx, ctx->ntokens + 1);
+    Token *t = &ctx->tokens[ctx->ntokens++];
+    t->kind = (short)kind;
+    t->line = ctx->line_no;
+    t->offset = 0;
+    t->length = 0;
+    t->value.ival = 0;
+    return t;
+}
+
+static void report_lex_error(CompilerContext *ctx, int line, char c) {
+    char text[2] = { c, '\0' };
+    diag_error(ctx, "Lexical error at line %d: unrecognized character '%s'\n",
+        line, text);
+}
+
+void lex_error(CompilerContext *ctx, char c) {
+    if (ctx->lexing_ahead)
+        push_token(ctx, TOKEN_LEX_ERROR)->value.cval = c;
+    else
+        report_lex_error(ctx, ctx->line_no, c);
+}
+
+
+void lex_all(CompilerContext *ctx, const char *src, size_t len, int line) {
+    lex_set_input(ctx, src, len);
+    ctx->line_no = line;
+    ctx->ntokens = 0;
+    ctx->lexing_ahead = 1;
+
+    // Tokens average a few bytes of source
+    reserve_tokens(ctx, (unsigned)(len / 8));
+
+    // The fast scanner fills in tokens itself. Lexical errors are pushed
+    // while it runs, so each token goes in once it is complete
+    if (ctx->lexer != LEX_FLEX) {
+        Token t;
+        do {
+            fast_lex_token(ctx, &t);
+            reserve_tokens(ctx, ctx->ntokens + 1);
+            ctx->tokens[ctx->ntokens++] = t;
+        } while (t.kind != 0);
+        ctx->lexing_ahead = 0;
+        return;
+    }
+
+    YYSTYPE v;
+    for (;;) {
+        int kind = yylex(&v, ctx);
+        Token *t = push_token(ctx, kind);
+        if (kind == 0) break;
+
+        lex_span(ctx, &t->offset, &t->length);
+        switch (kind) {
+            case INT_LITERAL: t->value.ival = v.ival; break;
+            case FLOAT_LITERAL: t->value.fval = v.fval; break;
+            case CHAR_LITERAL: t->value.cval = v.cval; break;
+            case STRING_LITERAL:
+            case ID: t->value.atom = v.atom; break;
+        }
+    }
+    ctx->lexing_ahead = 0;
+}
+
+
+/* ---- Parser ---- */
+
+typedef struct Parser {
+    CompilerContext *ctx;
+    AST *t;
+    const Token *tok;           // the lookahead, never a lexical error
+    int depth;                  // bound on bison's stack
+    int failed;                 // syntax error at tok
+    int too_deep;
+} Parser;
+
+static void advance(Parser *p) {
+    do
+        p->tok++;
+    while (p->tok->kind == TOKEN_LEX_ERROR);
+}
+
+static int peek(const Parser *p) {
+    return p->tok->kind;
+}
+
+static void fail(Parser *p) {
+    p->failed = 1;
+}
+
+static int expect(Parser *p, int kind) {
+    if (p->tok->kind != kind) {
+        fail(p);
+        return 0;
+    }
+    advance(p);
+    return 1;
+}
+
+static void skip_newlines(Parser *p) {
+    while (p->tok->kind == NEWLINE)
+        advance(p);
+}
+
+static int enter(Parser *p, int cost) {
+    p->depth += cost;
+    if (p->depth > MAX_DEPTH) {
+        p->too_deep = 1;
+        p->failed = 1;
+    }
+    return !p->failed;
+}
+
+
+enum { PREC_ADD = 1, PREC_MUL, PREC_POW, PREC_CMP };
+
+static int precedence(int kind, char *op) {
+    switch (kind) {
+        case PLUS:  *op = '+'; return PREC_ADD;
+        case MINUS: *op = '-'; return PREC_ADD;
+        case MUL:   *op = '*'; return PREC_MUL;
+        case DIV:   *op = '/'; return PREC_MUL;
+        case POW:   *op = '^'; return PREC_POW;
+        case GT:    *op = '>'; return PREC_CMP;
+        case LT:    *op = '<'; return PREC_CMP;
+        case GE:    *op = 'G'; return PREC_CMP;
+        case LE:    *op = 'L'; return PREC_CMP;
+        case EQ:    *op = 'E'; return PREC_CMP;
+        case NE:    *op = 'N'; return PREC_CMP;
+    }
+    return 0;
+}
+
+static NodeId expr(Parser *p, int min);
+
+static NodeId primary(Parser *p) {
+    const Token *t = p->tok;
+    NodeId n;
+
+    switch (t->kind) {
+        case INT_LITERAL:    n = make_int(p->t, t->value.ival); break;
+        case FLOAT_LITERAL:  n = make_float(p->t, t->value.fval); break;
+        case CHAR_LITERAL:   n = make_char(p->t, t->value.cval); break;
+        case STRING_LITERAL: n = make_string(p->t, t->value.atom); break;
+        case ID:             n = make_id(p->t, t->value.atom); break;
+
+        case LPAREN:
+            advance(p);
+            if (!enter(p, EXPR_DEPTH)) return NODE_NONE;
+            n = expr(p, PREC_ADD);
+            p->depth -= EXPR_DEPTH;
+            if (p->failed || !expect(p, RPAREN)) return NODE_NONE;
+            return n;
+
+        default:
+            fail(p);
+            return NODE_NONE;
+    }
+    advance(p);
+    return n;
+}
+
+// Operators of precedence min and up. A comparison right after another
+// at the same level is the error %nonassoc makes it
+static NodeId expr(Parser *p, int min) {
+    NodeId left = primary(p);
+    int last = 0;
+
+    while (!p->failed) {
+        char op;
+        int prec = precedence(peek(p), &op);
+        if (prec < min || prec == 0) break;
+        if (prec == PREC_CMP && last == PREC_CMP) {
+            fail(p);
+            break;
+        }
+        advance(p);
+
+        if (!enter(p, EXPR_DEPTH)) break;
+        NodeId right = expr(p, prec == PREC_POW ? prec : prec + 1);
+        p->depth -= EXPR_DEPTH;
+        if (p->failed) break;
+
+        left = make_binop(p->t, op, left, right);
+        last = prec;
+    }
+    return left;
+}
+
+
+static NodeId stmt(Parser *p);
+
+// Statements separated by newlines up to end, which is left unread
+static unsigned stmt_list(Parser *p, int end) {
+    NodeId first = stmt(p);
+    if (p->failed) return 0;
+
+    unsigned mark = ast_list_begin(p->t);
+    ast_list_push(p->t, first);
+    while (peek(p) == NEWLINE) {
+        skip_newlines(p);
+        if (peek(p) == end) break;
+
+        NodeId s = stmt(p);
+        if (p->failed) break;
+        ast_list_push(p->t, s);
+    }
+    return mark;
+}
+
+static NodeId block(Parser *p) {
+    if (!expect(p, LBRACKET) || !enter(p, BLOCK_DEPTH)) return NODE_NONE;
+
+    skip_newlines(p);
+    unsigned mark = stmt_list(p, RBRACKET);
+    p->depth -= BLOCK_DEPTH;
+    if (p->failed || !expect(p, RBRACKET)) return NODE_NONE;
+    return make_block(p->t, mark);
+}
+
+static NodeId stmt(Parser *p) {
+    switch (peek(p)) {
+        case LET: {
+            advance(p);
+            Atom name = p->tok->value.atom;
+            if (!expect(p, ID) || !expect(p, ASSIGN)) return NODE_NONE;
+            NodeId e = expr(p, PREC_ADD);
+            if (p->failed) return NODE_NONE;
+            return make_decl(p->t, name, e);
+        }
+
+        case PRINT: {
+            advance(p);
+            NodeId e = expr(p, PREC_ADD);
+            if (p->failed) return NODE_NONE;
+            return make_print(p->t, e);
+        }
+
+        case IF: {
+            advance(p);
+            NodeId cond = expr(p, PREC_ADD);
+            if (p->failed) return NODE_NONE;
+            skip_newlines(p);
+            NodeId body = block(p);
+            if (p->failed) return NODE_NONE;
+
+            // The else has to follow on the same line as the "]"
+            NodeId else_body = NODE_NONE;
+            if (peek(p) == ELSE) {
+                advance(p);
+                skip_newlines(p);
+                else_body = block(p);
+                if (p->failed) return NODE_NONE;
+            }
+            return make_if(p->t, cond, body, else_body);
+        }
+
+        case FOR: {
+            advance(p);
+            Atom var = p->tok->value.atom;
+            if (!expect(p, ID) || !expect(p, ASSIGN)) return NODE_NONE;
+            NodeId from = expr(p, PREC_ADD);
+            if (p->failed || !expect(p, TO)) return NODE_NONE;
+            NodeId to = expr(p, PREC_ADD);
+            if (p->failed) return NODE_NONE;
+            skip_newlines(p);
+            NodeId body = block(p);
+            if (p->failed) return NODE_NONE;
+            return make_for(p->t, var, from, to, body);
+        }
+
+        case LBRACKET:
+            return block(p);
+    }
+    fail(p);
+    return NODE_NONE;
+}
+
+
+static int parse_tokens(CompilerContext *ctx, Parser *p) {
+    p->ctx = ctx;
+    p->t = &ctx->ast;
+    p->tok = ctx->tokens;
+    p->depth = 0;
+    p->failed = 0;
+    p->too_deep = 0;
+    if (p->tok->kind == TOKEN_LEX_ERROR)
+        advance(p);
+
+    skip_newlines(p);
+    if (peek(p) == 0) {
+        ctx->ast.root = NODE_NONE;
+        return 0;
+    }
+
+    unsigned mark = stmt_list(p, 0);
+    if (p->failed) return 1;
+    if (peek(p) != 0) {
+        fail(p);
+        return 1;
+    }
+
+    ctx->ast.root = make_stmt_list(&ctx->ast, mark);
+    return 0;
+}
+
+
+int parse_source(CompilerContext *ctx, const char *src, size_t len, int line) {
+    if (ctx->parser == PARSER_BISON) {
+        STAT_PHASE(PHASE_PARSE);
+        lex_set_input(ctx, src, len);
+        ctx->line_no = line;
+        return yyparse(ctx);
+    }
+
+    STAT_PHASE(PHASE_LEX);
+    lex_all(ctx, src, len, line);
+
+    STAT_PHASE(PHASE_PARSE);
+    AST *t = &ctx->ast;
+    unsigned count = t->count, extra_len = t->extra_len, pending_len = t->pending_len;
+    Parser p;
+    int rc = parse_tokens(ctx, &p);
+
+    if (p.too_deep) {
+        // Nothing is reported yet; let bison parse it from the start
+        t->count = count;
+        t->extra_len = extra_len;
+        t->pending_len = pending_len;
+        lex_set_input(ctx, src, len);
+        ctx->line_no = line;
+        return yyparse(ctx);
+    }
+
+    // What bison's scanner would have reported before reaching p.tok
+    for (const Token *k = ctx->tokens; k < p.tok; k++)
+        if (k->kind == TOKEN_LEX_ERROR)
+            report_lex_error(ctx, k->line, k->value.cval);
+
+    ctx->line_no = p.tok->line;
+    if (rc != 0)
+        yyerror(ctx, "syntax error");
+    return rc;
+}
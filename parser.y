@@ -6,21 +6,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "ast.h"
+%}
 
-extern int yylex();
-extern int line_no;
-void yyerror(const char *s);
 
-ASTNode *root;
-%}
+/* No globals: the tree and the scanner come from the context */
+%define api.pure full
+%param {CompilerContext *ctx}
 
 
 %union {
     int ival;
     float fval;
     char cval;
-    char *sval;
-    ASTNode *node;
+    Atom atom;
+    unsigned mark;
+    NodeId node;
 }
 
 
@@ -35,8 +35,8 @@ ASTNode *root;
 %token <ival> INT_LITERAL
 %token <fval> FLOAT_LITERAL
 %token <cval> CHAR_LITERAL
-%token <sval> STRING_LITERAL
-%token <sval> ID
+%token <atom> STRING_LITERAL
+%token <atom> ID
 
 
 %left PLUS MINUS
@@ -51,7 +51,14 @@ ASTNode *root;
 
 
 
-%type <node> program stmt_list stmt_list_inner stmt block expr literal
+%type <mark> stmt_list
+%type <node> stmt block expr literal
+
+
+%code {
+    int yylex(YYSTYPE *lval, CompilerContext *ctx);
+    void yyerror(CompilerContext *ctx, const char *s);
+}
 
 
 %%
@@ -59,43 +66,37 @@ ASTNode *root;
 
 program
     : opt_newlines stmt_list opt_newlines
-        { root = $2; }
+        { ctx->ast.root = make_stmt_list(&ctx->ast, $2); }
     | opt_newlines
-        { root = NULL; }
+        { ctx->ast.root = NODE_NONE; }
     ;
 
 
+/* Statements are collected on the AST's pending stack, $$ is where the
+   list starts; make_stmt_list/make_block copy it out as one range */
 stmt_list
     : stmt_list newline_seq stmt
-        { $$ = make_stmt_list($1, $3); }
+        { ast_list_push(&ctx->ast, $3); $$ = $1; }
     | stmt
-        { $$ = $1; }
-    ;
-
-
-stmt_list_inner
-    : stmt_list_inner newline_seq stmt
-        { $$ = make_stmt_list($1, $3); }
-    | stmt
-        { $$ = $1; }
+        { $$ = ast_list_begin(&ctx->ast); ast_list_push(&ctx->ast, $1); }
     ;
 
 
 stmt
     : LET ID ASSIGN expr
-        { $$ = make_decl($2, $4); }
+        { $$ = make_decl(&ctx->ast, $2, $4); }
 
     | PRINT expr
-        { $$ = make_print($2); }
+        { $$ = make_print(&ctx->ast, $2); }
 
     | IF expr opt_newlines block %prec IFX
-        { $$ = make_if($2, $4, NULL); }
+        { $$ = make_if(&ctx->ast, $2, $4, NODE_NONE); }
 
     | IF expr opt_newlines block ELSE opt_newlines block
-        { $$ = make_if($2, $4, $7); }
+        { $$ = make_if(&ctx->ast, $2, $4, $7); }
 
     | FOR ID ASSIGN expr TO expr opt_newlines block
-        { $$ = make_for($2, $4, $6, $8); }
+        { $$ = make_for(&ctx->ast, $2, $4, $6, $8); }
 
     | block
         { $$ = $1; }
@@ -103,8 +104,8 @@ stmt
 
 
 block
-    : LBRACKET opt_newlines stmt_list_inner opt_newlines RBRACKET
-        { $$ = make_block($3); }
+    : LBRACKET opt_newlines stmt_list opt_newlines RBRACKET
+        { $$ = make_block(&ctx->ast, $3); }
     ;
 
 
@@ -121,34 +122,34 @@ newline_seq
 
 
 expr
-    : expr PLUS expr     { $$ = make_binop('+', $1, $3); }
-    | expr MINUS expr    { $$ = make_binop('-', $1, $3); }
-    | expr MUL expr      { $$ = make_binop('*', $1, $3); }
-    | expr DIV expr      { $$ = make_binop('/', $1, $3); }
-    | expr POW expr      { $$ = make_binop('^', $1, $3); }
-
-    | expr GT expr       { $$ = make_binop('>', $1, $3); }
-    | expr LT expr       { $$ = make_binop('<', $1, $3); }
-    | expr GE expr       { $$ = make_binop('G', $1, $3); }
-    | expr LE expr       { $$ = make_binop('L', $1, $3); }
-    | expr EQ expr       { $$ = make_binop('E', $1, $3); }
-    | expr NE expr       { $$ = make_binop('N', $1, $3); }
+    : expr PLUS expr     { $$ = make_binop(&ctx->ast, '+', $1, $3); }
+    | expr MINUS expr    { $$ = make_binop(&ctx->ast, '-', $1, $3); }
+    | expr MUL expr      { $$ = make_binop(&ctx->ast, '*', $1, $3); }
+    | expr DIV expr      { $$ = make_binop(&ctx->ast, '/', $1, $3); }
+    | expr POW expr      { $$ = make_binop(&ctx->ast, '^', $1, $3); }
+
+    | expr GT expr       { $$ = make_binop(&ctx->ast, '>', $1, $3); }
+    | expr LT expr       { $$ = make_binop(&ctx->ast, '<', $1, $3); }
+    | expr GE expr       { $$ = make_binop(&ctx->ast, 'G', $1, $3); }
+    | expr LE expr       { $$ = make_binop(&ctx->ast, 'L', $1, $3); }
+    | expr EQ expr       { $$ = make_binop(&ctx->ast, 'E', $1, $3); }
+    | expr NE expr       { $$ = make_binop(&ctx->ast, 'N', $1, $3); }
 
     | LPAREN expr RPAREN { $$ = $2; }
     | literal            { $$ = $1; }
-    | ID                 { $$ = make_id($1); }
+    | ID                 { $$ = make_id(&ctx->ast, $1); }
     ;
 
 
 literal
-    : INT_LITERAL        { $$ = make_int($1); }
-    | FLOAT_LITERAL      { $$ = make_float($1); }
-    | CHAR_LITERAL       { $$ = make_char($1); }
-    | STRING_LITERAL     { $$ = make_string($1); }
+    : INT_LITERAL        { $$ = make_int(&ctx->ast, $1); }
+    | FLOAT_LITERAL      { $$ = make_float(&ctx->ast, $1); }
+    | CHAR_LITERAL       { $$ = make_char(&ctx->ast, $1); }
+    | STRING_LITERAL     { $$ = make_string(&ctx->ast, $1); }
     ;
 
 %%
 
-void yyerror(const char *s) {
-    fprintf(stderr, "Parser error at line %d: %s\n", line_no, s);
+void yyerror(CompilerContext *ctx, const char *s) {
+    diag_error(ctx, "Parser error at line %d: %s\n", ctx->line_no, s);
 }
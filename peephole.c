@@ -0,0 +1,362 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Peephole optimizer over the code generator's instruction list.
+ *
+ * Each rule looks at the instruction at index i and the ones after it,
+ * and either rewrites them in place (deleted instructions become I_NOP)
+ * or returns 0. The pass sweeps the list with every enabled rule and
+ * repeats until a sweep changes nothing, since one rewrite often exposes
+ * another: a threaded jump leaves a dead label, whose removal lets a
+ * store and the following load meet.
+ *
+ * Jump targets are looked up through label_pos[] and label_refs[],
+ * rebuilt before every sweep and kept current by the rules themselves.
+ */
+
+static _Thread_local int *label_pos = NULL;       // by label_key, -1 = not placed
+static _Thread_local int *label_refs = NULL;
+static _Thread_local int label_cap = 0;
+
+
+static int same(const Operand *a, const Operand *b) {
+    return a->kind == b->kind && a->val == b->val &&
+           (a->kind != O_LABEL || a->lbl == b->lbl);
+}
+
+static int is_reg(const Operand *o, int r) {
+    return o->kind == O_REG && o->val == r;
+}
+
+static int is_cond_jump(int op) {
+    return op > I_JMP;
+}
+
+static void kill(Insn *in) {
+    if (insn_is_jump(in->op))
+        label_refs[label_key(&in->dst)]--;
+    in->op = I_NOP;
+}
+
+// Index of the next real instruction after i, or c->len
+static int next(const InsnList *c, int i) {
+    do {
+        i++;
+    } while (i < c->len && c->items[i].op == I_NOP);
+    return i;
+}
+
+// First index after i that is neither a label nor deleted
+static int next_code(const InsnList *c, int i) {
+    do {
+        i++;
+    } while (i < c->len && (c->items[i].op == I_NOP ||
+                            c->items[i].op == I_LABEL));
+    return i;
+}
+
+
+// Nothing between i and the next flag-setting instruction reads flags
+static int flags_dead(const InsnList *c, int i) {
+    for (i = next(c, i); i < c->len; i = next(c, i)) {
+        switch (c->items[i].op) {
+            case I_ADD: case I_SUB: case I_CMP: case I_XOR:
+            case I_SHL: case I_SHR: case I_MUL: case I_IMUL: case I_DIV:
+            case I_INC: case I_CALL: case I_INT:
+                return 1;
+            case I_JMP:
+                return 0;
+            default:
+                if (is_cond_jump(c->items[i].op))
+                    return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* mov [x], r / mov r, [x]  and  mov r, [x] / mov [x], r: drop the second */
+static int rule_store_load(InsnList *c, int i) {
+    Insn *a = &c->items[i];
+    if (a->op != I_MOV) return 0;
+
+    int j = next(c, i);
+    if (j >= c->len) return 0;
+    Insn *b = &c->items[j];
+    if (b->op != I_MOV) return 0;
+
+    int mem_reg = a->dst.kind == O_TMP && a->src.kind == O_REG;
+    int reg_mem = a->dst.kind == O_REG && a->src.kind == O_TMP;
+    if (!mem_reg && !reg_mem) return 0;
+
+    if (same(&a->dst, &b->src) && same(&a->src, &b->dst)) {
+        kill(b);
+        return 1;
+    }
+    return 0;
+}
+
+
+/* push x / pop r  ->  mov r, x  (or nothing when x is r) */
+static int rule_push_pop(InsnList *c, int i) {
+    Insn *a = &c->items[i];
+    if (a->op != I_PUSH) return 0;
+
+    int j = next(c, i);
+    if (j >= c->len || c->items[j].op != I_POP) return 0;
+    Insn *b = &c->items[j];
+    if (b->dst.kind != O_REG) return 0;
+
+    if (same(&a->dst, &b->dst)) {
+        kill(a);
+    } else {
+        a->op = I_MOV;
+        a->src = a->dst;
+        a->dst = b->dst;
+    }
+    kill(b);
+    return 1;
+}
+
+
+/* mov r, 0  ->  xor r, r  when the flags it clobbers are not read */
+static int rule_zero_reg(InsnList *c, int i) {
+    Insn *a = &c->items[i];
+    if (a->op != I_MOV || a->dst.kind != O_REG || a->dst.val == AH ||
+        a->src.kind != O_IMM || a->src.val != 0)
+        return 0;
+    if (!flags_dead(c, i)) return 0;
+
+    a->op = I_XOR;
+    a->src = a->dst;
+    return 1;
+}
+
+
+/*
+ * mov r, 2^k / mul r               ->  shl ax, k
+ * mov r, 2^k / xor dx, dx / div r  ->  shr ax, k
+ *
+ * The code generator loads a multiplier into a scratch register right
+ * before the mul and never reads it again, and the high word in DX is
+ * dead after either instruction.
+ */
+static int rule_mul_pow2(InsnList *c, int i) {
+    Insn *a = &c->items[i];
+    if (a->op != I_MOV || a->dst.kind != O_REG || a->src.kind != O_IMM)
+        return 0;
+
+    int r = a->dst.val;
+    int v = a->src.val;
+    if (r == AX || r == DX || r == AH || v <= 0 || (v & (v - 1)))
+        return 0;
+
+    int j = next(c, i);
+    if (j >= c->len) return 0;
+    Insn *b = &c->items[j];
+    Insn *x = NULL;
+    if (b->op == I_XOR && is_reg(&b->dst, DX) && is_reg(&b->src, DX)) {
+        x = b;
+        j = next(c, j);
+        if (j >= c->len) return 0;
+        b = &c->items[j];
+    }
+    if (!is_reg(&b->dst, r)) return 0;
+    if (!(b->op == I_MUL && !x) && !(b->op == I_DIV && x)) return 0;
+
+    int k = 0;
+    while ((1 << k) < v)
+        k++;
+
+    a->op = b->op == I_MUL ? I_SHL : I_SHR;
+    a->dst = (Operand){ O_REG, 0, AX };
+    a->src = (Operand){ O_IMM, 0, k };
+    if (k == 0)
+        a->op = I_NOP;
+    if (x)
+        x->op = I_NOP;
+    b->op = I_NOP;
+    return 1;
+}
+
+
+/* Jumps to a label that falls through to the target anyway */
+static int rule_jump_next(InsnList *c, int i) {
+    Insn *a = &c->items[i];
+    if (!insn_is_jump(a->op)) return 0;
+
+    for (int j = next(c, i); j < c->len && c->items[j].op == I_LABEL;
+         j = next(c, j)) {
+        if (same(&c->items[j].dst, &a->dst)) {
+            kill(a);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* A jump to an unconditional jump goes straight to its target */
+static int rule_jump_thread(InsnList *c, int i) {
+    Insn *a = &c->items[i];
+    if (!insn_is_jump(a->op)) return 0;
+
+    int pos = label_pos[label_key(&a->dst)];
+    if (pos < 0) return 0;
+
+    int j = next_code(c, pos);
+    if (j >= c->len || c->items[j].op != I_JMP) return 0;
+
+    Operand to = c->items[j].dst;
+    if (same(&to, &a->dst) || j == i) return 0;
+
+    label_refs[label_key(&a->dst)]--;
+    label_refs[label_key(&to)]++;
+    a->dst = to;
+    return 1;
+}
+
+
+/* Code after an unconditional jump is dead up to the next label */
+static int rule_unreachable(InsnList *c, int i) {
+    if (c->items[i].op != I_JMP) return 0;
+
+    int fired = 0;
+    for (int j = next(c, i); j < c->len && c->items[j].op != I_LABEL;
+         j = next(c, j)) {
+        kill(&c->items[j]);
+        fired = 1;
+    }
+    return fired;
+}
+
+
+/* Labels nothing jumps to */
+static int rule_dead_label(InsnList *c, int i) {
+    Insn *a = &c->items[i];
+    if (a->op != I_LABEL || label_refs[label_key(&a->dst)] > 0)
+        return 0;
+
+    label_pos[label_key(&a->dst)] = -1;
+    a->op = I_NOP;
+    return 1;
+}
+
+
+typedef struct Rule {
+    const char *name;
+    int (*apply)(InsnList *c, int i);
+    int enabled;
+} Rule;
+
+static Rule rules[] = {
+    { "store-load",  rule_store_load,  1 },
+    { "push-pop",    rule_push_pop,    1 },
+    { "zero-reg",    rule_zero_reg,    1 },
+    { "mul-pow2",    rule_mul_pow2,    1 },
+    { "jump-next",   rule_jump_next,   1 },
+    { "jump-thread", rule_jump_thread, 1 },
+    { "unreachable", rule_unreachable, 1 },
+    { "dead-label",  rule_dead_label,  1 },
+};
+
+#define NUM_RULES (int)(sizeof(rules) / sizeof(rules[0]))
+
+// Rules are switched before compiling starts; counts are per thread
+static _Thread_local unsigned rule_fired[NUM_RULES];
+
+
+int peephole_set_rule(const char *name, int enabled) {
+    int found = 0;
+    for (int r = 0; r < NUM_RULES; r++) {
+        if (strcmp(name, "all") == 0 || strcmp(name, rules[r].name) == 0) {
+            rules[r].enabled = enabled;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+
+void peephole_reset_stats(void) {
+    for (int r = 0; r < NUM_RULES; r++)
+        rule_fired[r] = 0;
+}
+
+
+void peephole_report(FILE *f) {
+    unsigned total = 0;
+    for (int r = 0; r < NUM_RULES; r++)
+        total += rule_fired[r];
+
+    fprintf(f, "Peephole: %u rewrites\n", total);
+    for (int r = 0; r < NUM_RULES; r++)
+        fprintf(f, "  %-12s %8u%s\n", rules[r].name, rule_fired[r],
+                rules[r].enabled ? "" : "  (disabled)");
+}
+
+
+static void index_labels(const InsnList *c) {
+    int keys = 0;
+    for (int i = 0; i < c->len; i++) {
+        const Insn *in = &c->items[i];
+        if ((in->op == I_LABEL || insn_is_jump(in->op)) &&
+            label_key(&in->dst) >= keys)
+            keys = label_key(&in->dst) + 1;
+    }
+
+    if (keys > label_cap) {
+        label_cap = keys;
+        label_pos = xrealloc(label_pos, label_cap * sizeof(int));
+        label_refs = xrealloc(label_refs, label_cap * sizeof(int));
+    }
+    for (int k = 0; k < keys; k++) {
+        label_pos[k] = -1;
+        label_refs[k] = 0;
+    }
+
+    for (int i = 0; i < c->len; i++) {
+        const Insn *in = &c->items[i];
+        if (in->op == I_LABEL)
+            label_pos[label_key(&in->dst)] = i;
+        else if (insn_is_jump(in->op))
+            label_refs[label_key(&in->dst)]++;
+    }
+}
+
+
+static void compact(InsnList *c) {
+    int kept = 0;
+    for (int i = 0; i < c->len; i++)
+        if (c->items[i].op != I_NOP)
+            c->items[kept++] = c->items[i];
+    c->len = kept;
+}
+
+
+void peephole(InsnList *code) {
+    int changed;
+    int sweeps = 0;
+
+    // Every rule shrinks or settles the code; the cap is a safety net
+    do {
+        changed = 0;
+        index_labels(code);
+
+        for (int i = 0; i < code->len; i++) {
+            for (int r = 0; r < NUM_RULES; r++) {
+                if (code->items[i].op == I_NOP)
+                    break;
+                if (rules[r].enabled && rules[r].apply(code, i)) {
+                    rule_fired[r]++;
+                    changed = 1;
+                }
+            }
+        }
+        compact(code);
+    } while (changed && ++sweeps < 32);
+}
@@ -1,12 +1,104 @@
 import http.server
-import socketserver
 import json
-import subprocess
 import os
+import queue
+import subprocess
 import sys
+import threading
+import zlib
 
 PORT = 3000
 DIRECTORY = "."
+COMPILER = os.path.abspath('nova.exe')
+WORKERS = int(os.environ.get('NOVA_WORKERS', os.cpu_count() or 4))
+TIMEOUT = 10    # seconds before a stuck compiler is killed
+
+
+class Worker:
+    """A long-lived `nova.exe --serve` process, started on first use and
+    again after it dies. The protocol is described above serve() in main.c."""
+
+    def __init__(self):
+        self.process = None
+        self.lock = threading.Lock()
+
+    def _start(self):
+        if self.process is None or self.process.poll() is not None:
+            self.process = subprocess.Popen(
+                [COMPILER, '--serve'],
+                stdin=subprocess.PIPE,
+                stdout=subprocess.PIPE,
+                stderr=subprocess.DEVNULL,
+                cwd=os.getcwd()
+            )
+
+    def _read(self, n):
+        data = self.process.stdout.read(n)
+        if len(data) != n:
+            raise EOFError
+        return data
+
+    def compile(self, mode, code, session=None):
+        with self.lock:
+            return self._compile(mode, code, session)
+
+    def _compile(self, mode, code, session):
+        self._start()
+        source = code.encode('utf-8')
+        request = b'%s 8086 %d' % (mode.encode(), len(source))
+        if session:
+            request += b' ' + session.encode()
+        timer = threading.Timer(TIMEOUT, self.process.kill)
+        timer.start()
+        try:
+            self.process.stdin.write(request + b'\n' + source)
+            self.process.stdin.flush()
+            header = self.process.stdout.readline().split()
+            if len(header) != 3:
+                raise EOFError
+            status, out_len, msg_len = map(int, header)
+            output = self._read(out_len)
+            messages = self._read(msg_len)
+        except (EOFError, OSError):
+            # Crashed, or killed by the timer; the next request restarts it
+            self.process.kill()
+            self.process.wait()
+            return 1, '', 'Compiler stopped (crash or timeout after %d s)\n' % TIMEOUT
+        finally:
+            timer.cancel()
+        return status, output.decode('utf-8', 'replace'), messages.decode('utf-8', 'replace')
+
+
+class Pool:
+    """Idle workers wait in a queue; a request takes one and puts it back.
+    Requests of an editor session always go to the same worker, which keeps
+    the session's previous compilation (see compile_incremental in incr.c)."""
+
+    def __init__(self, size):
+        self.workers = [Worker() for _ in range(size)]
+        self.idle = queue.Queue()
+        for worker in self.workers:
+            self.idle.put(worker)
+
+    def compile(self, mode, code, session=None):
+        if session:
+            worker = self.workers[zlib.crc32(session.encode()) % len(self.workers)]
+            return worker.compile(mode, code, session)
+
+        worker = self.idle.get()
+        try:
+            return worker.compile(mode, code)
+        finally:
+            self.idle.put(worker)
+
+
+class NovaServer(http.server.ThreadingHTTPServer):
+    daemon_threads = True
+    request_queue_size = 128    # the default backlog of 5 drops bursts
+
+
+pool = Pool(WORKERS)
+
 
 class NovaHandler(http.server.SimpleHTTPRequestHandler):
     def __init__(self, *args, **kwargs):
@@ -32,7 +124,7 @@ class NovaHandler(http.server.SimpleHTTPRequestHandler):
                      return
 
 
-                if not os.path.exists('nova.exe'):
+                if not os.path.exists(COMPILER):
                      response_data = {
                         'success': False,
                         'stdout': '',
@@ -42,47 +134,21 @@ class NovaHandler(http.server.SimpleHTTPRequestHandler):
                      self._send_json_response(500, response_data)
                      return
 
+                # The output is the assembly, or with "run" what the program
+                # printed after being compiled to memory and executed
+                run = bool(data.get('run'))
+                session = ''.join(c for c in str(data.get('session', ''))[:63] if c.isalnum())
+                status, output, messages = pool.compile('run' if run else 'asm', code, session)
+                ok = status == 0
 
-                asm_file = 'output.asm'
-                if os.path.exists(asm_file):
-                    try:
-                        os.remove(asm_file)
-                    except Exception as e:
-                        print(f"Warning: Could not remove stale output.asm: {e}")
-
-                temp_file_path = 'temp.no'
-                with open(temp_file_path, 'w') as f:
-                    f.write(code)
-
-                cmd = ['nova.exe']
-                
-                process = subprocess.Popen(
-                    cmd, 
-                    stdin=subprocess.PIPE, 
-                    stdout=subprocess.PIPE, 
-                    stderr=subprocess.PIPE,
-                    text=True,
-                    cwd=os.getcwd()
-                )
-                
-                stdout, stderr = process.communicate(input=code)
-                
-                asm_content = ""
-                
-                if os.path.exists(asm_file):
-                    try:
-                        with open(asm_file, 'r') as f:
-                            asm_content = f.read()
-                    except Exception as e:
-                        asm_content = f"Error reading output.asm: {e}"
-
-                
                 response_data = {
                     'success': True,
-                    'stdout': stdout,
-                    'stderr': stderr,
-                    'asm': asm_content
+                    'stdout': messages if ok else '',
+                    'stderr': '' if ok else messages,
+                    'asm': output if ok and not run else ''
                 }
+                if run:
+                    response_data['output'] = output if ok else ''
                 
                 self._send_json_response(response_data)
 
@@ -100,14 +166,15 @@ class NovaHandler(http.server.SimpleHTTPRequestHandler):
         response_bytes = json.dumps(data).encode('utf-8')
         self.send_response(status_code)
         self.send_header('Content-Type', 'application/json')
+        self.send_header('Content-Length', str(len(response_bytes)))
         self.end_headers()
         self.wfile.write(response_bytes)
 
 
 if __name__ == '__main__':
-    print(f"Starting server at http://localhost:{PORT}")
+    print(f"Starting server at http://localhost:{PORT} with {WORKERS} compiler workers")
     try:
-        with socketserver.TCPServer(("", PORT), NovaHandler) as httpd:
+        with NovaServer(("", PORT), NovaHandler) as httpd:
             httpd.serve_forever()
     except KeyboardInterrupt:
         print("\nServer stopped.")
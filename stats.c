@@ -0,0 +1,143 @@
+#include "ast.h"
+
+#if defined(NOVA_STATS)
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+
+/*
+ * --stats. The counters are bumped in place by the STAT_ macros in
+ * ast.h; this file only keeps the phase clock and prints the report.
+ * Phases do not nest: starting one ends the one before, so each phase
+ * is timed from its STAT_PHASE to the next. CPU time is the thread's,
+ * which is the compilation's even when other threads are compiling.
+ */
+
+_Thread_local CompileStats compile_stats;
+
+static _Thread_local Phase current = PHASE_NONE;
+static _Thread_local double started_wall, started_cpu;
+
+static const char *phase_name[NUM_PHASES] = {
+    "lex", "parse", "check", "fold", "ir", "select", "emit", "run"
+};
+
+static const char *node_name[NUM_NODE_KINDS] = {
+    "stmt_list", "decl", "print", "if", "for", "block", "binop", "literal", "id"
+};
+
+
+static double seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+void stats_phase(Phase p) {
+    double wall = seconds(CLOCK_MONOTONIC);
+    double cpu = seconds(CLOCK_THREAD_CPUTIME_ID);
+
+    if (current != PHASE_NONE) {
+        compile_stats.wall[current] += wall - started_wall;
+        compile_stats.cpu[current] += cpu - started_cpu;
+    }
+    current = p;
+    started_wall = wall;
+    started_cpu = cpu;
+}
+
+
+void stats_reset(void) {
+    memset(&compile_stats, 0, sizeof(compile_stats));
+    current = PHASE_NONE;
+}
+
+
+// In KB, 0 where it cannot be had
+static unsigned long peak_rss(void) {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+    return (unsigned long)(pmc.PeakWorkingSetSize / 1024);
+#else
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return (unsigned long)ru.ru_maxrss / 1024;
+#else
+    return (unsigned long)ru.ru_maxrss;
+#endif
+#endif
+}
+
+
+static void report_text(FILE *f, const CompileStats *s, unsigned long long nodes,
+                        unsigned long rss) {
+    double wall = 0, cpu = 0;
+
+    fprintf(f, "Phase            wall ms      cpu ms\n");
+    for (int p = 0; p < NUM_PHASES; p++) {
+        fprintf(f, "  %-10s %11.3f %11.3f\n", phase_name[p],
+                s->wall[p] * 1e3, s->cpu[p] * 1e3);
+        wall += s->wall[p];
+        cpu += s->cpu[p];
+    }
+    fprintf(f, "  %-10s %11.3f %11.3f\n", "total", wall * 1e3, cpu * 1e3);
+
+    fprintf(f, "Tokens:          %llu\n", s->tokens);
+    fprintf(f, "Nodes:           %llu\n", nodes);
+    for (int k = 0; k < NUM_NODE_KINDS; k++)
+        fprintf(f, "  %-10s %11llu\n", node_name[k], s->nodes[k]);
+    fprintf(f, "Symbol lookups:  %llu, %.2f probes on average, at most %u\n",
+            s->lookups, s->lookups ? (double)s->probes / s->lookups : 0.0,
+            s->max_probes);
+    fprintf(f, "Labels:          %llu\n", s->labels);
+    fprintf(f, "Instructions:    %llu\n", s->insns);
+    fprintf(f, "Bytes emitted:   %llu\n", s->bytes);
+    fprintf(f, "Peak RSS:        %lu KB\n", rss);
+}
+
+static void report_json(FILE *f, const CompileStats *s, unsigned long long nodes,
+                        unsigned long rss) {
+    fprintf(f, "{\"phases\": {");
+    for (int p = 0; p < NUM_PHASES; p++)
+        fprintf(f, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}", p ? ", " : "",
+                phase_name[p], s->wall[p] * 1e3, s->cpu[p] * 1e3);
+
+    fprintf(f, "}, \"tokens\": %llu, \"nodes\": {\"total\": %llu", s->tokens, nodes);
+    for (int k = 0; k < NUM_NODE_KINDS; k++)
+        fprintf(f, ", \"%s\": %llu", node_name[k], s->nodes[k]);
+
+    fprintf(f, "}, \"symbol_lookups\": %llu, \"symbol_probes\": %llu, "
+            "\"symbol_max_probes\": %u", s->lookups, s->probes, s->max_probes);
+    fprintf(f, ", \"labels\": %llu, \"instructions\": %llu, \"bytes\": %llu",
+            s->labels, s->insns, s->bytes);
+    fprintf(f, ", \"peak_rss_kb\": %lu}\n", rss);
+}
+
+
+void stats_report(FILE *f, int json) {
+    const CompileStats *s = &compile_stats;
+    unsigned long long nodes = 0;
+    for (int k = 0; k < NUM_NODE_KINDS; k++)
+        nodes += s->nodes[k];
+
+    if (json)
+        report_json(f, s, nodes, peak_rss());
+    else
+        report_text(f, s, nodes, peak_rss());
+}
+
+#endif
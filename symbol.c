@@ -3,66 +3,145 @@
 #include <stdlib.h>
 #include <string.h>
 
-static Symbol *symbol_table = NULL;
-static int current_scope = 0;
-int semantic_errors = 0;
 
-
-void sym_enter_scope(void) {
-    current_scope++;
+/*
+ * Scoped symbol table: an open-addressing hash keyed by atom holds the
+ * innermost binding of every name, older bindings hang off ->shadowed.
+ * Every insert is also pushed on an undo stack so leaving a scope only
+ * touches the symbols declared in it.
+ *
+ * A table belongs to one compilation context; nothing here is shared.
+ */
+struct SymSlot {
+    Atom name;          // ATOM_NONE = empty, keys are never removed
+    Symbol *sym;        // innermost live binding or NULL
+};
+
+
+static unsigned slot_hash(Atom name) {
+    return (unsigned)name * 2654435761u;
 }
 
-void sym_exit_scope(void) {
-    Symbol **curr = &symbol_table;
 
-    // Walk through list and remove symbols at current scope level
-    while (*curr) {
-        if ((*curr)->scope_level == current_scope) {
-            Symbol *tmp = *curr;
-            *curr = tmp->next;
-            free(tmp->name);
-            free(tmp);
-        } else {
-            curr = &(*curr)->next;
-        }
+static SymSlot *find_slot(const SymbolTable *st, Atom name) {
+    unsigned i = slot_hash(name) & st->slot_mask, probes = 1;
+    while (st->slots[i].name != name && st->slots[i].name != ATOM_NONE) {
+        i = (i + 1) & st->slot_mask;
+        probes++;
     }
-    current_scope--;
+    STAT_LOOKUP(probes);
+    return &st->slots[i];
 }
 
 
-static Symbol *sym_lookup_current_scope(const char *name) {
-    for (Symbol *s = symbol_table; s; s = s->next) {
-        if (strcmp(s->name, name) == 0 && s->scope_level == current_scope)
-            return s;
+static void grow_slots(SymbolTable *st) {
+    SymSlot *old = st->slots;
+    unsigned old_cap = old ? st->slot_mask + 1 : 0;
+    unsigned cap = old_cap ? old_cap * 2 : 256;
+
+    st->slots = calloc(cap, sizeof(SymSlot));
+    if (!st->slots) {
+        fprintf(stderr, "Fatal error: out of memory\n");
+        exit(1);
     }
-    return NULL;
+    st->slot_mask = cap - 1;
+
+    for (unsigned i = 0; i < old_cap; i++)
+        if (old[i].name != ATOM_NONE)
+            *find_slot(st, old[i].name) = old[i];
+    free(old);
 }
 
 
+void sym_init(SymbolTable *st) {
+    memset(st, 0, sizeof(*st));
+    arena_init(&st->records);
+}
+
+
+void sym_free(SymbolTable *st) {
+    free(st->slots);
+    free(st->undo);
+    free(st->scope_marks);
+    arena_free(&st->records);
+    memset(st, 0, sizeof(*st));
+}
+
+
+void sym_reset(SymbolTable *st) {
+    if (st->slots)
+        memset(st->slots, 0, (st->slot_mask + 1) * sizeof(SymSlot));
+    st->slot_used = 0;
+    st->undo_len = 0;
+    st->current_scope = 0;
+    arena_reset(&st->records);
+}
 
-Symbol *sym_lookup(const char *name) {
-    for (Symbol *s = symbol_table; s; s = s->next) {
-        if (strcmp(s->name, name) == 0)
-            return s;
+
+void sym_enter_scope(SymbolTable *st) {
+    st->current_scope++;
+    if (st->current_scope >= st->marks_cap) {
+        st->marks_cap = st->marks_cap ? st->marks_cap * 2 : 64;
+        st->scope_marks = xrealloc(st->scope_marks, st->marks_cap * sizeof(int));
+    }
+    st->scope_marks[st->current_scope] = st->undo_len;
+}
+
+void sym_exit_scope(SymbolTable *st) {
+    int mark = st->scope_marks[st->current_scope];
+
+    // Unwind only the bindings made in this scope, newest first
+    while (st->undo_len > mark) {
+        Symbol *s = st->undo[--st->undo_len];
+        find_slot(st, s->name)->sym = s->shadowed;
     }
-    return NULL;
+    st->current_scope--;
 }
 
 
-void sym_insert(const char *name, SymbolType type) {
-    if (sym_lookup_current_scope(name)) {
-        fprintf(stderr, "Semantic error: redeclaration of '%s'\n", name);
-        semantic_errors++;
-        return;
+Symbol *sym_lookup(const SymbolTable *st, Atom name) {
+    if (!st->slots) return NULL;
+    return find_slot(st, name)->sym;
+}
+
+
+int sym_insert(SymbolTable *st, Atom name, SymbolType type) {
+    Symbol *prev = sym_lookup(st, name);
+    if (prev && prev->scope_level == st->current_scope)
+        return 0;
+
+    // Keep the load factor under one half
+    if (!st->slots || (st->slot_used + 1) * 2 > st->slot_mask + 1)
+        grow_slots(st);
+
+    SymSlot *slot = find_slot(st, name);
+    if (slot->name == ATOM_NONE) {
+        slot->name = name;
+        st->slot_used++;
     }
 
-    // Create new symbol and add to front of list
-    Symbol *sym = malloc(sizeof(Symbol));
-    sym->name = strdup(name);
+    Symbol *sym = arena_alloc(&st->records, sizeof(Symbol));
+    sym->name = name;
     sym->type = type;
-    sym->scope_level = current_scope;
-    sym->next = symbol_table;
-    symbol_table = sym;
+    sym->scope_level = st->current_scope;
+    sym->shadowed = slot->sym;
+    slot->sym = sym;
+
+    if (st->undo_len == st->undo_cap) {
+        st->undo_cap = st->undo_cap ? st->undo_cap * 2 : 256;
+        st->undo = xrealloc(st->undo, st->undo_cap * sizeof(Symbol *));
+    }
+    st->undo[st->undo_len++] = sym;
+    return 1;
+}
+
+
+static void declare(CompilerContext *ctx, Atom name, SymbolType type) {
+    if (!sym_insert(&ctx->symbols, name, type)) {
+        diag_error(ctx, "Semantic error: redeclaration of '%s'\n",
+            atom_str(name));
+        ctx->semantic_errors++;
+    }
 }
 
 
@@ -77,40 +156,52 @@ static SymbolType ast_to_sym(ValueType v) {
 }
 
 
+static ValueType sym_to_ast(SymbolType s) {
+    switch (s) {
+        case SYM_INT: return TYPE_INT;
+        case SYM_FLOAT: return TYPE_FLOAT;
+        case SYM_CHAR: return TYPE_CHAR;
+        case SYM_STRING: return TYPE_STRING;
+    }
+    return TYPE_INT;
+}
+
+
 static int is_numeric(SymbolType t) {
     return t == SYM_INT || t == SYM_FLOAT;
 }
 
 
-static SymbolType check_expr(ASTNode *node) {
-    if (!node) return SYM_INT;
+static SymbolType check_expr(CompilerContext *ctx, NodeId n) {
+    const AST *t = &ctx->ast;
+    if (!n) return SYM_INT;
 
-    switch (node->type) {
+    switch (t->kind[n]) {
         case NODE_LITERAL:
-            return ast_to_sym(node->vtype);
+            return ast_to_sym(t->aux[n]);
 
         case NODE_ID: {
-            Symbol *s = sym_lookup(node->name);
+            Symbol *s = sym_lookup(&ctx->symbols, t->a[n]);
             if (!s) {
-                fprintf(stderr,
+                diag_error(ctx,
                     "Semantic error: variable '%s' not declared\n",
-                    node->name);
-                semantic_errors++;
+                    atom_str(t->a[n]));
+                ctx->semantic_errors++;
                 return SYM_INT;
             }
             return s->type;
         }
 
         case NODE_BINOP: {
-            SymbolType l = check_expr(node->left);
-            SymbolType r = check_expr(node->right);
+            SymbolType l = check_expr(ctx, t->a[n]);
+            SymbolType r = check_expr(ctx, t->b[n]);
 
 
             if (!is_numeric(l) || !is_numeric(r)) {
-                fprintf(stderr,
+                diag_error(ctx,
                     "Semantic error: invalid operands for '%c'\n",
-                    node->op);
-                semantic_errors++;
+                    t->aux[n]);
+                ctx->semantic_errors++;
             }
 
 
@@ -124,45 +215,52 @@ static SymbolType check_expr(ASTNode *node) {
 }
 
 
-static void check_stmt(ASTNode *node) {
-    if (!node) return;
+static void check_stmt(CompilerContext *ctx, NodeId n) {
+    const AST *t = &ctx->ast;
+    SymbolTable *st = &ctx->symbols;
+    if (!n) return;
 
-    switch (node->type) {
-        case NODE_STMT_LIST:
-            check_stmt(node->left);
-            check_stmt(node->right);
+    switch (t->kind[n]) {
+        case NODE_STMT_LIST: {
+            const NodeId *items = ast_items(t, n);
+            for (unsigned i = 0; i < t->b[n]; i++)
+                check_stmt(ctx, items[i]);
             break;
+        }
 
         case NODE_DECL: {
-            SymbolType t = check_expr(node->left);
-            sym_insert(node->name, t);
+            SymbolType type = check_expr(ctx, t->b[n]);
+            declare(ctx, t->a[n], type);
             break;
         }
 
         case NODE_PRINT:
-
-            check_expr(node->left);
+            // The back end picks how to print from the checked type
+            ctx->ast.aux[n] = sym_to_ast(check_expr(ctx, t->a[n]));
             break;
 
-        case NODE_BLOCK:
-            sym_enter_scope();
-            check_stmt(node->body);
-            sym_exit_scope();
+        case NODE_BLOCK: {
+            const NodeId *items = ast_items(t, n);
+            sym_enter_scope(st);
+            for (unsigned i = 0; i < t->b[n]; i++)
+                check_stmt(ctx, items[i]);
+            sym_exit_scope(st);
             break;
+        }
 
         case NODE_IF:
-            check_expr(node->cond);
-            check_stmt(node->body);
-            check_stmt(node->else_body);
+            check_expr(ctx, t->a[n]);
+            check_stmt(ctx, t->b[n]);
+            check_stmt(ctx, t->c[n]);
             break;
 
         case NODE_FOR:
-            sym_enter_scope();
-            sym_insert(node->name, SYM_INT);
-            check_expr(node->left);
-            check_expr(node->right);
-            check_stmt(node->body);
-            sym_exit_scope();
+            sym_enter_scope(st);
+            declare(ctx, t->a[n], SYM_INT);
+            check_expr(ctx, t->b[n]);
+            check_expr(ctx, ast_for_to(t, n));
+            check_stmt(ctx, ast_for_body(t, n));
+            sym_exit_scope(st);
             break;
 
         default:
@@ -171,18 +269,31 @@ static void check_stmt(ASTNode *node) {
 }
 
 
-void semantic_check(ASTNode *root) {
-    semantic_errors = 0;
-    symbol_table = NULL;
-    current_scope = 0;
+void semantic_begin(CompilerContext *ctx) {
+    ctx->semantic_errors = 0;
+    sym_reset(&ctx->symbols);
+    sym_enter_scope(&ctx->symbols);
+}
+
+
+void semantic_check_stmt(CompilerContext *ctx, NodeId n) {
+    check_stmt(ctx, n);
+}
 
-    sym_enter_scope();
-    check_stmt(root);
-    sym_exit_scope();
 
+int semantic_end(CompilerContext *ctx) {
+    sym_exit_scope(&ctx->symbols);
 
-    if (semantic_errors == 0)
-        printf("Semantic analysis successful\n");
+    if (ctx->semantic_errors == 0)
+        diag_status(ctx, "Semantic analysis successful\n");
     else
-        printf("Semantic analysis failed (%d errors)\n", semantic_errors);
+        diag_status(ctx, "Semantic analysis failed (%d errors)\n", ctx->semantic_errors);
+    return ctx->semantic_errors;
+}
+
+
+int semantic_check(CompilerContext *ctx) {
+    semantic_begin(ctx);
+    check_stmt(ctx, ctx->ast.root);
+    return semantic_end(ctx);
 }
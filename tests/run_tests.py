@@ -0,0 +1,83 @@
+"""Regression tests.
+
+Every tests/*.no is compiled to assembly, run with --run and run with
+--interpret. Both runs must print what tests/<name>.out holds and exit
+with the status in tests/<name>.rc (0 when there is none); the messages
+the compiler prints are ignored. A program whose .out is missing only
+has to compile and run the same both ways.
+
+    python tests/run_tests.py         # from the directory holding nova.exe
+    python tests/run_tests.py --lexer=flex --parser=bison
+
+Options after the script name are passed to every compiler run, so the
+same tests cover the generated scanner and parser.
+
+`make test` builds the compiler and runs them.
+"""
+
+import glob
+import os
+import subprocess
+import sys
+import tempfile
+
+COMPILER = os.path.abspath('nova.exe')
+TESTS = os.path.dirname(os.path.abspath(__file__))
+TIMEOUT = 30    # seconds per compiler run
+OPTIONS = sys.argv[1:]
+
+
+def read(path, default=None):
+    if not os.path.exists(path):
+        return default
+    with open(path, 'rb') as f:
+        return f.read()
+
+
+def run(args):
+    result = subprocess.run([COMPILER] + OPTIONS + args,
+                            stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                            timeout=TIMEOUT)
+    return result.returncode, result.stdout
+
+
+def check(source, workdir):
+    """What went wrong with one test, or None."""
+    name = os.path.splitext(source)[0]
+    expected = read(name + '.out')
+    status = int(read(name + '.rc', b'0'))
+
+    rc, _ = run(['-o', os.path.join(workdir, 'out.asm'), source])
+    if rc != 0:
+        return 'does not compile (status %d)' % rc
+
+    outputs = {}
+    for mode in ('--run', '--interpret'):
+        rc, out = run([mode, source])
+        if rc != status:
+            return '%s exits with %d, expected %d' % (mode, rc, status)
+        if expected is not None and out != expected:
+            return '%s prints %r, expected %r' % (mode, out[:60], expected[:60])
+        outputs[mode] = out
+    if outputs['--run'] != outputs['--interpret']:
+        return '--run and --interpret print different output'
+    return None
+
+
+def main():
+    sources = sorted(glob.glob(os.path.join(TESTS, '*.no')))
+    failed = 0
+    with tempfile.TemporaryDirectory() as workdir:
+        for source in sources:
+            try:
+                problem = check(source, workdir)
+            except subprocess.TimeoutExpired:
+                problem = 'timed out'
+            print('%-40s %s' % (os.path.basename(source), problem or 'ok'))
+            failed += problem is not None
+    print('%d of %d failed' % (failed, len(sources)))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,553 @@
+#include "ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Bytecode interpreter: a portable way to run a checked program on the
+ * host, and a reference to hold the code generators to.
+ *
+ * The bytecode is three-address code over registers. Every variable
+ * gets one register for the whole program (the environment is flat, as
+ * in the generated code), expression temporaries are stacked above them
+ * and a for loop's bound keeps its temporary until the loop ends.
+ *
+ * Values follow the 8086 code: 16-bit wrap-around, signed compares,
+ * unsigned divide, print as an unsigned number. A string is held as
+ * VM_STR plus its index, above any number, so print can tell the two
+ * apart.
+ *
+ * Conditions compile to fused compare-and-branch instructions, with an
+ * immediate form when the right operand is a constant, and a loop's
+ * increment, test and back edge are one FORLOOP. Dispatch is threaded
+ * through a label table with GCC's computed goto, or a switch elsewhere.
+ */
+
+enum {
+    VM_HALT,
+    VM_LOADK,       // a = c
+    VM_MOV,         // a = b
+    VM_ADD,         // a = b op c
+    VM_SUB,
+    VM_MUL,
+    VM_DIV,
+    VM_POW,
+    VM_ADDK,        // a = b op constant c
+    VM_SUBK,
+    VM_MULK,
+    VM_GT,          // a = b cmp c ? 1 : 0
+    VM_LT,
+    VM_GE,
+    VM_LE,
+    VM_EQ,
+    VM_NE,
+    VM_JMP,         // goto c
+    VM_JZ,          // if a == 0 goto c
+    VM_JGT,         // if a cmp b goto c
+    VM_JLT,
+    VM_JGE,
+    VM_JLE,
+    VM_JEQ,
+    VM_JNE,
+    VM_JGTK,        // if a cmp constant b goto c
+    VM_JLTK,
+    VM_JGEK,
+    VM_JLEK,
+    VM_JEQK,
+    VM_JNEK,
+    VM_FORLOOP,     // a = a + 1; if a <= b goto c
+    VM_FORLOOPK,    // the same with a constant bound b
+    VM_PRINT,       // print a
+    VM_PRINTS,      // print string c
+    VM_NUM_OPS
+};
+
+#define VM_STR 0x10000
+
+
+static _Thread_local VmProgram *prog;
+static _Thread_local int *reg_of = NULL;          // by atom, -1 = no register yet
+static _Thread_local int *str_of = NULL;          // by atom, -1 = not pooled yet
+static _Thread_local int reg_cap = 0;
+static _Thread_local int nvars;
+static _Thread_local int top;                     // next free temporary
+static _Thread_local int floor_reg;               // temporaries below are in use
+
+
+void vm_init(VmProgram *p) {
+    memset(p, 0, sizeof(*p));
+}
+
+
+void vm_free(VmProgram *p) {
+    free(p->code);
+    free(p->strings);
+    vm_init(p);
+}
+
+
+static int emit(int op, int a, int b, int c) {
+    if (prog->len == prog->cap) {
+        prog->cap = prog->cap ? prog->cap * 2 : 1024;
+        prog->code = xrealloc(prog->code, prog->cap * sizeof(VmInsn));
+    }
+    VmInsn *in = &prog->code[prog->len];
+    in->op = op;
+    in->a = a;
+    in->b = b;
+    in->c = c;
+    return prog->len++;
+}
+
+static void patch(int at) {
+    prog->code[at].c = prog->len;
+}
+
+
+static int add_string(Atom s) {
+    if (str_of[s] >= 0)
+        return str_of[s];
+    if (prog->nstrings == prog->str_cap) {
+        prog->str_cap = prog->str_cap ? prog->str_cap * 2 : 64;
+        prog->strings = xrealloc(prog->strings, prog->str_cap * sizeof(Atom));
+    }
+    prog->strings[prog->nstrings] = s;
+    str_of[s] = prog->nstrings;
+    return prog->nstrings++;
+}
+
+
+static int temp(void) {
+    int r = top++;
+    if (top > prog->nregs)
+        prog->nregs = top;
+    return r;
+}
+
+
+/* ---- Registers for variables ---- */
+
+static void name_var(Atom a) {
+    if (reg_of[a] < 0)
+        reg_of[a] = nvars++;
+}
+
+static void collect_vars(const AST *t, NodeId n) {
+    if (!n) return;
+
+    switch (t->kind[n]) {
+        case NODE_STMT_LIST:
+        case NODE_BLOCK:
+            for (unsigned i = 0; i < t->b[n]; i++)
+                collect_vars(t, t->extra[t->a[n] + i]);
+            break;
+
+        case NODE_DECL:
+            name_var(t->a[n]);
+            collect_vars(t, t->b[n]);
+            break;
+
+        case NODE_PRINT:
+            collect_vars(t, t->a[n]);
+            break;
+
+        case NODE_IF:
+            collect_vars(t, t->a[n]);
+            collect_vars(t, t->b[n]);
+            collect_vars(t, t->c[n]);
+            break;
+
+        case NODE_FOR:
+            name_var(t->a[n]);
+            collect_vars(t, t->b[n]);
+            collect_vars(t, ast_for_to(t, n));
+            collect_vars(t, ast_for_body(t, n));
+            break;
+
+        case NODE_BINOP:
+            collect_vars(t, t->a[n]);
+            collect_vars(t, t->b[n]);
+            break;
+
+        case NODE_ID:
+            name_var(t->a[n]);
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+/* ---- Expressions ---- */
+
+static int is_const(const AST *t, NodeId n) {
+    return t->kind[n] == NODE_LITERAL && t->aux[n] != TYPE_STRING;
+}
+
+static int const_value(const AST *t, NodeId n) {
+    return (short)t->a[n];
+}
+
+static int binop_op(char op) {
+    switch (op) {
+        case '+': return VM_ADD;
+        case '-': return VM_SUB;
+        case '*': return VM_MUL;
+        case '/': return VM_DIV;
+        case '^': return VM_POW;
+        case '>': return VM_GT;
+        case '<': return VM_LT;
+        case 'G': return VM_GE;
+        case 'L': return VM_LE;
+        case 'E': return VM_EQ;
+        default:  return VM_NE;
+    }
+}
+
+// Computes n into dst, or into any register when dst is -1
+static int expr(const AST *t, NodeId n, int dst) {
+    switch (t->kind[n]) {
+        case NODE_ID: {
+            int r = reg_of[t->a[n]];
+            if (dst < 0 || dst == r)
+                return r;
+            emit(VM_MOV, dst, r, 0);
+            return dst;
+        }
+
+        case NODE_LITERAL: {
+            int d = dst >= 0 ? dst : temp();
+            if (t->aux[n] == TYPE_STRING)
+                emit(VM_LOADK, d, 0, VM_STR + add_string(t->a[n]));
+            else
+                emit(VM_LOADK, d, 0, const_value(t, n));
+            return d;
+        }
+
+        case NODE_BINOP: {
+            int op = binop_op(t->aux[n]);
+            int l = expr(t, t->a[n], -1);
+
+            if (op <= VM_MUL && is_const(t, t->b[n])) {
+                int d = dst >= 0 ? dst : temp();
+                emit(op - VM_ADD + VM_ADDK, d, l, const_value(t, t->b[n]));
+                return d;
+            }
+
+            int r = expr(t, t->b[n], -1);
+            int d = dst >= 0 ? dst : temp();
+            emit(op, d, l, r);
+            return d;
+        }
+
+        default: {
+            int d = dst >= 0 ? dst : temp();
+            emit(VM_LOADK, d, 0, 0);
+            return d;
+        }
+    }
+}
+
+// Jump taken when the compare does not hold, as an offset from VM_JGT
+static int negate(int cmp) {
+    switch (cmp) {
+        case VM_GT: return VM_JLE - VM_JGT;
+        case VM_LT: return VM_JGE - VM_JGT;
+        case VM_GE: return VM_JLT - VM_JGT;
+        case VM_LE: return VM_JGT - VM_JGT;
+        case VM_EQ: return VM_JNE - VM_JGT;
+        default:    return VM_JEQ - VM_JGT;
+    }
+}
+
+// Emits a jump taken when n is false and returns it for patching
+static int jump_unless(const AST *t, NodeId n) {
+    if (t->kind[n] == NODE_BINOP) {
+        int op = binop_op(t->aux[n]);
+        if (op >= VM_GT) {
+            int l = expr(t, t->a[n], -1);
+            if (is_const(t, t->b[n]))
+                return emit(VM_JGTK + negate(op), l, const_value(t, t->b[n]), 0);
+            int r = expr(t, t->b[n], -1);
+            return emit(VM_JGT + negate(op), l, r, 0);
+        }
+    }
+    return emit(VM_JZ, expr(t, n, -1), 0, 0);
+}
+
+
+/* ---- Statements ---- */
+
+static void stmt(const AST *t, NodeId n);
+
+/*
+ * for var = from to bound [ body ] becomes
+ *
+ *         var = from; limit = bound
+ *         if var > limit goto exit
+ *   body: ...
+ *         forloop var, limit, body
+ *   exit:
+ */
+static void for_stmt(const AST *t, NodeId n) {
+    int var = reg_of[t->a[n]];
+    NodeId bound = ast_for_to(t, n);
+
+    expr(t, t->b[n], var);
+
+    int saved_floor = floor_reg;
+    int limit = 0, k = is_const(t, bound);
+    int skip;
+    if (k) {
+        limit = const_value(t, bound);
+        skip = emit(VM_JGTK, var, limit, 0);
+    } else {
+        limit = expr(t, bound, -1);
+        if (limit >= nvars) {
+            floor_reg = limit + 1;
+        } else {
+            // The body may assign the variable the bound came from
+            int r = temp();
+            emit(VM_MOV, r, limit, 0);
+            limit = r;
+            floor_reg = r + 1;
+        }
+        skip = emit(VM_JGT, var, limit, 0);
+    }
+
+    int body = prog->len;
+    top = floor_reg;
+    stmt(t, ast_for_body(t, n));
+    emit(k ? VM_FORLOOPK : VM_FORLOOP, var, limit, body);
+    patch(skip);
+
+    floor_reg = saved_floor;
+}
+
+
+static void stmt(const AST *t, NodeId n) {
+    if (!n) return;
+    top = floor_reg;
+
+    switch (t->kind[n]) {
+        case NODE_STMT_LIST:
+        case NODE_BLOCK:
+            for (unsigned i = 0; i < t->b[n]; i++)
+                stmt(t, t->extra[t->a[n] + i]);
+            break;
+
+        case NODE_DECL:
+            expr(t, t->b[n], reg_of[t->a[n]]);
+            break;
+
+        case NODE_PRINT: {
+            NodeId e = t->a[n];
+            if (t->kind[e] == NODE_LITERAL && t->aux[e] == TYPE_STRING)
+                emit(VM_PRINTS, 0, 0, add_string(t->a[e]));
+            else
+                emit(VM_PRINT, expr(t, e, -1), 0, 0);
+            break;
+        }
+
+        case NODE_IF: {
+            int skip = jump_unless(t, t->a[n]);
+            stmt(t, t->b[n]);
+            if (t->c[n]) {
+                int over = emit(VM_JMP, 0, 0, 0);
+                patch(skip);
+                stmt(t, t->c[n]);
+                patch(over);
+            } else {
+                patch(skip);
+            }
+            break;
+        }
+
+        case NODE_FOR:
+            for_stmt(t, n);
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+void vm_compile(VmProgram *p, const AST *t) {
+    prog = p;
+    p->len = 0;
+    p->nstrings = 0;
+
+    int natoms = atom_count() + 1;
+    if (natoms > reg_cap) {
+        reg_cap = natoms * 2;
+        reg_of = xrealloc(reg_of, reg_cap * sizeof(int));
+        str_of = xrealloc(str_of, reg_cap * sizeof(int));
+    }
+    memset(reg_of, -1, natoms * sizeof(int));
+    memset(str_of, -1, natoms * sizeof(int));
+
+    nvars = 0;
+    collect_vars(t, t->root);
+    p->nregs = nvars;
+    top = floor_reg = nvars;
+
+    stmt(t, t->root);
+    emit(VM_HALT, 0, 0, 0);
+    prog = NULL;
+}
+
+
+/* ---- Execution ---- */
+
+static void put_number(FILE *out, unsigned v) {
+    char buf[8];
+    char *p = buf + sizeof(buf);
+    do {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    fwrite(p, 1, buf + sizeof(buf) - p, out);
+}
+
+static void put_value(const VmProgram *p, FILE *out, int v) {
+    if (v >= VM_STR) {
+        Atom s = p->strings[v - VM_STR];
+        fwrite(atom_str(s), 1, atom_len(s), out);
+    } else {
+        put_number(out, (unsigned short)v);
+    }
+}
+
+
+#if defined(__GNUC__)
+#define VM_THREADED 1
+#define CASE(op)    L_##op
+#define DISPATCH()  goto *labels[ip->op]
+#else
+#define VM_THREADED 0
+#define CASE(op)    case op
+#define DISPATCH()  goto dispatch
+#endif
+
+#define NEXT()      do { ip++; DISPATCH(); } while (0)
+#define JUMP_IF(cond) do { ip = (cond) ? code + ip->c : ip + 1; DISPATCH(); } while (0)
+
+
+int vm_run(const VmProgram *p, FILE *out) {
+    const VmInsn *code = p->code;
+    const VmInsn *ip = code;
+    int *r = calloc(p->nregs ? p->nregs : 1, sizeof(int));
+    int rc = 0;
+
+    if (!r) {
+        fprintf(stderr, "Fatal error: out of memory\n");
+        exit(1);
+    }
+
+#if VM_THREADED
+    static void *const labels[VM_NUM_OPS] = {
+        [VM_HALT] = &&L_VM_HALT,       [VM_LOADK] = &&L_VM_LOADK,
+        [VM_MOV] = &&L_VM_MOV,         [VM_ADD] = &&L_VM_ADD,
+        [VM_SUB] = &&L_VM_SUB,         [VM_MUL] = &&L_VM_MUL,
+        [VM_DIV] = &&L_VM_DIV,         [VM_POW] = &&L_VM_POW,
+        [VM_ADDK] = &&L_VM_ADDK,       [VM_SUBK] = &&L_VM_SUBK,
+        [VM_MULK] = &&L_VM_MULK,       [VM_GT] = &&L_VM_GT,
+        [VM_LT] = &&L_VM_LT,           [VM_GE] = &&L_VM_GE,
+        [VM_LE] = &&L_VM_LE,           [VM_EQ] = &&L_VM_EQ,
+        [VM_NE] = &&L_VM_NE,           [VM_JMP] = &&L_VM_JMP,
+        [VM_JZ] = &&L_VM_JZ,           [VM_JGT] = &&L_VM_JGT,
+        [VM_JLT] = &&L_VM_JLT,         [VM_JGE] = &&L_VM_JGE,
+        [VM_JLE] = &&L_VM_JLE,         [VM_JEQ] = &&L_VM_JEQ,
+        [VM_JNE] = &&L_VM_JNE,         [VM_JGTK] = &&L_VM_JGTK,
+        [VM_JLTK] = &&L_VM_JLTK,       [VM_JGEK] = &&L_VM_JGEK,
+        [VM_JLEK] = &&L_VM_JLEK,       [VM_JEQK] = &&L_VM_JEQK,
+        [VM_JNEK] = &&L_VM_JNEK,       [VM_FORLOOP] = &&L_VM_FORLOOP,
+        [VM_FORLOOPK] = &&L_VM_FORLOOPK, [VM_PRINT] = &&L_VM_PRINT,
+        [VM_PRINTS] = &&L_VM_PRINTS
+    };
+    DISPATCH();
+#else
+dispatch:
+    switch (ip->op) {
+#endif
+
+    CASE(VM_LOADK):  r[ip->a] = ip->c; NEXT();
+    CASE(VM_MOV):    r[ip->a] = r[ip->b]; NEXT();
+
+    CASE(VM_ADD):    r[ip->a] = (short)(r[ip->b] + r[ip->c]); NEXT();
+    CASE(VM_SUB):    r[ip->a] = (short)(r[ip->b] - r[ip->c]); NEXT();
+    CASE(VM_MUL):    r[ip->a] = (short)(r[ip->b] * r[ip->c]); NEXT();
+    CASE(VM_ADDK):   r[ip->a] = (short)(r[ip->b] + ip->c); NEXT();
+    CASE(VM_SUBK):   r[ip->a] = (short)(r[ip->b] - ip->c); NEXT();
+    CASE(VM_MULK):   r[ip->a] = (short)(r[ip->b] * ip->c); NEXT();
+
+    CASE(VM_DIV): {
+        unsigned short d = (unsigned short)r[ip->c];
+        if (!d) {
+            fprintf(stderr, "Runtime error: division by zero\n");
+            rc = 1;
+            goto done;
+        }
+        r[ip->a] = (short)((unsigned short)r[ip->b] / d);
+        NEXT();
+    }
+
+    CASE(VM_POW): {
+        int base = r[ip->b], v = 1;
+        for (int i = r[ip->c]; i > 0; i--)
+            v = (short)(v * base);
+        r[ip->a] = v;
+        NEXT();
+    }
+
+    CASE(VM_GT):     r[ip->a] = r[ip->b] > r[ip->c]; NEXT();
+    CASE(VM_LT):     r[ip->a] = r[ip->b] < r[ip->c]; NEXT();
+    CASE(VM_GE):     r[ip->a] = r[ip->b] >= r[ip->c]; NEXT();
+    CASE(VM_LE):     r[ip->a] = r[ip->b] <= r[ip->c]; NEXT();
+    CASE(VM_EQ):     r[ip->a] = r[ip->b] == r[ip->c]; NEXT();
+    CASE(VM_NE):     r[ip->a] = r[ip->b] != r[ip->c]; NEXT();
+
+    CASE(VM_JMP):    ip = code + ip->c; DISPATCH();
+    CASE(VM_JZ):     JUMP_IF(r[ip->a] == 0);
+    CASE(VM_JGT):    JUMP_IF(r[ip->a] > r[ip->b]);
+    CASE(VM_JLT):    JUMP_IF(r[ip->a] < r[ip->b]);
+    CASE(VM_JGE):    JUMP_IF(r[ip->a] >= r[ip->b]);
+    CASE(VM_JLE):    JUMP_IF(r[ip->a] <= r[ip->b]);
+    CASE(VM_JEQ):    JUMP_IF(r[ip->a] == r[ip->b]);
+    CASE(VM_JNE):    JUMP_IF(r[ip->a] != r[ip->b]);
+    CASE(VM_JGTK):   JUMP_IF(r[ip->a] > ip->b);
+    CASE(VM_JLTK):   JUMP_IF(r[ip->a] < ip->b);
+    CASE(VM_JGEK):   JUMP_IF(r[ip->a] >= ip->b);
+    CASE(VM_JLEK):   JUMP_IF(r[ip->a] <= ip->b);
+    CASE(VM_JEQK):   JUMP_IF(r[ip->a] == ip->b);
+    CASE(VM_JNEK):   JUMP_IF(r[ip->a] != ip->b);
+
+    CASE(VM_FORLOOP): {
+        int v = (short)(r[ip->a] + 1);
+        r[ip->a] = v;
+        JUMP_IF(v <= r[ip->b]);
+    }
+
+    CASE(VM_FORLOOPK): {
+        int v = (short)(r[ip->a] + 1);
+        r[ip->a] = v;
+        JUMP_IF(v <= ip->b);
+    }
+
+    CASE(VM_PRINT):  put_value(p, out, r[ip->a]); NEXT();
+    CASE(VM_PRINTS): put_value(p, out, VM_STR + ip->c); NEXT();
+
+    CASE(VM_HALT):   goto done;
+
+#if !VM_THREADED
+    }
+#endif
+
+done:
+    fflush(out);
+    free(r);
+    return rc;
+}
@@ -0,0 +1,303 @@
+#include "ast.h"
+#include <stdio.h>
+#include <string.h>
+
+
+/*
+ * x86-64 output for Linux: prints the instruction list selected by
+ * generate_code as GNU assembler text in Intel syntax, with a runtime
+ * that replaces the DOS services. print appends to a 4 KiB buffer that
+ * goes out through write(2) when it fills up and at exit, so a program
+ * costs a handful of system calls however much it prints.
+ *
+ * The result needs no libc:
+ *
+ *   gcc -nostdlib -static -o prog output.s
+ *
+ * Strings are stored with their length in front, spill slots are
+ * quadwords in .bss. R11 is free for the printer, which needs it to
+ * store a string address to memory.
+ */
+
+static _Thread_local OutBuf *out;
+
+static const char *reg64[NUM_REGS] = {
+    "rax", "rbx", "rcx", "rdx", "rsi", "rdi", NULL,
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+};
+
+static const char *reg32[NUM_REGS] = {
+    "eax", "ebx", "ecx", "edx", "esi", "edi", NULL,
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"
+};
+
+static const char *reg16[NUM_REGS] = {
+    "ax", "bx", "cx", "dx", "si", "di", NULL,
+    "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"
+};
+
+static const char *op_name[] = {
+    "nop", "", "mov", "add", "sub", "cmp", "xor", "shl", "shr", "mul",
+    "imul", "div", "movsx", "movzx", "inc", "push", "pop", "call", "int",
+    "jmp", "je", "jne", "jg", "jge", "jl", "jle"
+};
+
+static const char *label_name[LBL_KINDS] = {
+    "B", "E", "L_END", "EXIT"
+};
+
+static const char *proc_name[] = { "print_int", "pow_int", "print_str" };
+
+
+static void put_operand(const Operand *o, int bits) {
+    switch (o->kind) {
+        case O_REG:
+            ob_puts(out, bits == 16 ? reg16[o->val] :
+                         bits == 32 ? reg32[o->val] : reg64[o->val]);
+            break;
+        case O_IMM:
+            ob_int(out, o->val);
+            break;
+        case O_TMP:
+            ob_puts(out, bits == 16 ? "word ptr [rip + TMP_" : "qword ptr [rip + TMP_");
+            ob_int(out, o->val);
+            ob_putc(out, ']');
+            break;
+        case O_STR:
+            ob_puts(out, "[rip + STR_");
+            ob_int(out, o->val);
+            ob_putc(out, ']');
+            break;
+        case O_LABEL:
+            ob_puts(out, label_name[o->lbl]);
+            ob_putc(out, '_');
+            ob_int(out, o->val);
+            break;
+        case O_PROC:
+            ob_puts(out, proc_name[o->val]);
+            break;
+    }
+}
+
+static void put_insn(const char *op, const Operand *dst, int dbits,
+                     const Operand *src, int sbits) {
+    ob_puts(out, "    ");
+    ob_puts(out, op);
+    if (dst->kind != O_NONE) {
+        ob_putc(out, ' ');
+        put_operand(dst, dbits);
+    }
+    if (src && src->kind != O_NONE) {
+        ob_puts(out, ", ");
+        put_operand(src, sbits);
+    }
+    ob_putc(out, '\n');
+}
+
+static void print_code(const InsnList *c) {
+    static const Operand scratch = { O_REG, 0, R11 };
+
+    for (int i = 0; i < c->len; i++) {
+        const Insn *in = &c->items[i];
+
+        switch (in->op) {
+            case I_NOP:
+                break;
+
+            case I_LABEL:
+                put_operand(&in->dst, 64);
+                ob_puts(out, ":\n");
+                break;
+
+            case I_MOV:
+                // A string operand is an address, loaded relative to rip
+                if (in->src.kind == O_STR && in->dst.kind == O_REG) {
+                    put_insn("lea", &in->dst, 64, &in->src, 64);
+                } else if (in->src.kind == O_STR) {
+                    put_insn("lea", &scratch, 64, &in->src, 64);
+                    put_insn("mov", &in->dst, 64, &scratch, 64);
+                } else {
+                    put_insn("mov", &in->dst, 64, &in->src, 64);
+                }
+                break;
+
+            case I_MOVSX:
+                put_insn("movsx", &in->dst, 64, &in->src, 16);
+                break;
+
+            case I_MOVZX:
+                // Writing the 32-bit register clears the upper half
+                put_insn("movzx", &in->dst, 32, &in->src, 16);
+                break;
+
+            default:
+                put_insn(op_name[in->op], &in->dst, 64, &in->src, 64);
+                break;
+        }
+    }
+}
+
+
+static void put_string(Atom s) {
+    const char *p = atom_str(s);
+    unsigned n = atom_len(s);
+
+    ob_puts(out, "    .quad ");
+    ob_int(out, (int)n);
+    ob_puts(out, "\n    .ascii \"");
+    for (unsigned i = 0; i < n; i++) {
+        unsigned char ch = (unsigned char)p[i];
+        if (ch == '"' || ch == '\\') {
+            ob_putc(out, '\\');
+            ob_putc(out, (char)ch);
+        } else if (ch < 32 || ch > 126) {
+            ob_putc(out, '\\');
+            ob_putc(out, (char)('0' + (ch >> 6)));
+            ob_putc(out, (char)('0' + ((ch >> 3) & 7)));
+            ob_putc(out, (char)('0' + (ch & 7)));
+        } else {
+            ob_putc(out, (char)ch);
+        }
+    }
+    ob_puts(out, "\"\n");
+}
+
+
+/* Every routine preserves all registers except rax and r11 */
+static const char runtime[] =
+    "# Appends rdx bytes at rsi to the output buffer\n"
+    "out_write:\n"
+    "    mov rax, [rip + OUT_LEN]\n"
+    "    lea rcx, [rax + rdx]\n"
+    "    cmp rcx, 4096\n"
+    "    jbe 2f\n"
+    "    call flush\n"
+    "    xor eax, eax\n"
+    "    cmp rdx, 4096\n"
+    "    jbe 2f\n"
+    "    mov eax, 1\n"
+    "    mov edi, 1\n"
+    "    syscall\n"
+    "    ret\n"
+    "2:\n"
+    "    lea rdi, [rip + OUT_BUF]\n"
+    "    add rdi, rax\n"
+    "    add rax, rdx\n"
+    "    mov [rip + OUT_LEN], rax\n"
+    "    mov rcx, rdx\n"
+    "    rep movsb\n"
+    "    ret\n"
+    "\n"
+    "flush:\n"
+    "    push rcx\n"
+    "    push rdx\n"
+    "    push rsi\n"
+    "    push rdi\n"
+    "    mov eax, 1\n"
+    "    mov edi, 1\n"
+    "    lea rsi, [rip + OUT_BUF]\n"
+    "    mov rdx, [rip + OUT_LEN]\n"
+    "    syscall\n"
+    "    mov qword ptr [rip + OUT_LEN], 0\n"
+    "    pop rdi\n"
+    "    pop rsi\n"
+    "    pop rdx\n"
+    "    pop rcx\n"
+    "    ret\n"
+    "\n"
+    "# Prints the low word of rax as an unsigned number, like the 8086 code\n"
+    "print_int:\n"
+    "    push rcx\n"
+    "    push rdx\n"
+    "    push rsi\n"
+    "    push rdi\n"
+    "    sub rsp, 8\n"
+    "    movzx eax, ax\n"
+    "    lea rsi, [rsp + 8]\n"
+    "    mov ecx, 10\n"
+    "1:\n"
+    "    xor edx, edx\n"
+    "    div ecx\n"
+    "    add dl, '0'\n"
+    "    dec rsi\n"
+    "    mov [rsi], dl\n"
+    "    test eax, eax\n"
+    "    jnz 1b\n"
+    "    lea rdx, [rsp + 8]\n"
+    "    sub rdx, rsi\n"
+    "    call out_write\n"
+    "    add rsp, 8\n"
+    "    pop rdi\n"
+    "    pop rsi\n"
+    "    pop rdx\n"
+    "    pop rcx\n"
+    "    ret\n"
+    "\n"
+    "# rax points at a length-prefixed string\n"
+    "print_str:\n"
+    "    push rcx\n"
+    "    push rdx\n"
+    "    push rsi\n"
+    "    push rdi\n"
+    "    mov rdx, [rax]\n"
+    "    lea rsi, [rax + 8]\n"
+    "    call out_write\n"
+    "    pop rdi\n"
+    "    pop rsi\n"
+    "    pop rdx\n"
+    "    pop rcx\n"
+    "    ret\n";
+
+// rax = base ^ exponent, both pushed by the caller, base first
+static const char runtime_pow[] =
+    "\n"
+    "pow_int:\n"
+    "    push rcx\n"
+    "    mov rcx, [rsp + 16]\n"
+    "    mov eax, 1\n"
+    "1:\n"
+    "    test rcx, rcx\n"
+    "    jle 2f\n"
+    "    imul rax, [rsp + 24]\n"
+    "    dec rcx\n"
+    "    jmp 1b\n"
+    "2:\n"
+    "    movsx rax, ax\n"
+    "    pop rcx\n"
+    "    ret 16\n";
+
+
+void x64_write(OutBuf *ob, const InsnList *code, const Atom *strings,
+               int nstrings, int spills, int uses_pow) {
+    out = ob;
+    ob_puts(out, "    .intel_syntax noprefix\n");
+
+    ob_puts(out, "    .section .rodata\n");
+    for (int i = 0; i < nstrings; i++) {
+        ob_puts(out, "STR_");
+        ob_int(out, i);
+        ob_puts(out, ":\n");
+        put_string(strings[i]);
+    }
+
+    ob_puts(out, "    .bss\n    .align 8\n");
+    for (int i = 0; i < spills; i++) {
+        ob_puts(out, "TMP_");
+        ob_int(out, i);
+        ob_puts(out, ":\n    .zero 8\n");
+    }
+    ob_puts(out, "OUT_LEN:\n    .zero 8\n");
+    ob_puts(out, "OUT_BUF:\n    .zero 4096\n");
+
+    ob_puts(out, "    .text\n    .globl _start\n_start:\n");
+    print_code(code);
+    ob_puts(out, "    call flush\n");
+    ob_puts(out, "    mov eax, 60\n");
+    ob_puts(out, "    xor edi, edi\n");
+    ob_puts(out, "    syscall\n\n");
+
+    ob_puts(out, runtime);
+    if (uses_pow)
+        ob_puts(out, runtime_pow);
+    out = NULL;
+}